@@ -7,18 +7,61 @@
 #include <algorithm>
 #include <vector>
 #include <unordered_map>
+#include <map>
 #include <limits>
 #include <ctime>
+#include <cstring>
+#include <thread>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <array>
+#include <chrono>
+#include <cmath>
+#include <bit>
+#include <string_view>
+#include <random>
+#include <optional>
+
+#include <emmintrin.h>
 
 #include <stdio.h>
 #include <direct.h>
 #include <Windows.h>
+#include <Psapi.h>
+#include <malloc.h>
 
 #include "steam/steam_api.h"
 #include "nlohmann/json.hpp"
+#include "lzma/LzmaEnc.h"
+#include "lzma/LzmaDec.h"
 
 using json = nlohmann::ordered_json;
 
+// The fields of a workshop query result the tool uses. A full SteamUGCDetails_t is several KB of fixed buffers
+struct WorkshopItem
+{
+    PublishedFileId_t id = 0;
+    EWorkshopFileType file_type = k_EWorkshopFileTypeCommunity;
+    uint64 owner = 0;
+    uint32 time_updated = 0;
+    int32 file_size = 0;
+};
+
+// Lumps and game lump children left out of a map's output, and the bytes each lump saved
+struct LumpStrip
+{
+    uint64 lumps = 0;
+    std::vector<uint32> game_lumps;
+    std::array<uint64, 64> saved = {};
+
+    bool Enabled() const
+    {
+        return lumps || !game_lumps.empty();
+    }
+};
+
 struct BSPFileInfo
 {
     bool upload = false;
@@ -31,7 +74,10 @@ struct BSPFileInfo
     std::string output_path;
     std::string changelog;
     std::vector<std::string> assets;
-    SteamUGCDetails_t details = SteamUGCDetails_t();
+    LumpStrip strip;
+    std::string input_hash;
+    bool verified = false;
+    WorkshopItem workshop;
 };
 using BSPInfoList = std::vector<BSPFileInfo>;
 
@@ -47,8 +93,12 @@ enum ConsoleColors
     WHITE = 15
 };
 
+// Recursive so a caller can hold it across several prints that belong together
+static std::recursive_mutex g_ConsoleMutex;
+
 static void ConsolePrintf(ConsoleColors color, const char* format, ...)
 {
+    std::lock_guard<std::recursive_mutex> lock(g_ConsoleMutex);
     SetConsoleTextAttribute(g_Console, color);
     char buffer[1024];
     std::string text;
@@ -105,348 +155,7736 @@ static bool IsIntegerInRange(const int& val, const int& min, const int& max)
     return val >= min && val <= max;
 }
 
-struct Config
+static std::string ToLower(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+    return str;
+}
+
+static bool ReadFileContents(const std::string& path, std::vector<uint8>& data)
+{
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    if (stream.fail())
+        return false;
+
+    std::streamsize size = stream.tellg();
+    if (size < 0)
+        return false;
+
+    data.resize((size_t)size);
+    stream.seekg(0);
+    return size == 0 || !stream.read((char*)data.data(), size).fail();
+}
+
+static bool ReadFileRange(const std::string& path, uint64 offset, uint64 size, std::vector<uint8>& data)
+{
+    std::ifstream stream(path, std::ios::binary);
+    data.resize((size_t)size);
+    return !stream.fail() && (size == 0 || !stream.seekg((std::streamoff)offset).read((char*)data.data(), (std::streamsize)size).fail());
+}
+
+static bool WriteFileContents(const std::string& path, const uint8* data, size_t size)
+{
+    // Write to a temporary name first so an interrupted run never leaves a truncated file behind. The name is unique to
+    // this write, so threads or processes writing the same file at once each rename a whole copy into place
+    static std::atomic<uint32> next_temp = 0;
+    std::string temp_path(path + "." + std::to_string(GetCurrentProcessId()) + "_" + std::to_string(next_temp++) + ".tmp");
+    std::ofstream stream(temp_path, std::ios::binary | std::ios::trunc);
+    std::error_code ec;
+    if (stream.fail() || stream.write((const char*)data, size).fail())
+    {
+        stream.close();
+        std::filesystem::remove(temp_path, ec);
+        return false;
+    }
+
+    stream.close();
+    std::filesystem::rename(temp_path, path, ec);
+    if (!ec)
+        return true;
+
+    std::filesystem::remove(temp_path, ec);
+    return false;
+}
+
+// 64-bit xxHash, used to key caches by file content
+class XXHash64
 {
 
 public:
 
-    bool ParseConfig(const std::string& config_name, BSPInfoList& bsplist)
+    XXHash64(uint64 seed = 0)
     {
-        // Load json file
-        std::ifstream stream(config_name);
-        if (stream.fail())
+        acc[0] = seed + PRIME1 + PRIME2;
+        acc[1] = seed + PRIME2;
+        acc[2] = seed;
+        acc[3] = seed - PRIME1;
+        this->seed = seed;
+    }
+
+    void Update(const void* data, size_t size)
+    {
+        // An empty vector's data can be null, which mustn't reach memcpy
+        if (!size)
+            return;
+
+        const uint8* input = (const uint8*)data;
+        total_size += size;
+
+        if (buffer_size + size < sizeof(buffer))
         {
-            ConsolePrintf(RED, "Failed to open %s. Does the file exist?\n", config_name);
-            return false;
+            memcpy(buffer + buffer_size, input, size);
+            buffer_size += size;
+            return;
         }
 
-        ConsolePrintf(WHITE, "> Parsing Settings & Maps\n\n");
-
-        json data = json::parse(stream, nullptr, false, true);
-        if (data.is_discarded())
+        if (buffer_size)
         {
-            ConsolePrintf(RED, "Found syntax errors within config.json\n");
-            return false;
+            size_t fill = sizeof(buffer) - buffer_size;
+            memcpy(buffer + buffer_size, input, fill);
+            Consume(buffer);
+            input += fill;
+            size -= fill;
+            buffer_size = 0;
         }
-        
-        bool bSuccess = true;
-        if (!ParseSettings(data))
+
+        while (size >= sizeof(buffer))
         {
-            stream.close();
-            return false;
+            Consume(input);
+            input += sizeof(buffer);
+            size -= sizeof(buffer);
         }
 
-        if (!ParseMaps(data, bsplist))
+        memcpy(buffer, input, size);
+        buffer_size = size;
+    }
+
+    uint64 Digest() const
+    {
+        uint64 hash;
+        if (total_size >= sizeof(buffer))
         {
-            stream.close();
-            return false;
+            hash = Rotl(acc[0], 1) + Rotl(acc[1], 7) + Rotl(acc[2], 12) + Rotl(acc[3], 18);
+            for (uint64 value : acc)
+                hash = (hash ^ Round(0, value)) * PRIME1 + PRIME4;
         }
+        else
+            hash = seed + PRIME5;
 
-        if (!ParseSharedAssets(data))
+        hash += total_size;
+
+        const uint8* input = buffer;
+        size_t remaining = buffer_size;
+        for (; remaining >= 8; input += 8, remaining -= 8)
+            hash = Rotl(hash ^ Round(0, Read64(input)), 27) * PRIME1 + PRIME4;
+
+        if (remaining >= 4)
         {
-            stream.close();
-            return false;
+            uint32 value;
+            memcpy(&value, input, sizeof(value));
+            hash = Rotl(hash ^ (value * PRIME1), 23) * PRIME2 + PRIME3;
+            input += 4;
+            remaining -= 4;
         }
 
-        stream.close();
-        data.clear();
+        for (; remaining; ++input, --remaining)
+            hash = Rotl(hash ^ (*input * PRIME5), 11) * PRIME1;
 
-        ConsolePrintf(YELLOW, "- - - - - - - - - - < Settings > - - - - - - - - - -\n\n");
-        ConsolePrintf(AQUA, "Found bspzip.exe @: \"%s\"\n", bspzip_path.c_str());
-        ConsolePrintf(AQUA, "Outputting Maps @: \"%s\"\n", base_output_path.c_str());
-        ConsolePrintf(AQUA, force_map_compression ? "Forced BSP Compression: Enabled\n" : "Forced BSP Compression: Disabled\n");
-        ConsolePrintf(AQUA, upload_maps_to_workshop ? "Workshop Uploading: Enabled\n" : "Workshop Uploading: Disabled\n");
-        printf("\n");
+        hash ^= hash >> 33;
+        hash *= PRIME2;
+        hash ^= hash >> 29;
+        hash *= PRIME3;
+        hash ^= hash >> 32;
+        return hash;
+    }
 
-        ConsolePrintf(WHITE, "Enter \"y\" to confirm these settings. Enter anything else to abort: ");
-        std::string input;
-        std::cin >> input;
-        if (!(!input.compare("y")))
+private:
+
+    static constexpr uint64 PRIME1 = 0x9E3779B185EBCA87ULL;
+    static constexpr uint64 PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+    static constexpr uint64 PRIME3 = 0x165667B19E3779F9ULL;
+    static constexpr uint64 PRIME4 = 0x85EBCA77C2B2AE63ULL;
+    static constexpr uint64 PRIME5 = 0x27D4EB2F165667C5ULL;
+
+    static uint64 Rotl(uint64 value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64 Read64(const uint8* input)
+    {
+        uint64 value;
+        memcpy(&value, input, sizeof(value));
+        return value;
+    }
+
+    static uint64 Round(uint64 acc_value, uint64 input)
+    {
+        return Rotl(acc_value + input * PRIME2, 31) * PRIME1;
+    }
+
+    void Consume(const uint8* input)
+    {
+        for (int i = 0; i < 4; i++)
+            acc[i] = Round(acc[i], Read64(input + i * 8));
+    }
+
+    uint64 acc[4];
+    uint64 seed = 0;
+    uint64 total_size = 0;
+    uint8 buffer[32] = {};
+    size_t buffer_size = 0;
+};
+
+static std::string HashToString(uint64 hash)
+{
+    char buffer[17];
+    snprintf(buffer, sizeof(buffer), "%016llx", (unsigned long long)hash);
+    return buffer;
+}
+
+static uint64 HashData(const void* data, size_t size)
+{
+    XXHash64 hasher;
+    hasher.Update(data, size);
+    return hasher.Digest();
+}
+
+static bool HashFile(const std::string& path, uint64& hash)
+{
+    std::ifstream stream(path, std::ios::binary);
+    if (stream.fail())
+        return false;
+
+    XXHash64 hasher;
+    std::vector<char> buffer(1 << 20);
+    while (stream.read(buffer.data(), buffer.size()) || stream.gcount())
+        hasher.Update(buffer.data(), (size_t)stream.gcount());
+
+    hash = hasher.Digest();
+    return stream.eof();
+}
+
+static uint32 CRC32(const void* data, size_t size, uint32 crc = 0)
+{
+    static const auto table = []()
+    {
+        std::array<uint32, 256> values = {};
+        for (uint32 i = 0; i < 256; i++)
         {
-            ConsolePrintf(DEFAULT, "\n");
-            return false;
+            uint32 value = i;
+            for (int bit = 0; bit < 8; bit++)
+                value = (value >> 1) ^ ((value & 1) ? 0xEDB88320 : 0);
+            values[i] = value;
         }
+        return values;
+    }();
+
+    const uint8* bytes = (const uint8*)data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++)
+        crc = table[(crc ^ bytes[i]) & 0xFF] ^ (crc >> 8);
+    return ~crc;
+}
 
-        // Create a temporary asset.txt file for bspzip to read from
-        std::string temp_path(std::filesystem::temp_directory_path().string() + "multi_map_packer_and_uploader/");
-        FixSlashes(temp_path);
-        if (!std::filesystem::is_directory(temp_path) && !std::filesystem::create_directory(temp_path))
+// Bytes currently held by pakfile buffers and LZMA encoders, so packing memory can be bounded and reported
+class MemoryTracker
+{
+
+public:
+
+    void Add(int64 bytes)
+    {
+        int64 now = current += bytes;
+        int64 previous = peak.load();
+        while (now > previous && !peak.compare_exchange_weak(previous, now)) {}
+    }
+
+    int64 Current() const
+    {
+        return current;
+    }
+
+    int64 Peak() const
+    {
+        return peak;
+    }
+
+private:
+
+    std::atomic<int64> current = 0;
+    std::atomic<int64> peak = 0;
+};
+
+static MemoryTracker g_PackMemory;
+
+enum ProfileStage
+{
+    PROFILE_STAGE_STARTUP,
+    PROFILE_STAGE_CONFIG,
+    PROFILE_STAGE_SCANNING,
+    PROFILE_STAGE_PLANNING,
+    PROFILE_STAGE_WORKSHOP_QUERY,
+    PROFILE_STAGE_PACKING,
+    PROFILE_STAGE_UPLOADING,
+    PROFILE_STAGE_FINISHING,
+    PROFILE_STAGE_COUNT,
+    PROFILE_STAGE_PROCESS = PROFILE_STAGE_COUNT
+};
+
+static const char* g_ProfileStageNames[PROFILE_STAGE_COUNT] = { "startup", "config", "scanning", "planning", "workshop_query", "packing", "uploading", "finishing" };
+
+// Counts heap allocations per pipeline stage once enabled, by hooking the global operator new and delete, and samples
+// the working set so each stage's peak can be told apart. Threads run in the process's current stage unless a scope
+// puts them in another, like the upload loop running beside packing. Only frees of blocks allocated while profiling are
+// counted, so the heap never drops below where it started. Blocks don't record their stage, so frees count toward the
+// stage of the thread doing them
+class AllocationProfiler
+{
+
+public:
+
+    // Puts the calling thread in a stage until the scope ends
+    class Scope
+    {
+
+    public:
+
+        Scope(AllocationProfiler& profiler, ProfileStage stage) : profiler(profiler), previous(thread_stage)
         {
-            ConsolePrintf(RED, "Failed to create a temp directory at %s\n", temp_path.c_str());
-            return false;
+            thread_stage = stage;
+            profiler.stages[stage].scopes++;
         }
 
-        std::string temp_assets_file(temp_path + "assets.txt");
-        std::ofstream asset_stream(temp_assets_file);
-        if (asset_stream.fail())
+        ~Scope()
         {
-            ConsolePrintf(RED, "Failed to create a file at the file path %s\n", temp_path.c_str());
-            return false;
+            profiler.EndStage(thread_stage);
+            profiler.stages[thread_stage].scopes--;
+            thread_stage = previous;
         }
 
-        // Copy maps to output directory
-        ConsolePrintf(YELLOW, "\n - - - - - - - - - - Packing Maps - - - - - - - - - - \n\n");
+    private:
 
-        for (BSPFileInfo& info : bsplist)
-        {
-            if (info.ignore_assets)
-            {
-                ConsolePrintf(AQUA, "%s (Ignored Assets)                    \n\n", info.name.c_str());
-                continue;
-            }
+        AllocationProfiler& profiler;
+        ProfileStage previous;
+    };
 
-            std::string temp_bsp(temp_path + info.name + ".bsp");
-            if (!std::filesystem::copy_file(info.source_path, temp_bsp, std::filesystem::copy_options::overwrite_existing))
-            {
-                ConsolePrintf(RED, "Failed to write a temp bsp at %s", temp_bsp.c_str());
-                asset_stream.close();
-                return false;
-            }
-                
+    ~AllocationProfiler()
+    {
+        Stop();
+    }
 
-            asset_stream.clear();
-            asset_stream.seekp(0);
+    void Enable()
+    {
+        if (Enabled())
+            return;
 
-            for (std::string asset : info.assets)
-            {
-                asset_stream << asset.c_str() << std::endl;
-            }
-            
-            for (std::string asset : shared_assets)
+        stages[stage].entered = true;
+        enabled = true;
+        sampler = std::thread([this]()
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping)
             {
-                asset_stream << asset.c_str() << std::endl;
+                SampleRSS();
+                stop_signal.wait_for(lock, std::chrono::milliseconds(50));
             }
+        });
+    }
 
-            std::string decompress("-repack \"" + temp_bsp + "\"");
-            std::string pack("-addlist \"" + temp_bsp + "\" \"" + temp_assets_file + "\" \"" + info.output_path + "\"");
-            std::string compress("-repack -compress \"" + info.output_path + "\"");
-            FixSlashes(decompress);
-            FixSlashes(pack);
-            FixSlashes(compress);
-
-            SHELLEXECUTEINFOA si = SHELLEXECUTEINFOA();
-            si.cbSize = sizeof(SHELLEXECUTEINFOA);
-            si.fMask = SEE_MASK_NOCLOSEPROCESS;
-            si.lpVerb = "open";
-            si.nShow = SW_HIDE;
-            si.lpFile = bspzip_path.c_str();
-            si.lpParameters = decompress.c_str();
+    bool Enabled() const
+    {
+        return enabled.load(std::memory_order_relaxed);
+    }
 
-            ConsolePrintf(YELLOW, "%s (Decompressing)...            \r", info.name.c_str());
-            if (!ShellExecuteExA(&si))
-            {
-                asset_stream.close();
-                ConsolePrintf(RED, "Failed to run command on bspzip.exe \"%s\"\n", decompress.c_str());
-                return false;
-            }
+    // Moves the process to a new stage
+    void SetStage(ProfileStage new_stage)
+    {
+        if (!Enabled())
+            return;
 
-            if (WaitForSingleObjectEx(si.hProcess, INFINITE, true) != 0)
-            {
-                asset_stream.close();
-                ConsolePrintf(RED, "Failed to wait for bspzip.exe to finish the decompress operation\n");
-                return false;
-            }
+        SampleRSS();
+        EndStage(stage);
+        stages[new_stage].entered = true;
+        stage = new_stage;
+    }
 
-            if (info.assets.size())
-            {
-                ConsolePrintf(YELLOW, "%s (Packing)...                    \r", info.name.c_str());
-                si.lpParameters = pack.c_str();
-                if (!ShellExecuteExA(&si))
-                {
-                    asset_stream.close();
-                    ConsolePrintf(RED, "Failed to run command on bspzip.exe \"%s\"\n", pack.c_str());
-                    return false;
-                }
+    void OnAllocate(size_t size)
+    {
+        StageCounters& counters = stages[thread_stage == PROFILE_STAGE_PROCESS ? stage.load(std::memory_order_relaxed) : thread_stage];
+        counters.allocations.fetch_add(1, std::memory_order_relaxed);
+        counters.allocated_bytes.fetch_add(size, std::memory_order_relaxed);
 
-                if (WaitForSingleObjectEx(si.hProcess, INFINITE, true) != 0)
-                {
-                    asset_stream.close();
-                    ConsolePrintf(RED, "Failed to wait for bspzip.exe to finish the addlist operation\n");
-                    return false;
-                }
-            }
+        int64 now = heap.fetch_add((int64)size, std::memory_order_relaxed) + (int64)size;
+        int64 previous = counters.peak_heap.load(std::memory_order_relaxed);
+        while (now > previous && !counters.peak_heap.compare_exchange_weak(previous, now, std::memory_order_relaxed)) {}
+    }
 
-            if (info.compress || force_map_compression)
-            {
-                ConsolePrintf(YELLOW, "%s (Compressing)...                    \r", info.name.c_str());
-                si.lpParameters = compress.c_str();
-                if (!ShellExecuteExA(&si))
-                {
-                    asset_stream.close();
-                    ConsolePrintf(RED, "Failed to run command on bspzip.exe \"%s.\"\n", compress.c_str());
-                    return false;
-                }
+    void OnFree(size_t size)
+    {
+        StageCounters& counters = stages[thread_stage == PROFILE_STAGE_PROCESS ? stage.load(std::memory_order_relaxed) : thread_stage];
+        counters.frees.fetch_add(1, std::memory_order_relaxed);
+        counters.freed_bytes.fetch_add(size, std::memory_order_relaxed);
+        heap.fetch_sub((int64)size, std::memory_order_relaxed);
+    }
 
-                if (WaitForSingleObjectEx(si.hProcess, INFINITE, true) != 0)
-                {
-                    asset_stream.close();
-                    ConsolePrintf(RED, "Failed to wait for bspzip.exe to finish the compress operation\n");
-                    return false;
-                }
-            }
+    // Stops counting, so reporting doesn't count itself
+    void Stop()
+    {
+        if (!sampler.joinable())
+            return;
 
-            ConsolePrintf(AQUA, "%s (Completed)                      \n\n", info.name.c_str());
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
         }
 
-        asset_stream.close();
+        stop_signal.notify_all();
+        sampler.join();
+        SampleRSS();
+        EndStage(stage);
+        enabled = false;
+    }
 
-        if (std::filesystem::is_directory(temp_path))
-            std::filesystem::remove_all(temp_path);
+    void Print()
+    {
+        ConsolePrintf(YELLOW, "\n- - - - - - - - - - < Memory Profile > - - - - - - - - - -\n\n");
+        ConsolePrintf(AQUA, "%-16s %12s %12s %12s %12s %12s %12s\n", "Stage", "Allocations", "Alloc MB", "Freed MB", "Peak Heap MB", "End Heap MB", "Peak RSS MB");
+        for (int i = 0; i < PROFILE_STAGE_COUNT; i++)
+        {
+            const StageCounters& counters = stages[i];
+            if (!counters.entered)
+                continue;
 
-        return true;
+            ConsolePrintf(WHITE, "%-16s %12llu %12.1f %12.1f %12.1f %12.1f %12.1f\n", g_ProfileStageNames[i], counters.allocations.load(), counters.allocated_bytes / 1048576.0,
+                counters.freed_bytes / 1048576.0, counters.peak_heap / 1048576.0, counters.heap_at_end / 1048576.0, counters.peak_rss / 1048576.0);
+        }
+
+        ConsolePrintf(AQUA, "\nPeak working set of the process: %.1f MB\n", PeakRSS() / 1048576.0);
+        ConsolePrintf(WHITE, "Heap sizes only count memory allocated after profiling started, and LZMA encoders. Output buffers aren't on the heap, but are in the working set\n\n");
     }
-    
-    std::string bspzip_path;
-    std::string base_output_path;
-    bool upload_maps_to_workshop = false;
 
-private:
+    // Stops profiling, prints the table and exports it if there's a path
+    void Report(const std::string& export_path)
+    {
+        if (!Enabled())
+            return;
 
-    bool ParseSettings(const json& data)
+        Stop();
+        Print();
+        if (!export_path.empty())
+            Export(export_path);
+    }
+
+    bool Export(const std::string& path)
     {
-        if (!data.contains("settings"))
+        json data;
+        data["peak_rss_bytes"] = PeakRSS();
+        for (int i = 0; i < PROFILE_STAGE_COUNT; i++)
         {
-            ConsolePrintf(RED, "Failed to find the \"settings\" key\n");
-            return false;
+            const StageCounters& counters = stages[i];
+            if (!counters.entered)
+                continue;
+
+            json& stage_data = data["stages"][g_ProfileStageNames[i]];
+            stage_data["allocations"] = counters.allocations.load();
+            stage_data["allocated_bytes"] = counters.allocated_bytes.load();
+            stage_data["frees"] = counters.frees.load();
+            stage_data["freed_bytes"] = counters.freed_bytes.load();
+            stage_data["peak_heap_bytes"] = counters.peak_heap.load();
+            stage_data["heap_at_end_bytes"] = counters.heap_at_end.load();
+            stage_data["peak_rss_bytes"] = counters.peak_rss.load();
         }
 
-        // Path to bspzip.exe
-        const json settings = data["settings"];
-        if (!settings.contains("bspzip_path"))
+        std::string text = data.dump(4);
+        if (WriteFileContents(path, (const uint8*)text.data(), text.size()))
+            return true;
+
+        ConsolePrintf(RED, "Failed to write the memory profile to %s\n", path.c_str());
+        return false;
+    }
+
+private:
+
+    struct StageCounters
+    {
+        std::atomic<uint64> allocations = 0;
+        std::atomic<uint64> allocated_bytes = 0;
+        std::atomic<uint64> frees = 0;
+        std::atomic<uint64> freed_bytes = 0;
+        std::atomic<int64> peak_heap = 0;
+        std::atomic<int64> heap_at_end = 0;
+        std::atomic<uint64> peak_rss = 0;
+        std::atomic<int32> scopes = 0;
+        std::atomic<bool> entered = false;
+    };
+
+    static uint64 PeakRSS()
+    {
+        PROCESS_MEMORY_COUNTERS counters = {};
+        counters.cb = sizeof(counters);
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+        return counters.PeakWorkingSetSize;
+    }
+
+    void EndStage(ProfileStage ended)
+    {
+        stages[ended].entered = true;
+        stages[ended].heap_at_end = heap.load();
+    }
+
+    // The working set counts toward the process's stage and every stage a thread is scoped to
+    void SampleRSS()
+    {
+        PROCESS_MEMORY_COUNTERS memory = {};
+        memory.cb = sizeof(memory);
+        GetProcessMemoryInfo(GetCurrentProcess(), &memory, sizeof(memory));
+
+        for (int i = 0; i < PROFILE_STAGE_COUNT; i++)
         {
-            ConsolePrintf(RED, "Failed to find settings key \"bspzip_path\"\n");
-            return false;
+            StageCounters& counters = stages[i];
+            if (i != stage && !counters.scopes)
+                continue;
+
+            uint64 previous = counters.peak_rss.load();
+            while (memory.WorkingSetSize > previous && !counters.peak_rss.compare_exchange_weak(previous, memory.WorkingSetSize)) {}
         }
-        
-        if (!settings["bspzip_path"].is_string())
-        {
-            ConsolePrintf(RED, "The value of \"bspzip_path\" must have a string value\n");
-            return false;
+    }
+
+    static thread_local ProfileStage thread_stage;
+
+    std::atomic<bool> enabled = false;
+    std::atomic<ProfileStage> stage = PROFILE_STAGE_STARTUP;
+    std::atomic<int64> heap = 0;
+    StageCounters stages[PROFILE_STAGE_COUNT];
+
+    std::thread sampler;
+    std::mutex mutex;
+    std::condition_variable stop_signal;
+    bool stopping = false;
+};
+
+thread_local ProfileStage AllocationProfiler::thread_stage = PROFILE_STAGE_PROCESS;
+
+static AllocationProfiler g_AllocProfiler;
+
+// Put before every block, keeping the alignment malloc gives, so a free knows whether its block was counted
+struct AllocationHeader
+{
+    uint64 size;
+    uint64 profiled;
+};
+
+static_assert(sizeof(AllocationHeader) == 16, "AllocationHeader must keep blocks 16 byte aligned");
+
+// Replaced so allocations can be profiled. Costs a header and a single check while profiling is off
+static void* ProfiledAllocate(size_t size)
+{
+    AllocationHeader* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+    if (!header)
+        return nullptr;
+
+    header->size = size;
+    header->profiled = g_AllocProfiler.Enabled();
+    if (header->profiled)
+        g_AllocProfiler.OnAllocate(size);
+
+    return header + 1;
+}
+
+static void ProfiledFree(void* block)
+{
+    if (!block)
+        return;
+
+    AllocationHeader* header = (AllocationHeader*)block - 1;
+    if (header->profiled && g_AllocProfiler.Enabled())
+        g_AllocProfiler.OnFree(header->size);
+
+    free(header);
+}
+
+void* operator new(size_t size)
+{
+    void* block = ProfiledAllocate(size);
+    if (!block)
+        throw std::bad_alloc();
+
+    return block;
+}
+
+void* operator new[](size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+    return ProfiledAllocate(size);
+}
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept
+{
+    return ProfiledAllocate(size);
+}
+
+void operator delete(void* block) noexcept
+{
+    ProfiledFree(block);
+}
+
+void operator delete[](void* block) noexcept
+{
+    ProfiledFree(block);
+}
+
+void operator delete(void* block, size_t) noexcept
+{
+    ProfiledFree(block);
+}
+
+void operator delete[](void* block, size_t) noexcept
+{
+    ProfiledFree(block);
+}
+
+void operator delete(void* block, const std::nothrow_t&) noexcept
+{
+    ProfiledFree(block);
+}
+
+void operator delete[](void* block, const std::nothrow_t&) noexcept
+{
+    ProfiledFree(block);
+}
+
+struct MetricsSettings
+{
+    bool enabled = false;
+    std::string path;
+    uint32 interval_seconds = 5;
+};
+
+// Tracks the progress of a run and periodically rewrites it to a file in the Prometheus text format, for a node
+// exporter's textfile collector or anything else that can scrape a file
+class Metrics
+{
+
+public:
+
+    ~Metrics()
+    {
+        Stop();
+    }
+
+    void Start(const MetricsSettings& metrics_settings)
+    {
+        settings = metrics_settings;
+        if (!settings.enabled)
+            return;
+
+        run_start = std::chrono::steady_clock::now();
+        last_progress = std::time(nullptr);
+        writer = std::thread([this]()
+        {
+            // The file is written outside the lock, so a slow disk never holds up the workers reporting progress
+            std::unique_lock<std::mutex> lock(mutex);
+            while (!stopping)
+            {
+                std::string text = FormatLocked();
+                lock.unlock();
+                Write(text);
+                lock.lock();
+                stop_signal.wait_for(lock, std::chrono::seconds(settings.interval_seconds), [this]() { return stopping; });
+            }
+        });
+    }
+
+    // Writes the final values and stops the writer
+    void Stop()
+    {
+        if (!writer.joinable())
+            return;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+
+        stop_signal.notify_all();
+        writer.join();
+
+        std::string text;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            text = FormatLocked();
+        }
+
+        Write(text);
+
+        // Reported once here rather than on every failed write
+        if (write_failed)
+            ConsolePrintf(RED, "Failed to write metrics to %s\n", settings.path.c_str());
+    }
+
+    // Moves a map to a new stage, recording how long it spent in the previous one. Stages that end a map's run aren't timed
+    void SetStage(const std::string& map, const char* stage, bool timed = true)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto now = std::chrono::steady_clock::now();
+        MapStage& current = maps[map];
+        if (current.stage && current.timed)
+            stage_latency[current.stage].Observe(std::chrono::duration<double>(now - current.start).count());
+
+        current.stage = stage;
+        current.start = now;
+        current.timed = timed;
+        last_progress = std::time(nullptr);
+    }
+
+    void CountMap(bool failed)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        (failed ? maps_failed : maps_completed)++;
+        last_progress = std::time(nullptr);
+    }
+
+    void AddBytesPacked(uint64 bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        bytes_packed += bytes;
+        last_progress = std::time(nullptr);
+    }
+
+    void SetUploadProgress(uint64 bytes)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        upload_in_progress = bytes;
+        last_progress = std::time(nullptr);
+    }
+
+    void CountUploadRetry()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        upload_in_progress = 0;
+        upload_retries++;
+        last_progress = std::time(nullptr);
+    }
+
+    void AddUpload(uint64 bytes, double seconds, bool failed)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        upload_in_progress = 0;
+        last_progress = std::time(nullptr);
+        (failed ? uploads_failed : uploads_completed)++;
+        if (failed)
+            return;
+
+        bytes_uploaded += bytes;
+        upload_seconds += seconds;
+    }
+
+private:
+
+    struct Histogram
+    {
+        static constexpr double bounds[] = { 1, 5, 15, 30, 60, 120, 300, 600, 1800 };
+        uint64 buckets[std::size(bounds)] = {};
+        uint64 count = 0;
+        double sum = 0.0;
+
+        void Observe(double value)
+        {
+            for (size_t i = 0; i < std::size(bounds); i++)
+                if (value <= bounds[i])
+                    buckets[i]++;
+
+            count++;
+            sum += value;
+        }
+    };
+
+    struct MapStage
+    {
+        const char* stage = nullptr;
+        std::chrono::steady_clock::time_point start;
+        bool timed = false;
+    };
+
+    static std::string EscapeLabel(const std::string& value)
+    {
+        std::string escaped;
+        for (char c : value)
+        {
+            if (c == '\\' || c == '"')
+                escaped += '\\';
+
+            escaped += c == '\n' ? 'n' : c;
+        }
+
+        return escaped;
+    }
+
+    // Formats every value while the lock is held, so the snapshot is consistent
+    std::string FormatLocked()
+    {
+        PROCESS_MEMORY_COUNTERS counters = {};
+        counters.cb = sizeof(counters);
+        GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters));
+
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - run_start).count();
+        double throughput = upload_seconds > 0.0 ? bytes_uploaded / upload_seconds : 0.0;
+
+        std::string text;
+        char line[512];
+        auto metric = [&](const char* name, const char* type, const char* help, double value)
+        {
+            snprintf(line, sizeof(line), "# HELP %s %s\n# TYPE %s %s\n%s %.17g\n", name, help, name, type, name, value);
+            text += line;
+        };
+
+        metric("mmpu_maps_completed_total", "counter", "Maps packed successfully.", (double)maps_completed);
+        metric("mmpu_maps_failed_total", "counter", "Maps that failed to pack.", (double)maps_failed);
+        metric("mmpu_bytes_packed_total", "counter", "Bytes of packed bsps written.", (double)bytes_packed);
+        metric("mmpu_uploads_completed_total", "counter", "Maps uploaded to the workshop.", (double)uploads_completed);
+        metric("mmpu_uploads_failed_total", "counter", "Workshop uploads that failed.", (double)uploads_failed);
+        metric("mmpu_upload_retries_total", "counter", "Workshop uploads retried after a transient failure.", (double)upload_retries);
+        metric("mmpu_bytes_uploaded_total", "counter", "Bytes uploaded to the workshop, including the current upload.", (double)(bytes_uploaded + upload_in_progress));
+        metric("mmpu_upload_throughput_bytes_per_second", "gauge", "Average speed of completed uploads.", throughput);
+        metric("mmpu_peak_rss_bytes", "gauge", "Peak working set of the process.", (double)counters.PeakWorkingSetSize);
+        metric("mmpu_peak_pack_memory_bytes", "gauge", "Peak memory of the packing buffers and encoders.", (double)g_PackMemory.Peak());
+        metric("mmpu_run_seconds", "gauge", "Seconds since the run started.", elapsed);
+        metric("mmpu_last_progress_timestamp_seconds", "gauge", "Unix time of the last progress any map or upload made.", (double)last_progress);
+
+        text += "# HELP mmpu_map_stage The stage each map is currently in.\n# TYPE mmpu_map_stage gauge\n";
+        for (const auto& [map, stage] : maps)
+        {
+            snprintf(line, sizeof(line), "mmpu_map_stage{map=\"%s\",stage=\"%s\"} 1\n", EscapeLabel(map).c_str(), stage.stage);
+            text += line;
+        }
+
+        text += "# HELP mmpu_stage_duration_seconds How long maps spent in each stage.\n# TYPE mmpu_stage_duration_seconds histogram\n";
+        for (const auto& [stage, histogram] : stage_latency)
+        {
+            for (size_t i = 0; i < std::size(Histogram::bounds); i++)
+            {
+                snprintf(line, sizeof(line), "mmpu_stage_duration_seconds_bucket{stage=\"%s\",le=\"%g\"} %llu\n", stage.c_str(), Histogram::bounds[i], histogram.buckets[i]);
+                text += line;
+            }
+
+            snprintf(line, sizeof(line), "mmpu_stage_duration_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n", stage.c_str(), histogram.count);
+            text += line;
+            snprintf(line, sizeof(line), "mmpu_stage_duration_seconds_sum{stage=\"%s\"} %.17g\nmmpu_stage_duration_seconds_count{stage=\"%s\"} %llu\n", stage.c_str(), histogram.sum, stage.c_str(), histogram.count);
+            text += line;
+        }
+
+        return text;
+    }
+
+    // Only called by the writer, or once it has stopped
+    void Write(const std::string& text)
+    {
+        if (!WriteFileContents(settings.path, (const uint8*)text.data(), text.size()))
+            write_failed = true;
+    }
+
+    MetricsSettings settings;
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable stop_signal;
+    bool stopping = false;
+    bool write_failed = false;
+    std::chrono::steady_clock::time_point run_start;
+    time_t last_progress = 0;
+
+    std::map<std::string, MapStage> maps;
+    std::map<std::string, Histogram> stage_latency;
+    uint64 maps_completed = 0;
+    uint64 maps_failed = 0;
+    uint64 bytes_packed = 0;
+    uint64 uploads_completed = 0;
+    uint64 uploads_failed = 0;
+    uint64 upload_retries = 0;
+    uint64 bytes_uploaded = 0;
+    uint64 upload_in_progress = 0;
+    double upload_seconds = 0.0;
+};
+
+static Metrics g_Metrics;
+
+static void* LzmaAllocFunc(ISzAllocPtr, size_t size)
+{
+    // Prefixed the same as any other block so frees can be accounted for
+    AllocationHeader* header = (AllocationHeader*)malloc(sizeof(AllocationHeader) + size);
+    if (!header)
+        return nullptr;
+
+    header->size = size;
+    header->profiled = g_AllocProfiler.Enabled();
+    g_PackMemory.Add((int64)size);
+    if (header->profiled)
+        g_AllocProfiler.OnAllocate(size);
+
+    return header + 1;
+}
+
+static void LzmaFreeFunc(ISzAllocPtr, void* address)
+{
+    if (!address)
+        return;
+
+    AllocationHeader* header = (AllocationHeader*)address - 1;
+    g_PackMemory.Add(-(int64)header->size);
+    if (header->profiled && g_AllocProfiler.Enabled())
+        g_AllocProfiler.OnFree(header->size);
+
+    free(header);
+}
+
+static const ISzAlloc g_LzmaAlloc = { LzmaAllocFunc, LzmaFreeFunc };
+
+// Compresses a buffer into a raw LZMA stream. Returns false if the result wouldn't be smaller than the input
+static bool LZMACompress(const uint8* data, size_t size, std::vector<uint8>& out, uint8 (&props)[LZMA_PROPS_SIZE], int level = 5, uint32 dictionary_size = 1 << 24)
+{
+    if (!size)
+        return false;
+
+    CLzmaEncProps enc_props;
+    LzmaEncProps_Init(&enc_props);
+    enc_props.level = level;
+    enc_props.dictSize = dictionary_size;
+    enc_props.reduceSize = size;
+    enc_props.numThreads = 1;
+
+    out.resize(size);
+    SizeT out_size = size;
+    SizeT props_size = LZMA_PROPS_SIZE;
+    if (LzmaEncode(out.data(), &out_size, data, size, &enc_props, props, &props_size, 0, nullptr, &g_LzmaAlloc, &g_LzmaAlloc) != SZ_OK || out_size >= size)
+        return false;
+
+    out.resize(out_size);
+    return true;
+}
+
+// Picks the largest LZMA dictionary whose encoder (roughly 12 bytes per dictionary byte plus fixed tables) fits the budget
+static uint32 LZMADictionaryForBudget(uint64 budget)
+{
+    uint32 dictionary_size = 1 << 16;
+    while (dictionary_size < (1 << 24) && (uint64)dictionary_size * 2 * 12 + (4 << 20) <= budget)
+        dictionary_size *= 2;
+
+    return dictionary_size;
+}
+
+struct LzmaInStream
+{
+    ISeqInStream vt;
+    std::istream* stream;
+    uint64 remaining;
+    uint32 crc;
+    bool failed;
+};
+
+static SRes LzmaInStreamRead(ISeqInStreamPtr p, void* buf, size_t* size)
+{
+    LzmaInStream* self = (LzmaInStream*)p;
+    size_t wanted = (size_t)std::min<uint64>(*size, self->remaining);
+    if (wanted && self->stream->read((char*)buf, wanted).fail())
+    {
+        self->failed = true;
+        return SZ_ERROR_READ;
+    }
+
+    self->crc = CRC32(buf, wanted, self->crc);
+    self->remaining -= wanted;
+    *size = wanted;
+    return SZ_OK;
+}
+
+struct LzmaOutStream
+{
+    ISeqOutStream vt;
+    std::ostream* stream;
+    uint64 written;
+    uint64 limit;
+    bool overflow;
+};
+
+static size_t LzmaOutStreamWrite(ISeqOutStreamPtr p, const void* buf, size_t size)
+{
+    LzmaOutStream* self = (LzmaOutStream*)p;
+    if (self->written + size > self->limit)
+    {
+        // Not worth finishing, the caller will store the data instead
+        self->overflow = true;
+        return 0;
+    }
+
+    if (self->stream->write((const char*)buf, size).fail())
+        return 0;
+
+    self->written += size;
+    return size;
+}
+
+struct LZMAStreamResult
+{
+    bool success = false;
+    bool read_error = false;
+    uint64 written = 0;
+    uint32 crc = 0;
+    uint8 props[LZMA_PROPS_SIZE] = {};
+};
+
+// Compresses [offset, offset + size) of a stream straight into the output without buffering it. Gives up once more than limit bytes would be written
+static LZMAStreamResult LZMACompressStream(std::istream& source, uint64 offset, uint64 size, std::ostream& output, uint64 limit, uint32 dictionary_size)
+{
+    LZMAStreamResult result;
+    CLzmaEncHandle encoder = LzmaEnc_Create(&g_LzmaAlloc);
+    if (!encoder)
+        return result;
+
+    CLzmaEncProps enc_props;
+    LzmaEncProps_Init(&enc_props);
+    enc_props.level = 5;
+    enc_props.dictSize = dictionary_size;
+    enc_props.reduceSize = size;
+    enc_props.numThreads = 1;
+
+    SizeT props_size = LZMA_PROPS_SIZE;
+    LzmaInStream in = { { LzmaInStreamRead }, &source, size, 0, false };
+    LzmaOutStream out = { { LzmaOutStreamWrite }, &output, 0, limit, false };
+    source.clear();
+    source.seekg(offset);
+    if (LzmaEnc_SetProps(encoder, &enc_props) == SZ_OK && LzmaEnc_WriteProperties(encoder, result.props, &props_size) == SZ_OK)
+        result.success = LzmaEnc_Encode(encoder, &out.vt, &in.vt, nullptr, &g_LzmaAlloc, &g_LzmaAlloc) == SZ_OK && !out.overflow && !in.remaining;
+
+    LzmaEnc_Destroy(encoder, &g_LzmaAlloc, &g_LzmaAlloc);
+    result.read_error = in.failed;
+    result.written = out.written;
+    result.crc = in.crc;
+    return result;
+}
+
+// Decompresses a raw LZMA stream whose decompressed size is known, which is how Source stores them
+static bool LZMADecompress(const uint8* data, size_t size, const uint8* props, uint8* out, size_t out_size)
+{
+    SizeT in_size = size;
+    SizeT decompressed_size = out_size;
+    ELzmaStatus status;
+    return LzmaDecode(out, &decompressed_size, data, &in_size, props, LZMA_PROPS_SIZE, LZMA_FINISH_ANY, &status, &g_LzmaAlloc) == SZ_OK && decompressed_size == out_size;
+}
+
+// Decompresses [offset, offset + size) of a stream straight into the output, through a buffer split between the
+// compressed and the decompressed data
+static bool LZMADecompressStream(std::istream& source, uint64 offset, uint64 size, const uint8* props, uint64 out_size, std::ostream& output, uint8* buffer, size_t buffer_size, uint32* crc = nullptr)
+{
+    CLzmaDec decoder;
+    LzmaDec_Construct(&decoder);
+    if (LzmaDec_Allocate(&decoder, props, LZMA_PROPS_SIZE, &g_LzmaAlloc) != SZ_OK)
+        return false;
+
+    LzmaDec_Init(&decoder);
+    source.clear();
+    source.seekg(offset);
+
+    size_t half = buffer_size / 2;
+    uint8* in = buffer;
+    uint8* out = buffer + half;
+    size_t in_pos = 0, in_size = 0;
+    bool success = true;
+    while (success && out_size)
+    {
+        if (in_pos == in_size && size)
+        {
+            in_pos = 0;
+            in_size = (size_t)std::min<uint64>(half, size);
+            size -= in_size;
+            if (source.read((char*)in, in_size).fail())
+                break;
+        }
+
+        SizeT in_length = in_size - in_pos;
+        SizeT out_length = (SizeT)std::min<uint64>(half, out_size);
+        ELzmaStatus status;
+        SRes result = LzmaDec_DecodeToBuf(&decoder, out, &out_length, in + in_pos, &in_length, LZMA_FINISH_ANY, &status);
+        in_pos += in_length;
+        out_size -= out_length;
+
+        // Running out of input before the output is complete means the data was cut short
+        success = result == SZ_OK && (in_length || out_length) && !output.write((const char*)out, out_length).fail();
+        if (crc)
+            *crc = CRC32(out, out_length, *crc);
+    }
+
+    LzmaDec_Free(&decoder, &g_LzmaAlloc);
+    return success && !out_size;
+}
+
+// Shannon entropy of a buffer in bits per byte
+static double ByteEntropy(const uint8* data, size_t size)
+{
+    if (!size)
+        return 0.0;
+
+    uint32 histogram[256] = {};
+    for (size_t i = 0; i < size; i++)
+        ++histogram[data[i]];
+
+    double entropy = 0.0;
+    for (uint32 count : histogram)
+    {
+        if (!count)
+            continue;
+
+        double p = count / (double)size;
+        entropy -= p * std::log2(p);
+    }
+
+    return entropy;
+}
+
+static std::string GetExtension(const std::string& path)
+{
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return "";
+
+    return ToLower(path.substr(dot));
+}
+
+enum VTFImageFormat
+{
+    VTF_FORMAT_RGBA8888 = 0,
+    VTF_FORMAT_ABGR8888 = 1,
+    VTF_FORMAT_RGB888 = 2,
+    VTF_FORMAT_BGR888 = 3,
+    VTF_FORMAT_RGB565 = 4,
+    VTF_FORMAT_I8 = 5,
+    VTF_FORMAT_IA88 = 6,
+    VTF_FORMAT_P8 = 7,
+    VTF_FORMAT_A8 = 8,
+    VTF_FORMAT_RGB888_BLUESCREEN = 9,
+    VTF_FORMAT_BGR888_BLUESCREEN = 10,
+    VTF_FORMAT_ARGB8888 = 11,
+    VTF_FORMAT_BGRA8888 = 12,
+    VTF_FORMAT_DXT1 = 13,
+    VTF_FORMAT_DXT3 = 14,
+    VTF_FORMAT_DXT5 = 15,
+    VTF_FORMAT_BGRX8888 = 16,
+    VTF_FORMAT_BGR565 = 17,
+    VTF_FORMAT_BGRX5551 = 18,
+    VTF_FORMAT_BGRA4444 = 19,
+    VTF_FORMAT_DXT1_ONEBITALPHA = 20,
+    VTF_FORMAT_BGRA5551 = 21,
+    VTF_FORMAT_UV88 = 22,
+    VTF_FORMAT_UVWQ8888 = 23,
+    VTF_FORMAT_RGBA16161616F = 24,
+    VTF_FORMAT_RGBA16161616 = 25,
+    VTF_FORMAT_UVLX8888 = 26,
+    VTF_FORMAT_NONE = 0xFFFFFFFF
+};
+
+enum VTFTextureFlags
+{
+    VTF_FLAG_NORMAL = 0x80,
+    VTF_FLAG_NOMIP = 0x100,
+    VTF_FLAG_ONEBITALPHA = 0x1000,
+    VTF_FLAG_EIGHTBITALPHA = 0x2000,
+    VTF_FLAG_ENVMAP = 0x4000
+};
+
+enum VTFTargetFormat
+{
+    VTF_TARGET_KEEP,
+    VTF_TARGET_AUTO,
+    VTF_TARGET_DXT1,
+    VTF_TARGET_DXT5
+};
+
+#pragma pack(push, 1)
+struct VTFHeader
+{
+    char signature[4];
+    uint32 version[2];
+    uint32 header_size;
+    uint16 width;
+    uint16 height;
+    uint32 flags;
+    uint16 frames;
+    uint16 first_frame;
+    uint8 padding0[4];
+    float reflectivity[3];
+    uint8 padding1[4];
+    float bumpmap_scale;
+    uint32 high_res_format;
+    uint8 mipmap_count;
+    uint32 low_res_format;
+    uint8 low_res_width;
+    uint8 low_res_height;
+    uint16 depth;
+    uint8 padding2[3];
+    uint32 num_resources;
+    uint8 padding3[8];
+};
+
+struct VTFResourceEntry
+{
+    uint8 tag[3];
+    uint8 flags;
+    uint32 offset;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(VTFHeader) == 80, "VTFHeader must match the on-disk 7.3 header layout");
+
+struct VTFRule
+{
+    std::string folder;
+    VTFTargetFormat format = VTF_TARGET_AUTO;
+    uint32 max_resolution = 0;
+    bool skip_normal_maps = true;
+};
+
+struct VTFSettings
+{
+    bool enabled = false;
+    uint32 threads = 0;
+    std::string cache_path;
+    std::vector<VTFRule> rules;
+};
+
+// Returns the byte size of one image (a single mip of a single frame/face/slice), or 0 for unsupported formats
+static size_t VTFImageSize(uint32 format, uint32 width, uint32 height)
+{
+    size_t blocks = (size_t)((width + 3) / 4) * ((height + 3) / 4);
+    size_t pixels = (size_t)width * height;
+    switch (format)
+    {
+        case VTF_FORMAT_DXT1:
+        case VTF_FORMAT_DXT1_ONEBITALPHA:
+            return blocks * 8;
+        case VTF_FORMAT_DXT3:
+        case VTF_FORMAT_DXT5:
+            return blocks * 16;
+        case VTF_FORMAT_I8:
+        case VTF_FORMAT_P8:
+        case VTF_FORMAT_A8:
+            return pixels;
+        case VTF_FORMAT_RGB565:
+        case VTF_FORMAT_IA88:
+        case VTF_FORMAT_BGR565:
+        case VTF_FORMAT_BGRX5551:
+        case VTF_FORMAT_BGRA4444:
+        case VTF_FORMAT_BGRA5551:
+        case VTF_FORMAT_UV88:
+            return pixels * 2;
+        case VTF_FORMAT_RGB888:
+        case VTF_FORMAT_BGR888:
+        case VTF_FORMAT_RGB888_BLUESCREEN:
+        case VTF_FORMAT_BGR888_BLUESCREEN:
+            return pixels * 3;
+        case VTF_FORMAT_RGBA8888:
+        case VTF_FORMAT_ABGR8888:
+        case VTF_FORMAT_ARGB8888:
+        case VTF_FORMAT_BGRA8888:
+        case VTF_FORMAT_BGRX8888:
+        case VTF_FORMAT_UVWQ8888:
+        case VTF_FORMAT_UVLX8888:
+            return pixels * 4;
+        case VTF_FORMAT_RGBA16161616F:
+        case VTF_FORMAT_RGBA16161616:
+            return pixels * 8;
+        default:
+            return 0;
+    }
+}
+
+static bool IsVTFFormatEncodable(uint32 format)
+{
+    switch (format)
+    {
+        case VTF_FORMAT_RGBA8888:
+        case VTF_FORMAT_ABGR8888:
+        case VTF_FORMAT_RGB888:
+        case VTF_FORMAT_BGR888:
+        case VTF_FORMAT_BGRA8888:
+        case VTF_FORMAT_BGRX8888:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void DecodeToRGBA(const uint8* src, uint32 format, size_t pixels, uint8* dst)
+{
+    for (size_t i = 0; i < pixels; i++, dst += 4)
+    {
+        switch (format)
+        {
+            case VTF_FORMAT_RGBA8888: dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = src[3]; src += 4; break;
+            case VTF_FORMAT_ABGR8888: dst[0] = src[3]; dst[1] = src[2]; dst[2] = src[1]; dst[3] = src[0]; src += 4; break;
+            case VTF_FORMAT_BGRA8888: dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = src[3]; src += 4; break;
+            case VTF_FORMAT_BGRX8888: dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = 255; src += 4; break;
+            case VTF_FORMAT_RGB888: dst[0] = src[0]; dst[1] = src[1]; dst[2] = src[2]; dst[3] = 255; src += 3; break;
+            case VTF_FORMAT_BGR888: dst[0] = src[2]; dst[1] = src[1]; dst[2] = src[0]; dst[3] = 255; src += 3; break;
+            default: break;
+        }
+    }
+}
+
+static uint16 PackRGB565(uint32 color)
+{
+    uint32 r = color & 0xFF, g = (color >> 8) & 0xFF, b = (color >> 16) & 0xFF;
+    return (uint16)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+static uint32 UnpackRGB565(uint16 color)
+{
+    uint32 r = (color >> 11) & 31, g = (color >> 5) & 63, b = color & 31;
+    r = (r << 3) | (r >> 2);
+    g = (g << 2) | (g >> 4);
+    b = (b << 3) | (b >> 2);
+    return r | (g << 8) | (b << 16);
+}
+
+static uint32 LerpColor(uint32 a, uint32 b, uint32 wa, uint32 wb)
+{
+    uint32 result = 0;
+    for (int shift = 0; shift < 24; shift += 8)
+        result |= ((((a >> shift) & 0xFF) * wa + ((b >> shift) & 0xFF) * wb) / (wa + wb)) << shift;
+    return result;
+}
+
+// Squared RGB distance between four RGBA pixels and one palette color, computed in 16-bit lanes
+static __m128i ColorDistance4(__m128i pixels, __m128i color)
+{
+    const __m128i zero = _mm_setzero_si128();
+    __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(pixels, zero), _mm_unpacklo_epi8(color, zero));
+    __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(pixels, zero), _mm_unpackhi_epi8(color, zero));
+    lo = _mm_madd_epi16(lo, lo);
+    hi = _mm_madd_epi16(hi, hi);
+    __m128i even = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(2, 0, 2, 0)));
+    __m128i odd = _mm_castps_si128(_mm_shuffle_ps(_mm_castsi128_ps(lo), _mm_castsi128_ps(hi), _MM_SHUFFLE(3, 1, 3, 1)));
+    return _mm_add_epi32(even, odd);
+}
+
+static __m128i SelectEpi32(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+// Encodes the color half of a DXT block from 16 RGBA pixels (row-major, 64 bytes)
+static void CompressColorBlock(const uint8* block, uint8* out)
+{
+    const __m128i rgb_mask = _mm_set1_epi32(0x00FFFFFF);
+    __m128i rows[4];
+    for (int i = 0; i < 4; i++)
+        rows[i] = _mm_and_si128(_mm_loadu_si128((const __m128i*)(block + i * 16)), rgb_mask);
+
+    // Bounding box of the block's colors
+    __m128i min_color = _mm_min_epu8(_mm_min_epu8(rows[0], rows[1]), _mm_min_epu8(rows[2], rows[3]));
+    __m128i max_color = _mm_max_epu8(_mm_max_epu8(rows[0], rows[1]), _mm_max_epu8(rows[2], rows[3]));
+    min_color = _mm_min_epu8(min_color, _mm_shuffle_epi32(min_color, _MM_SHUFFLE(1, 0, 3, 2)));
+    min_color = _mm_min_epu8(min_color, _mm_shuffle_epi32(min_color, _MM_SHUFFLE(2, 3, 0, 1)));
+    max_color = _mm_max_epu8(max_color, _mm_shuffle_epi32(max_color, _MM_SHUFFLE(1, 0, 3, 2)));
+    max_color = _mm_max_epu8(max_color, _mm_shuffle_epi32(max_color, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    // Inset the box by 1/16th to reduce the error introduced by the extremes
+    __m128i inset = _mm_srli_epi16(_mm_unpacklo_epi8(_mm_subs_epu8(max_color, min_color), _mm_setzero_si128()), 4);
+    inset = _mm_packus_epi16(inset, inset);
+    min_color = _mm_adds_epu8(min_color, inset);
+    max_color = _mm_subs_epu8(max_color, inset);
+
+    uint16 c0 = PackRGB565((uint32)_mm_cvtsi128_si32(max_color));
+    uint16 c1 = PackRGB565((uint32)_mm_cvtsi128_si32(min_color));
+    if (c0 < c1)
+        std::swap(c0, c1);
+
+    uint32 indices = 0;
+    if (c0 != c1)
+    {
+        uint32 palette[4];
+        palette[0] = UnpackRGB565(c0);
+        palette[1] = UnpackRGB565(c1);
+        palette[2] = LerpColor(palette[0], palette[1], 2, 1);
+        palette[3] = LerpColor(palette[0], palette[1], 1, 2);
+
+        for (int row = 0; row < 4; row++)
+        {
+            __m128i best = ColorDistance4(rows[row], _mm_set1_epi32((int)palette[0]));
+            __m128i best_index = _mm_setzero_si128();
+            for (int i = 1; i < 4; i++)
+            {
+                __m128i dist = ColorDistance4(rows[row], _mm_set1_epi32((int)palette[i]));
+                __m128i closer = _mm_cmplt_epi32(dist, best);
+                best = SelectEpi32(closer, dist, best);
+                best_index = SelectEpi32(closer, _mm_set1_epi32(i), best_index);
+            }
+
+            alignas(16) uint32 lanes[4];
+            _mm_store_si128((__m128i*)lanes, best_index);
+            for (int i = 0; i < 4; i++)
+                indices |= lanes[i] << ((row * 4 + i) * 2);
+        }
+    }
+
+    memcpy(out, &c0, 2);
+    memcpy(out + 2, &c1, 2);
+    memcpy(out + 4, &indices, 4);
+}
+
+static void CompressAlphaBlock(const uint8* block, uint8* out)
+{
+    uint8 min_alpha = 255, max_alpha = 0;
+    for (int i = 0; i < 16; i++)
+    {
+        min_alpha = std::min(min_alpha, block[i * 4 + 3]);
+        max_alpha = std::max(max_alpha, block[i * 4 + 3]);
+    }
+
+    uint64 indices = 0;
+    if (max_alpha != min_alpha)
+    {
+        // Palette index 0 is max_alpha, 1 is min_alpha, and 2..7 step from max towards min in sevenths
+        uint32 range = max_alpha - min_alpha;
+        for (int i = 0; i < 16; i++)
+        {
+            uint32 step = ((max_alpha - block[i * 4 + 3]) * 7 + range / 2) / range;
+            uint64 index = step == 0 ? 0 : step == 7 ? 1 : step + 1;
+            indices |= index << (i * 3);
+        }
+    }
+
+    out[0] = max_alpha;
+    out[1] = min_alpha;
+    for (int i = 0; i < 6; i++)
+        out[2 + i] = (uint8)(indices >> (i * 8));
+}
+
+// Compresses an RGBA image into DXT1 or DXT5 blocks, clamping reads at the image edges
+static void CompressImageDXT(const uint8* rgba, uint32 width, uint32 height, bool dxt5, uint8* out)
+{
+    alignas(16) uint8 block[64];
+    for (uint32 by = 0; by < height; by += 4)
+    {
+        for (uint32 bx = 0; bx < width; bx += 4)
+        {
+            for (uint32 y = 0; y < 4; y++)
+            {
+                uint32 sy = std::min(by + y, height - 1);
+                for (uint32 x = 0; x < 4; x++)
+                {
+                    uint32 sx = std::min(bx + x, width - 1);
+                    memcpy(block + (y * 4 + x) * 4, rgba + ((size_t)sy * width + sx) * 4, 4);
+                }
+            }
+
+            if (dxt5)
+            {
+                CompressAlphaBlock(block, out);
+                out += 8;
+            }
+
+            CompressColorBlock(block, out);
+            out += 8;
+        }
+    }
+}
+
+class VTFOptimizer
+{
+
+public:
+
+    struct Result
+    {
+        std::string output_path;
+        uint64 bytes_before = 0;
+        uint64 bytes_after = 0;
+        bool converted = false;
+        bool from_cache = false;
+    };
+
+    VTFOptimizer(const VTFSettings& settings) : settings(settings) {}
+
+    // Converts every qualifying .vtf in the asset lists and points the entries at the cached results
+    bool Run(std::vector<std::vector<std::string>*>& asset_lists)
+    {
+        if (!std::filesystem::is_directory(settings.cache_path) && !std::filesystem::create_directories(settings.cache_path))
+        {
+            ConsolePrintf(RED, "Failed to create the vtf cache directory at %s\n", settings.cache_path.c_str());
+            return false;
+        }
+
+        // Gather each unique source texture once, no matter how many maps share it
+        std::unordered_map<std::string, size_t> job_index;
+        std::vector<std::pair<std::string, const VTFRule*>> jobs;
+        for (std::vector<std::string>* list : asset_lists)
+        {
+            for (size_t i = 0; i + 1 < list->size(); i += 2)
+            {
+                const std::string& internal_path = (*list)[i];
+                const std::string& source_path = (*list)[i + 1];
+                if (!ToLower(internal_path).ends_with(".vtf") || job_index.contains(source_path))
+                    continue;
+
+                const VTFRule* rule = FindRule(internal_path);
+                if (!rule)
+                    continue;
+
+                job_index[source_path] = jobs.size();
+                jobs.emplace_back(source_path, rule);
+            }
+        }
+
+        if (jobs.empty())
+        {
+            ConsolePrintf(AQUA, "No textures matched the vtf optimization rules\n\n");
+            return true;
+        }
+
+        std::vector<Result> results(jobs.size());
+        std::atomic<size_t> next_job = 0;
+        std::atomic<size_t> finished_jobs = 0;
+        uint32 thread_count = settings.threads ? settings.threads : std::max(1u, std::thread::hardware_concurrency());
+        thread_count = (uint32)std::min<size_t>(thread_count, jobs.size());
+
+        std::vector<std::thread> workers;
+        for (uint32 i = 0; i < thread_count; i++)
+        {
+            workers.emplace_back([&]()
+            {
+                for (size_t job = next_job++; job < jobs.size(); job = next_job++)
+                {
+                    results[job] = Optimize(jobs[job].first, *jobs[job].second);
+                    ++finished_jobs;
+                }
+            });
+        }
+
+        while (finished_jobs < jobs.size())
+        {
+            ConsolePrintProgress(YELLOW, finished_jobs, jobs.size());
+            Sleep(100);
+        }
+
+        for (std::thread& worker : workers)
+            worker.join();
+
+        // Swap the source paths of converted textures for their cached versions
+        for (std::vector<std::string>* list : asset_lists)
+        {
+            for (size_t i = 1; i < list->size(); i += 2)
+            {
+                auto it = job_index.find((*list)[i]);
+                if (it != job_index.end() && results[it->second].converted)
+                    (*list)[i] = results[it->second].output_path;
+            }
+        }
+
+        uint64 converted = 0, cached = 0, bytes_before = 0, bytes_after = 0;
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            if (!results[i].converted)
+                continue;
+
+            ++converted;
+            cached += results[i].from_cache;
+            bytes_before += results[i].bytes_before;
+            bytes_after += results[i].bytes_after;
+            if (verbose_logging)
+                ConsolePrintf(WHITE, "%s (%llu KB -> %llu KB)%s\n", jobs[i].first.c_str(), results[i].bytes_before / 1024, results[i].bytes_after / 1024, results[i].from_cache ? " [cached]" : "");
+        }
+
+        ConsolePrintf(AQUA, "Optimized %llu/%llu textures (%llu from cache) using %u threads: %.2f MB -> %.2f MB                    \n\n",
+            converted, (uint64)jobs.size(), cached, thread_count, bytes_before / 1048576.0, bytes_after / 1048576.0);
+        return true;
+    }
+
+    bool verbose_logging = false;
+
+private:
+
+    const VTFRule* FindRule(const std::string& internal_path) const
+    {
+        // The most specific folder wins
+        std::string path = ToLower(internal_path);
+        const VTFRule* best = nullptr;
+        for (const VTFRule& rule : settings.rules)
+        {
+            if (path.starts_with(rule.folder) && (!best || rule.folder.length() > best->folder.length()))
+                best = &rule;
+        }
+
+        return best;
+    }
+
+    Result Optimize(const std::string& source_path, const VTFRule& rule)
+    {
+        Result result;
+        std::vector<uint8> input;
+        if (!ReadFileContents(source_path, input) || !Convert(input, rule, nullptr))
+            return result;
+
+        // The cache key covers the texture's content, the rule's parameters and the encoder revision
+        char rule_key[64];
+        snprintf(rule_key, sizeof(rule_key), "_f%d_r%u_n%d_v1", (int)rule.format, rule.max_resolution, (int)rule.skip_normal_maps);
+        std::string cache_file(settings.cache_path + HashToString(HashData(input.data(), input.size())) + rule_key);
+
+        result.bytes_before = input.size();
+        if (std::filesystem::is_regular_file(cache_file + ".skip"))
+            return result;
+
+        if (std::filesystem::is_regular_file(cache_file + ".vtf"))
+        {
+            result.output_path = cache_file + ".vtf";
+            result.bytes_after = std::filesystem::file_size(result.output_path);
+            result.converted = result.from_cache = true;
+            return result;
+        }
+
+        std::vector<uint8> output;
+        if (!Convert(input, rule, &output) || output.size() >= input.size())
+        {
+            // Remember that this texture gains nothing so later runs don't redo the work
+            WriteFileContents(cache_file + ".skip", nullptr, 0);
+            return result;
+        }
+
+        if (!WriteFileContents(cache_file + ".vtf", output.data(), output.size()))
+            return result;
+
+        result.output_path = cache_file + ".vtf";
+        result.bytes_after = output.size();
+        result.converted = true;
+        return result;
+    }
+
+    // Re-encodes a vtf according to a rule. With no output buffer, only reports whether the rule would change anything
+    static bool Convert(const std::vector<uint8>& input, const VTFRule& rule, std::vector<uint8>* output)
+    {
+        if (input.size() < 64)
+            return false;
+
+        VTFHeader header = {};
+        memcpy(&header, input.data(), std::min(input.size(), sizeof(VTFHeader)));
+        if (memcmp(header.signature, "VTF", 4) || header.version[0] != 7 || header.version[1] > 5 || header.header_size > input.size())
+            return false;
+
+        uint32 minor = header.version[1];
+        if (minor < 2)
+            header.depth = 1;
+        if (minor < 3)
+            header.num_resources = 0;
+
+        // Volume textures aren't worth the complexity
+        if (header.depth > 1 || !header.mipmap_count || !header.frames)
+            return false;
+
+        uint32 faces = 1;
+        if (header.flags & VTF_FLAG_ENVMAP)
+            faces = (minor < 5 && header.first_frame != 0xFFFF) ? 7 : 6;
+
+        size_t low_res_size = header.low_res_format == VTF_FORMAT_NONE ? 0 : VTFImageSize(header.low_res_format, header.low_res_width, header.low_res_height);
+        if (VTFImageSize(header.high_res_format, header.width, header.height) == 0)
+            return false;
+
+        // Size of each mip level across all frames and faces, plus where it starts in the high res data
+        std::vector<size_t> mip_offsets(header.mipmap_count);
+        size_t high_res_size = 0;
+        for (int mip = header.mipmap_count - 1; mip >= 0; mip--)
+        {
+            mip_offsets[mip] = high_res_size;
+            high_res_size += VTFImageSize(header.high_res_format, std::max(1, header.width >> mip), std::max(1, header.height >> mip)) * header.frames * faces;
+        }
+
+        // Locate the image data
+        size_t low_res_offset = header.header_size;
+        size_t high_res_offset = header.header_size + low_res_size;
+        std::vector<VTFResourceEntry> resources(header.num_resources);
+        if (minor >= 3)
+        {
+            if (sizeof(VTFHeader) + resources.size() * sizeof(VTFResourceEntry) > input.size())
+                return false;
+
+            memcpy(resources.data(), input.data() + sizeof(VTFHeader), resources.size() * sizeof(VTFResourceEntry));
+            bool found_high_res = false;
+            for (const VTFResourceEntry& resource : resources)
+            {
+                if (resource.tag[0] == 0x01 && !resource.tag[1] && !resource.tag[2])
+                    low_res_offset = resource.offset;
+                else if (resource.tag[0] == 0x30 && !resource.tag[1] && !resource.tag[2])
+                {
+                    high_res_offset = resource.offset;
+                    found_high_res = true;
+                }
+            }
+
+            if (!found_high_res)
+                return false;
+        }
+
+        if (high_res_offset + high_res_size > input.size() || low_res_offset + low_res_size > input.size())
+            return false;
+
+        // Drop mip levels above the maximum resolution, and every mip of textures that never use them
+        uint32 skip = 0;
+        if (rule.max_resolution)
+        {
+            while (skip + 1 < header.mipmap_count && std::max(header.width >> skip, header.height >> skip) > (int)rule.max_resolution)
+                ++skip;
+        }
+
+        uint32 mip_count = header.mipmap_count - skip;
+        if (header.flags & VTF_FLAG_NOMIP)
+            mip_count = 1;
+
+        uint32 format = header.high_res_format;
+        bool has_alpha = false;
+        bool skip_normal = rule.skip_normal_maps && (header.flags & VTF_FLAG_NORMAL);
+        if (rule.format != VTF_TARGET_KEEP && !skip_normal && IsVTFFormatEncodable(header.high_res_format))
+        {
+            if (rule.format == VTF_TARGET_AUTO)
+            {
+                // Only spend the extra bits on alpha if the texture actually uses it
+                std::vector<uint8> rgba;
+                for (uint32 mip = skip; mip < skip + mip_count && !has_alpha; mip++)
+                {
+                    uint32 width = std::max(1, header.width >> mip), height = std::max(1, header.height >> mip);
+                    size_t pixels = (size_t)width * height * header.frames * faces;
+                    rgba.resize(pixels * 4);
+                    DecodeToRGBA(input.data() + high_res_offset + mip_offsets[mip], header.high_res_format, pixels, rgba.data());
+                    for (size_t i = 0; i < pixels && !has_alpha; i++)
+                        has_alpha = rgba[i * 4 + 3] != 255;
+                }
+
+                format = has_alpha ? VTF_FORMAT_DXT5 : VTF_FORMAT_DXT1;
+            }
+            else
+                format = rule.format == VTF_TARGET_DXT5 ? VTF_FORMAT_DXT5 : VTF_FORMAT_DXT1;
+        }
+
+        if (format == header.high_res_format && mip_count == header.mipmap_count)
+            return false;
+
+        if (!output)
+            return true;
+
+        // Build the new high res data, smallest mip first
+        std::vector<uint8> high_res;
+        std::vector<uint8> rgba;
+        for (int mip = skip + mip_count - 1; mip >= (int)skip; mip--)
+        {
+            uint32 width = std::max(1, header.width >> mip), height = std::max(1, header.height >> mip);
+            size_t src_image_size = VTFImageSize(header.high_res_format, width, height);
+            size_t dst_image_size = VTFImageSize(format, width, height);
+            const uint8* src = input.data() + high_res_offset + mip_offsets[mip];
+            for (uint32 image = 0; image < header.frames * faces; image++, src += src_image_size)
+            {
+                size_t offset = high_res.size();
+                high_res.resize(offset + dst_image_size);
+                if (format == header.high_res_format)
+                {
+                    memcpy(high_res.data() + offset, src, src_image_size);
+                    continue;
+                }
+
+                rgba.resize((size_t)width * height * 4);
+                DecodeToRGBA(src, header.high_res_format, (size_t)width * height, rgba.data());
+                CompressImageDXT(rgba.data(), width, height, format == VTF_FORMAT_DXT5, high_res.data() + offset);
+            }
+        }
+
+        VTFHeader new_header = header;
+        new_header.width = (uint16)std::max(1, header.width >> skip);
+        new_header.height = (uint16)std::max(1, header.height >> skip);
+        new_header.mipmap_count = (uint8)mip_count;
+        new_header.high_res_format = format;
+        if (format == VTF_FORMAT_DXT1)
+            new_header.flags &= ~(VTF_FLAG_ONEBITALPHA | VTF_FLAG_EIGHTBITALPHA);
+        else if (format == VTF_FORMAT_DXT5)
+            new_header.flags = (new_header.flags & ~VTF_FLAG_ONEBITALPHA) | VTF_FLAG_EIGHTBITALPHA;
+
+        // Keep the original header bytes past the fields we know about, then lay the data back out
+        output->assign(input.begin(), input.begin() + header.header_size);
+        memcpy(output->data(), &new_header, std::min<size_t>(header.header_size, minor >= 3 ? sizeof(VTFHeader) : 63));
+        if (minor < 3)
+        {
+            output->insert(output->end(), input.begin() + low_res_offset, input.begin() + low_res_offset + low_res_size);
+            output->insert(output->end(), high_res.begin(), high_res.end());
+            return true;
+        }
+
+        for (size_t i = 0; i < resources.size(); i++)
+        {
+            VTFResourceEntry& resource = resources[i];
+            if (resource.flags & 0x02)
+                continue;
+
+            size_t offset = output->size();
+            if (resource.tag[0] == 0x01 && !resource.tag[1] && !resource.tag[2])
+                output->insert(output->end(), input.begin() + low_res_offset, input.begin() + low_res_offset + low_res_size);
+            else if (resource.tag[0] == 0x30 && !resource.tag[1] && !resource.tag[2])
+                output->insert(output->end(), high_res.begin(), high_res.end());
+            else
+            {
+                // Other resources are stored as a 4 byte length followed by their data
+                uint32 length = 0;
+                if ((size_t)resource.offset + 4 > input.size())
+                    return false;
+
+                memcpy(&length, input.data() + resource.offset, 4);
+                if ((size_t)resource.offset + 4 + length > input.size())
+                    return false;
+
+                output->insert(output->end(), input.begin() + resource.offset, input.begin() + resource.offset + 4 + length);
+            }
+
+            resource.offset = (uint32)offset;
+        }
+
+        memcpy(output->data() + sizeof(VTFHeader), resources.data(), resources.size() * sizeof(VTFResourceEntry));
+        return true;
+    }
+
+    const VTFSettings& settings;
+};
+
+const int BSP_HEADER_LUMPS = 64;
+const int BSP_LUMP_GAME_LUMP = 35;
+const int BSP_LUMP_PAKFILE = 40;
+const uint32 BSP_IDENT = 'V' | ('B' << 8) | ('S' << 16) | ('P' << 24);
+const uint32 LZMA_LUMP_ID = 'L' | ('Z' << 8) | ('M' << 16) | ('A' << 24);
+
+const uint32 ZIP_LOCAL_FILE_SIGNATURE = 0x04034b50;
+const uint32 ZIP_CENTRAL_FILE_SIGNATURE = 0x02014b50;
+const uint32 ZIP_END_OF_DIRECTORY_SIGNATURE = 0x06054b50;
+const uint16 ZIP_METHOD_STORE = 0;
+const uint16 ZIP_METHOD_LZMA = 14;
+const uint16 GAME_LUMP_FLAG_COMPRESSED = 1;
+
+#pragma pack(push, 1)
+struct BSPLump
+{
+    int32 fileofs;
+    int32 filelen;
+    int32 version;
+    uint32 uncompressed_size;
+};
+
+struct BSPHeader
+{
+    uint32 ident;
+    int32 version;
+    BSPLump lumps[BSP_HEADER_LUMPS];
+    int32 map_revision;
+};
+
+struct LZMALumpHeader
+{
+    uint32 id;
+    uint32 actual_size;
+    uint32 lzma_size;
+    uint8 properties[LZMA_PROPS_SIZE];
+};
+
+struct BSPGameLump
+{
+    int32 id;
+    uint16 flags;
+    uint16 version;
+    int32 fileofs;
+    int32 filelen;
+};
+
+struct ZipLocalFileHeader
+{
+    uint32 signature;
+    uint16 version_needed;
+    uint16 flags;
+    uint16 method;
+    uint16 time;
+    uint16 date;
+    uint32 crc;
+    uint32 compressed_size;
+    uint32 uncompressed_size;
+    uint16 name_length;
+    uint16 extra_length;
+};
+
+struct ZipCentralFileHeader
+{
+    uint32 signature;
+    uint16 version_made_by;
+    uint16 version_needed;
+    uint16 flags;
+    uint16 method;
+    uint16 time;
+    uint16 date;
+    uint32 crc;
+    uint32 compressed_size;
+    uint32 uncompressed_size;
+    uint16 name_length;
+    uint16 extra_length;
+    uint16 comment_length;
+    uint16 disk_start;
+    uint16 internal_attributes;
+    uint32 external_attributes;
+    uint32 local_offset;
+};
+
+struct ZipEndOfDirectory
+{
+    uint32 signature;
+    uint16 disk;
+    uint16 directory_disk;
+    uint16 disk_entries;
+    uint16 total_entries;
+    uint32 directory_size;
+    uint32 directory_offset;
+    uint16 comment_length;
+};
+#pragma pack(pop)
+
+struct ZipEntry
+{
+    std::string name;
+    uint16 method = ZIP_METHOD_STORE;
+    uint16 flags = 0;
+    uint16 time = 0;
+    uint16 date = 0;
+    uint32 crc = 0;
+    uint32 compressed_size = 0;
+    uint32 uncompressed_size = 0;
+    uint32 local_offset = 0;
+};
+
+// Finds the end of directory record, which sits before an optional comment of up to 64 KB
+static bool FindZipEndOfDirectory(const uint8* data, size_t size, ZipEndOfDirectory& eocd, size_t& eocd_pos)
+{
+    if (size < sizeof(ZipEndOfDirectory))
+        return false;
+
+    size_t search_end = size >= sizeof(ZipEndOfDirectory) + 0xFFFF ? size - sizeof(ZipEndOfDirectory) - 0xFFFF : 0;
+    for (size_t pos = size - sizeof(ZipEndOfDirectory) + 1; pos-- > search_end;)
+    {
+        uint32 signature;
+        memcpy(&signature, data + pos, sizeof(signature));
+        if (signature == ZIP_END_OF_DIRECTORY_SIGNATURE)
+        {
+            memcpy(&eocd, data + pos, sizeof(eocd));
+            eocd_pos = pos;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static bool ParseZipDirectory(const uint8* directory, size_t size, uint32 count, std::vector<ZipEntry>& entries)
+{
+    size_t pos = 0;
+    entries.reserve(entries.size() + count);
+    for (uint32 i = 0; i < count; i++)
+    {
+        ZipCentralFileHeader header;
+        if (pos + sizeof(header) > size)
+            return false;
+
+        memcpy(&header, directory + pos, sizeof(header));
+        if (header.signature != ZIP_CENTRAL_FILE_SIGNATURE || pos + sizeof(header) + header.name_length > size)
+            return false;
+
+        ZipEntry entry;
+        entry.name.assign((const char*)directory + pos + sizeof(header), header.name_length);
+        entry.method = header.method;
+        entry.flags = header.flags;
+        entry.time = header.time;
+        entry.date = header.date;
+        entry.crc = header.crc;
+        entry.compressed_size = header.compressed_size;
+        entry.uncompressed_size = header.uncompressed_size;
+        entry.local_offset = header.local_offset;
+        entries.push_back(entry);
+
+        pos += sizeof(header) + header.name_length + header.extra_length + header.comment_length;
+    }
+
+    return true;
+}
+
+// Parses the central directory of an in-memory zip archive
+static bool ReadZipDirectory(const uint8* data, size_t size, std::vector<ZipEntry>& entries)
+{
+    ZipEndOfDirectory eocd;
+    size_t eocd_pos;
+    if (!FindZipEndOfDirectory(data, size, eocd, eocd_pos) || (size_t)eocd.directory_offset + eocd.directory_size > eocd_pos)
+        return false;
+
+    return ParseZipDirectory(data + eocd.directory_offset, eocd.directory_size, eocd.total_entries, entries);
+}
+
+// Parses the central directory of a zip archive stored at [offset, offset + size) of a stream, without reading the entries
+static bool ReadZipDirectory(std::istream& stream, uint64 offset, uint64 size, std::vector<ZipEntry>& entries, uint64* directory_offset = nullptr)
+{
+    std::vector<uint8> tail((size_t)std::min<uint64>(size, sizeof(ZipEndOfDirectory) + 0xFFFF));
+    uint64 tail_offset = offset + size - tail.size();
+    if (!stream.seekg(tail_offset).read((char*)tail.data(), tail.size()))
+        return false;
+
+    ZipEndOfDirectory eocd;
+    size_t eocd_pos;
+    if (!FindZipEndOfDirectory(tail.data(), tail.size(), eocd, eocd_pos) || (uint64)eocd.directory_offset + eocd.directory_size > size)
+        return false;
+
+    std::vector<uint8> directory(eocd.directory_size);
+    if (!stream.seekg(offset + eocd.directory_offset).read((char*)directory.data(), directory.size()))
+        return false;
+
+    if (directory_offset)
+        *directory_offset = eocd.directory_offset;
+
+    return ParseZipDirectory(directory.data(), directory.size(), eocd.total_entries, entries);
+}
+
+// Returns the offset of an entry's data within the archive, or npos if its local header is invalid
+static size_t ZipEntryDataOffset(const uint8* data, size_t size, const ZipEntry& entry)
+{
+    ZipLocalFileHeader header;
+    if ((size_t)entry.local_offset + sizeof(header) > size)
+        return std::string::npos;
+
+    memcpy(&header, data + entry.local_offset, sizeof(header));
+    size_t offset = (size_t)entry.local_offset + sizeof(header) + header.name_length + header.extra_length;
+    if (header.signature != ZIP_LOCAL_FILE_SIGNATURE || offset + entry.compressed_size > size)
+        return std::string::npos;
+
+    return offset;
+}
+
+enum CompressionAction
+{
+    COMPRESSION_SAMPLE,
+    COMPRESSION_STORE,
+    COMPRESSION_COMPRESS
+};
+
+struct CompressionPolicySettings
+{
+    double min_ratio = 0.95;
+    uint32 sample_size = 16384;
+    double entropy_threshold = 7.5;
+    std::unordered_map<std::string, CompressionAction> rules = {
+        { ".mp3", COMPRESSION_STORE },
+        { ".ogg", COMPRESSION_STORE },
+        { ".bik", COMPRESSION_STORE }
+    };
+};
+
+struct CompressionDecision
+{
+    bool compress = false;
+    bool complete = false;
+    bool sampled_all = false;
+    double estimated_ratio = 1.0;
+    double seconds = 0.0;
+    std::vector<uint8> data;
+    uint8 props[LZMA_PROPS_SIZE] = {};
+};
+
+// Decides per pakfile entry whether compressing it is worth the CPU time, and keeps score of what that decision cost
+class CompressionPolicy
+{
+
+public:
+
+    struct Stats
+    {
+        uint64 entries = 0;
+        uint64 compressed = 0;
+        uint64 stored = 0;
+        uint64 bytes_in = 0;
+        uint64 bytes_out = 0;
+        uint64 bytes_lost = 0;
+        double seconds_saved = 0.0;
+        double seconds_spent = 0.0;
+    };
+
+    CompressionPolicy(const CompressionPolicySettings& settings) : settings(settings) {}
+
+    // Decides from the head of an entry whether to compress it. If the sample was the whole entry, the compressed data comes along with it
+    CompressionDecision Decide(const std::string& name, const uint8* sample, size_t sample_size, uint64 size)
+    {
+        CompressionDecision decision;
+        CompressionAction action = COMPRESSION_SAMPLE;
+        auto rule = settings.rules.find(GetExtension(name));
+        if (rule != settings.rules.end())
+            action = rule->second;
+
+        double entropy = ByteEntropy(sample, sample_size);
+        decision.estimated_ratio = std::min(1.0, entropy / 8.0);
+        if (action == COMPRESSION_STORE || !size)
+            return decision;
+
+        if (action == COMPRESSION_COMPRESS)
+        {
+            decision.compress = true;
+            return decision;
+        }
+
+        if (entropy >= settings.entropy_threshold)
+            return decision;
+
+        // Trial compress the head of the entry to see if the rest is worth the effort
+        auto start = std::chrono::steady_clock::now();
+        bool fits = LZMACompress(sample, sample_size, decision.data, decision.props);
+        decision.seconds = RecordThroughput(sample_size, start);
+        decision.sampled_all = sample_size == size;
+        decision.estimated_ratio = fits ? decision.data.size() / (double)sample_size : 1.0;
+        decision.compress = decision.estimated_ratio <= settings.min_ratio;
+        decision.complete = decision.compress && decision.sampled_all;
+        return decision;
+    }
+
+    void RecordCompressed(const std::string& name, uint64 size, uint64 compressed_size, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        measured_bytes += size;
+        measured_seconds += seconds;
+
+        Stats& stat = stats[GetExtension(name)];
+        ++stat.entries;
+        ++stat.compressed;
+        stat.bytes_in += size;
+        stat.bytes_out += compressed_size;
+        stat.seconds_spent += seconds;
+    }
+
+    void RecordStored(const std::string& name, uint64 size, const CompressionDecision& decision, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Stats& stat = stats[GetExtension(name)];
+        ++stat.entries;
+        ++stat.stored;
+        stat.bytes_in += size;
+        stat.bytes_out += size;
+        stat.seconds_spent += decision.seconds + seconds;
+
+        // Compression was tried and didn't pay off, so nothing was saved or lost
+        if (decision.compress)
+            return;
+
+        // Stored, so count the time we didn't spend and the bytes compression would likely have saved
+        stat.bytes_lost += (uint64)(size * (1.0 - decision.estimated_ratio));
+        if (!decision.sampled_all)
+            stat.seconds_saved += size / BytesPerSecond();
+    }
+
+    double MinRatio() const
+    {
+        return settings.min_ratio;
+    }
+
+    uint32 SampleSize() const
+    {
+        return settings.sample_size;
+    }
+
+    void PrintReport() const
+    {
+        if (stats.empty())
+            return;
+
+        ConsolePrintf(YELLOW, " - - - - - - - - - - < Compression Policy > - - - - - - - - - -\n\n");
+        ConsolePrintf(AQUA, "%-8s %9s %10s %8s %12s %12s %11s %12s\n", "Type", "Entries", "Compressed", "Stored", "In (KB)", "Out (KB)", "Time Saved", "Lost (KB)");
+
+        std::vector<std::pair<std::string, Stats>> sorted(stats.begin(), stats.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.bytes_in > b.second.bytes_in; });
+
+        Stats total;
+        for (const auto& [ext, stat] : sorted)
+        {
+            ConsolePrintf(WHITE, "%-8s %9llu %10llu %8llu %12llu %12llu %10.2fs %12llu\n", ext.empty() ? "(none)" : ext.c_str(),
+                stat.entries, stat.compressed, stat.stored, stat.bytes_in / 1024, stat.bytes_out / 1024, stat.seconds_saved, stat.bytes_lost / 1024);
+
+            total.entries += stat.entries;
+            total.compressed += stat.compressed;
+            total.stored += stat.stored;
+            total.bytes_in += stat.bytes_in;
+            total.bytes_out += stat.bytes_out;
+            total.seconds_saved += stat.seconds_saved;
+            total.bytes_lost += stat.bytes_lost;
+        }
+
+        ConsolePrintf(AQUA, "%-8s %9llu %10llu %8llu %12llu %12llu %10.2fs %12llu\n\n", "Total",
+            total.entries, total.compressed, total.stored, total.bytes_in / 1024, total.bytes_out / 1024, total.seconds_saved, total.bytes_lost / 1024);
+    }
+
+    std::unordered_map<std::string, Stats> stats;
+
+private:
+
+    double RecordThroughput(size_t size, std::chrono::steady_clock::time_point start)
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        std::lock_guard<std::mutex> lock(mutex);
+        measured_bytes += size;
+        measured_seconds += seconds;
+        return seconds;
+    }
+
+    double BytesPerSecond() const
+    {
+        // Assume a conservative LZMA speed until something has actually been measured
+        if (measured_seconds <= 0.0)
+            return 2.0 * 1048576.0;
+
+        return measured_bytes / measured_seconds;
+    }
+
+    const CompressionPolicySettings& settings;
+    std::mutex mutex;
+    uint64 measured_bytes = 0;
+    double measured_seconds = 0.0;
+};
+
+const size_t PACK_BUFFER_SIZE = 1 << 20;
+
+enum OutputFlush
+{
+    OUTPUT_FLUSH_NONE,
+    OUTPUT_FLUSH_FILE
+};
+
+struct OutputSettings
+{
+    bool preallocate = true;
+    OutputFlush flush = OUTPUT_FLUSH_NONE;
+};
+
+// Every output being written holds two of these
+const size_t OUTPUT_BUFFER_SIZE = 4 << 20;
+
+struct PackingSettings
+{
+    uint32 memory_limit_mb = 512;
+    uint32 parallel_maps = 1;
+    uint32 compression_threads = 0;
+    bool incremental = false;
+    bool deterministic = false;
+    OutputSettings output;
+};
+
+// Deterministic outputs use this dictionary however much memory or how many threads there are, and date every entry
+// 1980-01-01 00:00:00, the earliest zip time
+const uint32 DETERMINISTIC_DICTIONARY_SIZE = 1 << 20;
+const uint16 DETERMINISTIC_DOS_TIME = 0;
+const uint16 DETERMINISTIC_DOS_DATE = (1 << 5) | 1;
+
+class EntryOrder;
+
+// How much of the memory budget one packer may use
+struct PackerLimits
+{
+    uint32 dictionary_size = 1 << 16;
+    uint32 threads = 1;
+    uint64 entry_limit = 0;
+    bool deterministic = false;
+    const EntryOrder* order = nullptr;
+};
+
+// A fixed set of equally sized buffers shared by every packer, so streaming assets never allocates past the budget
+class BufferPool
+{
+
+public:
+
+    BufferPool(size_t buffer_size, size_t count) : buffer_size(buffer_size)
+    {
+        for (size_t i = 0; i < count; i++)
+        {
+            storage.emplace_back(new uint8[buffer_size]);
+            free_buffers.push_back(storage.back().get());
+        }
+
+        g_PackMemory.Add((int64)(buffer_size * count));
+    }
+
+    ~BufferPool()
+    {
+        g_PackMemory.Add(-(int64)(buffer_size * storage.size()));
+    }
+
+    uint8* Acquire()
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        available.wait(lock, [this]() { return !free_buffers.empty(); });
+        uint8* buffer = free_buffers.back();
+        free_buffers.pop_back();
+        return buffer;
+    }
+
+    void Release(uint8* buffer)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            free_buffers.push_back(buffer);
+        }
+
+        available.notify_one();
+    }
+
+    size_t BufferSize() const
+    {
+        return buffer_size;
+    }
+
+    size_t TotalBytes() const
+    {
+        return buffer_size * storage.size();
+    }
+
+private:
+
+    size_t buffer_size;
+    std::vector<std::unique_ptr<uint8[]>> storage;
+    std::vector<uint8*> free_buffers;
+    std::mutex mutex;
+    std::condition_variable available;
+};
+
+class PooledBuffer
+{
+
+public:
+
+    PooledBuffer(BufferPool& pool) : pool(pool), data(pool.Acquire()) {}
+
+    ~PooledBuffer()
+    {
+        pool.Release(data);
+    }
+
+    PooledBuffer(const PooledBuffer&) = delete;
+    PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+    BufferPool& pool;
+    uint8* data;
+};
+
+static void GetDosTime(const std::string& path, uint16& time, uint16& date)
+{
+    std::error_code ec;
+    auto file_time = std::filesystem::last_write_time(path, ec);
+    time_t timestamp = std::time(nullptr);
+    if (!ec)
+        timestamp = std::chrono::system_clock::to_time_t(std::chrono::time_point_cast<std::chrono::system_clock::duration>(file_time - std::filesystem::file_time_type::clock::now() + std::chrono::system_clock::now()));
+
+    tm local = {};
+    localtime_s(&local, &timestamp);
+    date = (uint16)(((std::max(local.tm_year, 80) - 80) << 9) | ((local.tm_mon + 1) << 5) | local.tm_mday);
+    time = (uint16)((local.tm_hour << 11) | (local.tm_min << 5) | (local.tm_sec / 2));
+}
+
+static bool CopyStreamRange(std::istream& source, uint64 offset, uint64 size, std::ostream& output, uint8* buffer, size_t buffer_size, uint32* crc = nullptr)
+{
+    source.clear();
+    source.seekg(offset);
+    while (size)
+    {
+        size_t chunk = (size_t)std::min<uint64>(size, buffer_size);
+        if (source.read((char*)buffer, chunk).fail() || output.write((const char*)buffer, chunk).fail())
+            return false;
+
+        if (crc)
+            *crc = CRC32(buffer, chunk, *crc);
+
+        size -= chunk;
+    }
+
+    return true;
+}
+
+// A write-only file for packed outputs. Data is gathered in two large page aligned buffers and written with overlapped
+// I/O, so one buffer fills while the other is on its way to the disk. Seeks that land in the buffer being filled, like
+// a pakfile entry's header being filled in after its data, don't write anything
+class OutputFile : public std::streambuf
+{
+
+public:
+
+    ~OutputFile()
+    {
+        Close();
+        for (Buffer& buffer : buffers)
+        {
+            if (buffer.data)
+            {
+                VirtualFree(buffer.data, 0, MEM_RELEASE);
+                g_PackMemory.Add(-(int64)OUTPUT_BUFFER_SIZE);
+            }
+
+            if (buffer.overlapped.hEvent)
+                CloseHandle(buffer.overlapped.hEvent);
+        }
+    }
+
+    bool Open(const std::string& path, uint64 expected_size, const OutputSettings& settings)
+    {
+        flush = settings.flush;
+        handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+            return false;
+
+        // Reserve the whole file at once instead of growing it with every write, so it ends up in as few pieces as
+        // possible. The end of the file is moved out too, since NTFS completes writes that extend a file synchronously,
+        // which would leave nothing for the second buffer to overlap with. The file is cut back to what was written
+        // when it's closed
+        if (settings.preallocate && expected_size)
+        {
+            FILE_ALLOCATION_INFO allocation = {};
+            allocation.AllocationSize.QuadPart = (LONGLONG)expected_size;
+            SetFileInformationByHandle(handle, FileAllocationInfo, &allocation, sizeof(allocation));
+
+            FILE_END_OF_FILE_INFO end_of_file = {};
+            end_of_file.EndOfFile.QuadPart = (LONGLONG)expected_size;
+            preallocated = SetFileInformationByHandle(handle, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file));
+        }
+
+        for (Buffer& buffer : buffers)
+        {
+            buffer.data = (char*)VirtualAlloc(nullptr, OUTPUT_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+            buffer.overlapped.hEvent = CreateEventA(nullptr, TRUE, FALSE, nullptr);
+            if (!buffer.data || !buffer.overlapped.hEvent)
+                return false;
+
+            g_PackMemory.Add((int64)OUTPUT_BUFFER_SIZE);
+        }
+
+        setp(buffers[0].data, buffers[0].data + OUTPUT_BUFFER_SIZE);
+        return true;
+    }
+
+    // Writes whatever is left and closes the file, flushing it to the disk first if the settings ask for it
+    bool Close()
+    {
+        if (handle == INVALID_HANDLE_VALUE)
+            return !failed;
+
+        Submit();
+        for (Buffer& buffer : buffers)
+            Wait(buffer);
+
+        if (preallocated)
+        {
+            FILE_END_OF_FILE_INFO end_of_file = {};
+            end_of_file.EndOfFile.QuadPart = (LONGLONG)end;
+            if (!SetFileInformationByHandle(handle, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file)))
+                failed = true;
+        }
+
+        if (!failed && flush == OUTPUT_FLUSH_FILE && !FlushFileBuffers(handle))
+            failed = true;
+
+        CloseHandle(handle);
+        handle = INVALID_HANDLE_VALUE;
+        return !failed;
+    }
+
+protected:
+
+    int_type overflow(int_type c) override
+    {
+        if (failed || !Submit())
+            return traits_type::eof();
+
+        if (!traits_type::eq_int_type(c, traits_type::eof()))
+        {
+            *pptr() = traits_type::to_char_type(c);
+            pbump(1);
+        }
+
+        return traits_type::not_eof(c);
+    }
+
+    std::streamsize xsputn(const char* data, std::streamsize size) override
+    {
+        std::streamsize written = 0;
+        while (written < size)
+        {
+            if (pptr() == epptr() && traits_type::eq_int_type(overflow(traits_type::eof()), traits_type::eof()))
+                break;
+
+            std::streamsize chunk = std::min<std::streamsize>(size - written, epptr() - pptr());
+            memcpy(pptr(), data + written, (size_t)chunk);
+            pbump((int)chunk);
+            written += chunk;
+        }
+
+        return written;
+    }
+
+    pos_type seekoff(off_type offset, std::ios_base::seekdir dir, std::ios_base::openmode which) override
+    {
+        uint64 position = base + (uint64)(pptr() - pbase());
+        if (dir == std::ios_base::cur)
+            offset += (off_type)position;
+        else if (dir == std::ios_base::end)
+            offset += (off_type)std::max(end, base + Filled());
+
+        return seekpos(pos_type(offset), which);
+    }
+
+    pos_type seekpos(pos_type pos, std::ios_base::openmode which) override
+    {
+        uint64 target = (uint64)(off_type)pos;
+        if (failed || (off_type)pos < 0 || !(which & std::ios_base::out))
+            return pos_type(off_type(-1));
+
+        // Within what's buffered, only the write position moves
+        size_t filled = Filled();
+        if (target >= base && target <= base + filled)
+        {
+            high_water = filled;
+            setp(pbase(), epptr());
+            pbump((int)(target - base));
+            return pos;
+        }
+
+        // Anywhere else, everything in flight has to land first so an older write can't land on top of a newer one
+        if (!Submit())
+            return pos_type(off_type(-1));
+
+        for (Buffer& buffer : buffers)
+            Wait(buffer);
+
+        base = target;
+        return failed ? pos_type(off_type(-1)) : pos;
+    }
+
+    int sync() override
+    {
+        Submit();
+        for (Buffer& buffer : buffers)
+            Wait(buffer);
+
+        return failed ? -1 : 0;
+    }
+
+private:
+
+    struct Buffer
+    {
+        char* data = nullptr;
+        OVERLAPPED overlapped = {};
+        DWORD pending = 0;
+        bool in_flight = false;
+    };
+
+    size_t Filled() const
+    {
+        return std::max(high_water, (size_t)(pptr() - pbase()));
+    }
+
+    // Starts writing the current buffer and switches to the other one once its last write has landed
+    bool Submit()
+    {
+        size_t size = Filled();
+        if (size)
+        {
+            Buffer& buffer = buffers[current];
+            buffer.overlapped.Offset = (DWORD)base;
+            buffer.overlapped.OffsetHigh = (DWORD)(base >> 32);
+            buffer.pending = (DWORD)size;
+            buffer.in_flight = true;
+            if (!WriteFile(handle, buffer.data, buffer.pending, nullptr, &buffer.overlapped) && GetLastError() != ERROR_IO_PENDING)
+            {
+                buffer.in_flight = false;
+                failed = true;
+            }
+
+            base += size;
+            end = std::max(end, base);
+            current ^= 1;
+        }
+
+        Wait(buffers[current]);
+        high_water = 0;
+        setp(buffers[current].data, buffers[current].data + OUTPUT_BUFFER_SIZE);
+        return !failed;
+    }
+
+    void Wait(Buffer& buffer)
+    {
+        if (!buffer.in_flight)
+            return;
+
+        DWORD written = 0;
+        if (!GetOverlappedResult(handle, &buffer.overlapped, &written, TRUE) || written != buffer.pending)
+            failed = true;
+
+        buffer.in_flight = false;
+    }
+
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OutputFlush flush = OUTPUT_FLUSH_NONE;
+    Buffer buffers[2];
+    int current = 0;
+    uint64 base = 0;
+    uint64 end = 0;
+    size_t high_water = 0;
+    bool preallocated = false;
+    bool failed = false;
+};
+
+// Writes the same data through std::ofstream and through OutputFile, both flushed to the disk, and prints how fast each was
+static bool BenchmarkOutput(const std::string& directory, uint64 size_mb)
+{
+    // Entry sized writes of data that doesn't repeat, like a pakfile being streamed out
+    std::vector<char> chunk(64 << 10);
+    uint64 state = 0x9E3779B97F4A7C15ull;
+    for (char& byte : chunk)
+    {
+        state ^= state << 13; state ^= state >> 7; state ^= state << 17;
+        byte = (char)state;
+    }
+
+    uint64 total = size_mb << 20;
+    std::string path(directory + "/benchmark_io.tmp");
+    OutputSettings settings;
+    settings.flush = OUTPUT_FLUSH_FILE;
+
+    ConsolePrintf(YELLOW, "Writing %llu MB to %s each way...\n", size_mb, path.c_str());
+    for (int mode = 0; mode < 2; mode++)
+    {
+        auto start = std::chrono::steady_clock::now();
+        bool written = true;
+        if (mode == 0)
+        {
+            std::ofstream stream(path, std::ios::binary | std::ios::trunc);
+            for (uint64 i = 0; i < total && stream; i += chunk.size())
+                stream.write(chunk.data(), (std::streamsize)std::min<uint64>(chunk.size(), total - i));
+
+            stream.close();
+            written = !stream.fail();
+
+            // A stream can't be flushed to the disk, so open the file again to do it
+            HANDLE handle = CreateFileA(path.c_str(), GENERIC_WRITE, 0, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+            written = written && handle != INVALID_HANDLE_VALUE && FlushFileBuffers(handle);
+            if (handle != INVALID_HANDLE_VALUE)
+                CloseHandle(handle);
+        }
+        else
+        {
+            OutputFile file;
+            std::ostream stream(&file);
+            written = file.Open(path, total, settings);
+            for (uint64 i = 0; i < total && written && stream; i += chunk.size())
+                stream.write(chunk.data(), (std::streamsize)std::min<uint64>(chunk.size(), total - i));
+
+            written = file.Close() && written && !stream.fail();
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (!written)
+        {
+            ConsolePrintf(RED, "Failed to write %s\n", path.c_str());
+            return false;
+        }
+
+        ConsolePrintf(AQUA, "%-14s %8.1f MB/s (%.2f seconds)\n", mode == 0 ? "std::ofstream" : "OutputFile", size_mb / std::max(seconds, 1e-9), seconds);
+    }
+
+    std::error_code ec;
+    std::filesystem::remove(path, ec);
+    return true;
+}
+
+enum PassthroughMethod
+{
+    PASSTHROUGH_FAILED,
+    PASSTHROUGH_SAME_FILE,
+    PASSTHROUGH_HARD_LINK,
+    PASSTHROUGH_BLOCK_CLONE,
+    PASSTHROUGH_COPY
+};
+
+static const char* g_PassthroughNames[] = { "Failed", "Already in place", "Hard linked", "Block cloned", "Copied" };
+
+// Clones the extents of a file into a new one, which shares them until either is written. Only works within a volume
+// that supports block cloning, like ReFS, and fails anywhere else
+static bool CloneFile(const std::string& source, const std::string& destination)
+{
+    HANDLE input = CreateFileA(source.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (input == INVALID_HANDLE_VALUE)
+        return false;
+
+    // The volume's cluster size comes along with its integrity information, which only block cloning volumes have
+    LARGE_INTEGER size = {};
+    FSCTL_GET_INTEGRITY_INFORMATION_BUFFER integrity = {};
+    DWORD returned = 0;
+    bool cloned = GetFileSizeEx(input, &size) && DeviceIoControl(input, FSCTL_GET_INTEGRITY_INFORMATION, nullptr, 0, &integrity, sizeof(integrity), &returned, nullptr) && integrity.ClusterSizeInBytes;
+    HANDLE output = cloned ? CreateFileA(destination.c_str(), GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr) : INVALID_HANDLE_VALUE;
+    FILE_END_OF_FILE_INFO end_of_file = {};
+    end_of_file.EndOfFile = size;
+    cloned = output != INVALID_HANDLE_VALUE && SetFileInformationByHandle(output, FileEndOfFileInfo, &end_of_file, sizeof(end_of_file));
+
+    // Ranges are whole clusters, so the last one reaches past the end of the file, and each has to be under 4 GB
+    const uint64 max_range = 1ull << 30;
+    uint64 cluster_size = integrity.ClusterSizeInBytes;
+    uint64 total = cloned ? ((uint64)size.QuadPart + cluster_size - 1) / cluster_size * cluster_size : 0;
+    for (uint64 offset = 0; cloned && offset < total; offset += max_range)
+    {
+        DUPLICATE_EXTENTS_DATA extents = {};
+        extents.FileHandle = input;
+        extents.SourceFileOffset.QuadPart = (int64)offset;
+        extents.TargetFileOffset.QuadPart = (int64)offset;
+        extents.ByteCount.QuadPart = (int64)std::min(max_range, total - offset);
+        cloned = DeviceIoControl(output, FSCTL_DUPLICATE_EXTENTS_TO_FILE, &extents, sizeof(extents), nullptr, 0, &returned, nullptr);
+    }
+
+    CloseHandle(input);
+    if (output != INVALID_HANDLE_VALUE)
+    {
+        CloseHandle(output);
+        if (!cloned)
+            DeleteFileA(destination.c_str());
+    }
+
+    return cloned;
+}
+
+// True if the output is another name for the source, like a hard link left by a pass through
+static bool IsLinkedToSource(const std::string& source, const std::string& output)
+{
+    std::error_code ec;
+    return std::filesystem::equivalent(source, output, ec) && std::filesystem::weakly_canonical(source, ec) != std::filesystem::weakly_canonical(output, ec);
+}
+
+// Puts a file at a destination without copying its data where the volume allows it: a hard link if it's on the same
+// NTFS volume, then a block clone, then CopyFile, which copies on the server for network shares
+static PassthroughMethod PassThroughFile(const std::string& source, const std::string& destination)
+{
+    std::error_code ec;
+    if (std::filesystem::equivalent(source, destination, ec))
+        return PASSTHROUGH_SAME_FILE;
+
+    std::filesystem::remove(destination, ec);
+    if (CreateHardLinkA(destination.c_str(), source.c_str(), nullptr))
+        return PASSTHROUGH_HARD_LINK;
+
+    if (CloneFile(source, destination))
+        return PASSTHROUGH_BLOCK_CLONE;
+
+    if (CopyFileA(source.c_str(), destination.c_str(), FALSE))
+        return PASSTHROUGH_COPY;
+
+    return PASSTHROUGH_FAILED;
+}
+
+// A file to add to a pakfile, either a whole file or the data of an entry of another archive within one. Raw entries
+// are copied as they are instead of being compressed
+struct PakfileSource
+{
+    const std::string* name = nullptr;
+    const std::string* path = nullptr;
+    const ZipEntry* entry = nullptr;
+    uint64 offset = 0;
+    bool raw = false;
+};
+
+struct EntryOrderSettings
+{
+    bool enabled = false;
+    std::string profile_path;
+};
+
+// Lays pakfile entries out so the game reads them in long sequential runs. Entries in the load order profile come first,
+// in the order the game loaded them. Each VTF follows the first VMT that references it, each model's files follow its
+// .mdl, and everything else stays next to its folder's neighbours
+class EntryOrder
+{
+
+public:
+
+    EntryOrder(const EntryOrderSettings& settings) : settings(settings) {}
+
+    // The profile is a text file of internal paths, one per line, as they were loaded. Repeats keep their first position
+    bool LoadProfile()
+    {
+        profile.clear();
+        if (settings.profile_path.empty())
+            return true;
+
+        std::ifstream stream(settings.profile_path);
+        if (stream.fail())
+        {
+            ConsolePrintf(RED, "Failed to open the load order profile at %s\n", settings.profile_path.c_str());
+            return false;
+        }
+
+        std::string line;
+        while (std::getline(stream, line))
+        {
+            size_t first = line.find_first_not_of(" \t\r\"");
+            size_t last = line.find_last_not_of(" \t\r\"");
+            if (first == std::string::npos)
+                continue;
+
+            std::string key = ToLower(line.substr(first, last - first + 1));
+            FixSlashes(key);
+            profile.emplace(key, (uint32)profile.size());
+        }
+
+        return true;
+    }
+
+    void Sort(std::vector<PakfileSource>& files) const
+    {
+        std::vector<std::string> keys(files.size());
+        std::unordered_map<std::string, size_t> indices;
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            keys[i] = ToLower(*files[i].name);
+            FixSlashes(keys[i]);
+            indices[keys[i]] = i;
+        }
+
+        std::vector<SortKey> sort_keys(files.size());
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            auto found = profile.find(keys[i]);
+            sort_keys[i] = { found != profile.end() ? found->second : UINT32_MAX, &keys[i], 0, &keys[i] };
+        }
+
+        // Model files follow the .mdl of the same name, the one leading the group
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (sort_keys[i].rank != UINT32_MAX || !keys[i].starts_with("models/"))
+                continue;
+
+            size_t slash = keys[i].find_last_of('/');
+            size_t dot = keys[i].find('.', slash);
+            if (dot == std::string::npos)
+                continue;
+
+            std::string extension = keys[i].substr(keys[i].find_last_of('.') + 1);
+            static const char* model_extensions[] = { "mdl", "vvd", "vtx", "phy", "ani" };
+            auto member = std::find_if(std::begin(model_extensions), std::end(model_extensions), [&](const char* value) { return extension == value; });
+            if (member == std::end(model_extensions))
+                continue;
+
+            auto leader = indices.find(keys[i].substr(0, dot) + ".mdl");
+            if (leader == indices.end() || leader->second == i)
+                continue;
+
+            sort_keys[i].rank = sort_keys[leader->second].rank;
+            sort_keys[i].anchor = sort_keys[leader->second].anchor;
+            sort_keys[i].member = (uint32)(member - std::begin(model_extensions));
+        }
+
+        // Every texture a VMT names is claimed by the earliest VMT naming it, so the result doesn't depend on the input order
+        std::vector<uint8> contents;
+        std::vector<std::optional<SortKey>> claims(files.size());
+        for (size_t i = 0; i < files.size(); i++)
+        {
+            if (!keys[i].ends_with(".vmt") || !ReadSmallFile(files[i], contents))
+                continue;
+
+            for (const std::string& texture : TextureReferences(contents))
+            {
+                auto found = indices.find(texture);
+                if (found == indices.end() || sort_keys[found->second].rank != UINT32_MAX)
+                    continue;
+
+                SortKey claim = { sort_keys[i].rank, sort_keys[i].anchor, 1, &keys[found->second] };
+                std::optional<SortKey>& current = claims[found->second];
+                if (!current || LeadsBefore(claim, *current))
+                    current = claim;
+            }
+        }
+
+        for (size_t i = 0; i < files.size(); i++)
+            if (claims[i])
+                sort_keys[i] = *claims[i];
+
+        std::vector<size_t> order(files.size());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b) { return std::tie(sort_keys[a].rank, *sort_keys[a].anchor, sort_keys[a].member, *sort_keys[a].path) < std::tie(sort_keys[b].rank, *sort_keys[b].anchor, sort_keys[b].member, *sort_keys[b].path); });
+
+        std::vector<PakfileSource> sorted;
+        sorted.reserve(files.size());
+        for (size_t i : order)
+            sorted.push_back(files[i]);
+
+        files = std::move(sorted);
+    }
+
+private:
+
+    struct SortKey
+    {
+        uint32 rank;
+        const std::string* anchor;
+        uint32 member;
+        const std::string* path;
+    };
+
+    static bool LeadsBefore(const SortKey& a, const SortKey& b)
+    {
+        return std::tie(a.rank, *a.anchor) < std::tie(b.rank, *b.anchor);
+    }
+
+    // VMTs are small, so anything larger isn't worth reading. Compressed entries of the source's pakfile are left alone
+    static bool ReadSmallFile(const PakfileSource& file, std::vector<uint8>& contents)
+    {
+        if (file.raw)
+            return false;
+
+        std::error_code ec;
+        uint64 size = file.entry ? file.entry->uncompressed_size : std::filesystem::file_size(*file.path, ec);
+        if (ec || size > 65536)
+            return false;
+
+        return file.entry ? ReadFileRange(*file.path, file.offset, size, contents) : ReadFileContents(*file.path, contents);
+    }
+
+    // Any word of a VMT might be a texture, so each is tried as one
+    static std::vector<std::string> TextureReferences(const std::vector<uint8>& contents)
+    {
+        std::vector<std::string> textures;
+        std::string word;
+        for (size_t i = 0; i <= contents.size(); i++)
+        {
+            char c = i < contents.size() ? (char)contents[i] : ' ';
+            if (!isspace((unsigned char)c) && c != '"' && c != '{' && c != '}')
+            {
+                word += (char)tolower((unsigned char)c);
+                continue;
+            }
+
+            if (word.length() > 1 && word[0] != '$' && word[0] != '%')
+            {
+                FixSlashes(word);
+                word.erase(std::unique(word.begin(), word.end(), [](char a, char b) { return a == '/' && b == '/'; }), word.end());
+                if (word.starts_with("materials/"))
+                    word.erase(0, 10);
+
+                if (!word.ends_with(".vtf"))
+                    word += ".vtf";
+
+                textures.push_back("materials/" + word);
+            }
+
+            word.clear();
+        }
+
+        return textures;
+    }
+
+    const EntryOrderSettings& settings;
+    std::unordered_map<std::string, uint32> profile;
+};
+
+// Streams a zip archive into an output one entry at a time. Entry data goes straight from its source to the output
+// through a pooled buffer, and only compact central directory records are kept in memory
+class PakfileWriter
+{
+
+public:
+
+    PakfileWriter(std::ostream& output, BufferPool& pool, CompressionPolicy* policy, const PackerLimits& limits)
+        : PakfileWriter(output, pool, policy, limits, output.tellp()) {}
+
+    // Writes into an archive that starts at an earlier position of the output
+    PakfileWriter(std::ostream& output, BufferPool& pool, CompressionPolicy* policy, const PackerLimits& limits, std::streamoff start)
+        : output(output), pool(pool), policy(policy), limits(limits), start(start) {}
+
+    // Lists an entry that's already in the archive without writing anything
+    void Keep(const ZipEntry& entry)
+    {
+        Record record = {};
+        record.name_offset = (uint32)names.size();
+        record.name_length = (uint16)entry.name.length();
+        record.method = entry.method;
+        record.flags = entry.flags;
+        record.time = entry.time;
+        record.date = entry.date;
+        record.crc = entry.crc;
+        record.compressed_size = entry.compressed_size;
+        record.uncompressed_size = entry.uncompressed_size;
+        record.local_offset = entry.local_offset;
+        names += entry.name;
+        records.push_back(record);
+    }
+
+    bool AddFile(const std::string& name, const std::string& path)
+    {
+        std::ifstream source(path, std::ios::binary | std::ios::ate);
+        if (source.fail())
+        {
+            ConsolePrintf(RED, "Failed to open the asset %s\n", path.c_str());
+            return false;
+        }
+
+        uint64 size = (uint64)source.tellg();
+        uint16 time, date;
+        GetDosTime(path, time, date);
+        return WriteEntry(name, source, 0, size, time, date);
+    }
+
+    // Adds files in order, compressing them on worker threads ahead of the writer. Only a window of entries may be done
+    // and waiting at once, and files above the entry limit are left to the writer to stream, which bounds the memory used
+    bool AddFiles(const std::vector<PakfileSource>& files)
+    {
+        if (!policy || limits.threads <= 1 || files.size() <= 1)
+        {
+            for (const PakfileSource& file : files)
+                if (!AddSource(file))
+                    return false;
+
+            return true;
+        }
+
+        size_t window = (size_t)limits.threads * 2;
+        std::vector<std::unique_ptr<PreparedEntry>> prepared(files.size());
+        std::mutex mutex;
+        std::condition_variable work_available, entry_ready;
+        size_t next_job = 0;
+        size_t next_write = 0;
+        bool aborted = false;
+
+        auto worker = [&]()
+        {
+            while (true)
+            {
+                size_t index;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    work_available.wait(lock, [&]() { return aborted || next_job >= files.size() || next_job < next_write + window; });
+                    if (aborted || next_job >= files.size())
+                        return;
+
+                    index = next_job++;
+                }
+
+                std::unique_ptr<PreparedEntry> entry = Prepare(files[index]);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    prepared[index] = std::move(entry);
+                }
+
+                entry_ready.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (uint32 i = 0; i < std::min<size_t>(limits.threads, files.size()); i++)
+            threads.emplace_back(worker);
+
+        // Write entries strictly in order as they become ready
+        bool success = true;
+        for (size_t i = 0; i < files.size() && success; i++)
+        {
+            std::unique_ptr<PreparedEntry> entry;
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                entry_ready.wait(lock, [&]() { return prepared[i] != nullptr; });
+                entry = std::move(prepared[i]);
+                next_write = i + 1;
+            }
+
+            work_available.notify_all();
+            success = entry->streamed ? AddSource(files[i]) : WritePrepared(*files[i].name, *entry);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            aborted = true;
+        }
+
+        work_available.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        return success;
+    }
+
+    // Adds the decompressed data of an entry of another zip archive, stored
+    bool AddDecompressed(const ZipEntry& entry, std::vector<uint8>&& data)
+    {
+        PreparedEntry prepared;
+        prepared.time = entry.time;
+        prepared.date = entry.date;
+        prepared.crc = entry.crc;
+        prepared.size = entry.uncompressed_size;
+        prepared.data = std::move(data);
+        g_PackMemory.Add((int64)prepared.data.capacity());
+        return WritePrepared(entry.name, prepared);
+    }
+
+    // Adds an LZMA entry of another zip archive stored, decompressing it straight into the output instead of holding it
+    bool AddDecompressedStream(const ZipEntry& entry, std::istream& source, uint64 data_offset)
+    {
+        // Zip LZMA data starts with the encoder version and the size of the properties that follow
+        uint8 lzma_prefix[4 + LZMA_PROPS_SIZE];
+        source.clear();
+        if (entry.compressed_size <= sizeof(lzma_prefix) || source.seekg(data_offset).read((char*)lzma_prefix, sizeof(lzma_prefix)).fail())
+            return Fail(entry.name);
+
+        PooledBuffer buffer(pool);
+        Record record = MakeRecord(entry.name, entry.time, entry.date);
+        record.method = ZIP_METHOD_STORE;
+        record.crc = entry.crc;
+        record.compressed_size = entry.uncompressed_size;
+        record.uncompressed_size = entry.uncompressed_size;
+        WriteLocalHeader(record);
+
+        uint32 crc = 0;
+        if (!LZMADecompressStream(source, data_offset + sizeof(lzma_prefix), entry.compressed_size - sizeof(lzma_prefix), lzma_prefix + 4, entry.uncompressed_size, output, buffer.data, pool.BufferSize(), &crc) || crc != entry.crc)
+            return Fail(entry.name);
+
+        records.push_back(record);
+        return true;
+    }
+
+    // Adds an entry of another zip archive, recompressing it only if it's stored
+    bool AddEntry(const ZipEntry& entry, std::istream& source, uint64 data_offset)
+    {
+        if (entry.method == ZIP_METHOD_STORE)
+            return WriteEntry(entry.name, source, data_offset, entry.uncompressed_size, entry.time, entry.date);
+
+        PooledBuffer buffer(pool);
+        Record record = MakeRecord(entry.name, entry.time, entry.date);
+        record.method = entry.method;
+        record.flags = entry.flags;
+        record.crc = entry.crc;
+        record.compressed_size = entry.compressed_size;
+        record.uncompressed_size = entry.uncompressed_size;
+        WriteLocalHeader(record);
+        if (!CopyStreamRange(source, data_offset, entry.compressed_size, output, buffer.data, pool.BufferSize()))
+            return Fail(entry.name);
+
+        records.push_back(record);
+        return true;
+    }
+
+    // Writes the central directory and returns the archive's total size
+    bool Finish(uint64& size)
+    {
+        uint64 directory_offset = Position();
+        for (const Record& record : records)
+        {
+            ZipCentralFileHeader header = {};
+            header.signature = ZIP_CENTRAL_FILE_SIGNATURE;
+            header.version_made_by = 20;
+            header.version_needed = record.method == ZIP_METHOD_LZMA ? 63 : 10;
+            header.flags = record.flags;
+            header.method = record.method;
+            header.time = record.time;
+            header.date = record.date;
+            header.crc = record.crc;
+            header.compressed_size = record.compressed_size;
+            header.uncompressed_size = record.uncompressed_size;
+            header.name_length = record.name_length;
+            header.local_offset = record.local_offset;
+            output.write((const char*)&header, sizeof(header));
+            output.write(names.data() + record.name_offset, record.name_length);
+        }
+
+        ZipEndOfDirectory eocd = {};
+        eocd.signature = ZIP_END_OF_DIRECTORY_SIGNATURE;
+        eocd.disk_entries = eocd.total_entries = (uint16)std::min<size_t>(records.size(), 0xFFFF);
+        eocd.directory_offset = (uint32)directory_offset;
+        eocd.directory_size = (uint32)(Position() - directory_offset);
+        output.write((const char*)&eocd, sizeof(eocd));
+
+        size = Position();
+        if (records.size() > 0xFFFF || size > (uint64)std::numeric_limits<int32>::max())
+        {
+            ConsolePrintf(RED, "The pakfile exceeds the limits of the bsp format (%llu entries, %llu bytes)\n", (uint64)records.size(), size);
+            return false;
+        }
+
+        return !output.fail();
+    }
+
+    size_t EntryCount() const
+    {
+        return records.size();
+    }
+
+private:
+
+    // Everything the central directory needs, with the name kept in a shared string instead of its own allocation
+    struct Record
+    {
+        uint32 name_offset;
+        uint16 name_length;
+        uint16 method;
+        uint16 flags;
+        uint16 time;
+        uint16 date;
+        uint32 crc;
+        uint32 compressed_size;
+        uint32 uncompressed_size;
+        uint32 local_offset;
+    };
+
+    // An entry compressed or judged not worth compressing by a worker, waiting for its turn to be written
+    struct PreparedEntry
+    {
+        bool streamed = false;
+        uint16 method = ZIP_METHOD_STORE;
+        uint16 time = 0;
+        uint16 date = 0;
+        uint32 crc = 0;
+        uint32 size = 0;
+        uint8 props[LZMA_PROPS_SIZE] = {};
+        std::vector<uint8> data;
+
+        ~PreparedEntry()
+        {
+            g_PackMemory.Add(-(int64)data.capacity());
+        }
+    };
+
+    bool AddSource(const PakfileSource& file)
+    {
+        if (!file.entry)
+            return AddFile(*file.name, *file.path);
+
+        std::ifstream source(*file.path, std::ios::binary);
+        if (source.fail())
+        {
+            ConsolePrintf(RED, "Failed to open %s\n", file.path->c_str());
+            return false;
+        }
+
+        if (file.raw)
+            return AddEntry(*file.entry, source, file.offset);
+
+        return WriteEntry(*file.name, source, file.offset, file.entry->uncompressed_size, file.entry->time, file.entry->date);
+    }
+
+    std::unique_ptr<PreparedEntry> Prepare(const PakfileSource& file)
+    {
+        const std::string& name = *file.name;
+        std::unique_ptr<PreparedEntry> entry = std::make_unique<PreparedEntry>();
+        std::error_code ec;
+        uint64 size = file.entry ? file.entry->uncompressed_size : std::filesystem::file_size(*file.path, ec);
+        if (file.raw || ec || size > limits.entry_limit)
+        {
+            // Too large to hold, so the writer streams it, and reports any error, when its turn comes
+            entry->streamed = true;
+            return entry;
+        }
+
+        std::vector<uint8> contents;
+        g_PackMemory.Add((int64)size);
+        bool read = file.entry ? ReadFileRange(*file.path, file.offset, size, contents) : ReadFileContents(*file.path, contents);
+        g_PackMemory.Add(-(int64)size);
+        if (!read || contents.size() != size)
+        {
+            entry->streamed = true;
+            return entry;
+        }
+
+        if (file.entry)
+        {
+            entry->time = file.entry->time;
+            entry->date = file.entry->date;
+        }
+        else
+            GetDosTime(*file.path, entry->time, entry->date);
+
+        entry->crc = CRC32(contents.data(), contents.size());
+        entry->size = (uint32)size;
+
+        // Sampled the same as a streamed entry, so an entry comes out the same whichever way it's written
+        size_t sample_size = (size_t)std::min<uint64>(size, std::min<size_t>(policy->SampleSize(), pool.BufferSize()));
+        CompressionDecision decision = sample_size ? policy->Decide(name, contents.data(), sample_size, size) : CompressionDecision();
+        if (decision.complete)
+        {
+            entry->method = ZIP_METHOD_LZMA;
+            entry->data = std::move(decision.data);
+            memcpy(entry->props, decision.props, sizeof(entry->props));
+            policy->RecordCompressed(name, size, entry->data.size() + 4 + LZMA_PROPS_SIZE, decision.seconds);
+        }
+        else if (decision.compress)
+        {
+            auto compress_start = std::chrono::steady_clock::now();
+            std::vector<uint8> compressed;
+            bool fits = LZMACompress(contents.data(), contents.size(), compressed, entry->props, 5, limits.dictionary_size) && compressed.size() <= size * policy->MinRatio();
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - compress_start).count();
+            if (fits)
+            {
+                entry->method = ZIP_METHOD_LZMA;
+                entry->data = std::move(compressed);
+                policy->RecordCompressed(name, size, entry->data.size() + 4 + LZMA_PROPS_SIZE, decision.seconds + seconds);
+            }
+            else
+                policy->RecordStored(name, size, decision, seconds);
+        }
+        else
+            policy->RecordStored(name, size, decision, 0.0);
+
+        if (entry->method == ZIP_METHOD_STORE)
+            entry->data = std::move(contents);
+
+        g_PackMemory.Add((int64)entry->data.capacity());
+        return entry;
+    }
+
+    bool WritePrepared(const std::string& name, const PreparedEntry& entry)
+    {
+        if (entry.data.size() > 0xFFFFFFFF || Position() > 0xFFFFFFFF || name.length() > 0xFFFF)
+        {
+            ConsolePrintf(RED, "The pakfile entry %s is too large for the bsp format\n", name.c_str());
+            return false;
+        }
+
+        const uint8 lzma_prefix[4] = { 9, 20, LZMA_PROPS_SIZE, 0 };
+        bool compressed = entry.method == ZIP_METHOD_LZMA;
+        Record record = MakeRecord(name, entry.time, entry.date);
+        record.method = entry.method;
+        record.crc = entry.crc;
+        record.compressed_size = (uint32)(entry.data.size() + (compressed ? sizeof(lzma_prefix) + LZMA_PROPS_SIZE : 0));
+        record.uncompressed_size = entry.size;
+        WriteLocalHeader(record);
+        if (compressed)
+        {
+            output.write((const char*)lzma_prefix, sizeof(lzma_prefix));
+            output.write((const char*)entry.props, LZMA_PROPS_SIZE);
+        }
+
+        output.write((const char*)entry.data.data(), entry.data.size());
+        records.push_back(record);
+        return !output.fail() || Fail(name);
+    }
+
+    uint64 Position()
+    {
+        return (uint64)(output.tellp() - start);
+    }
+
+    Record MakeRecord(const std::string& name, uint16 time, uint16 date)
+    {
+        Record record = {};
+        record.name_offset = (uint32)names.size();
+        record.name_length = (uint16)name.length();
+        record.time = limits.deterministic ? DETERMINISTIC_DOS_TIME : time;
+        record.date = limits.deterministic ? DETERMINISTIC_DOS_DATE : date;
+        record.local_offset = (uint32)Position();
+        names += name;
+        return record;
+    }
+
+    void WriteLocalHeader(const Record& record)
+    {
+        ZipLocalFileHeader header = {};
+        header.signature = ZIP_LOCAL_FILE_SIGNATURE;
+        header.version_needed = record.method == ZIP_METHOD_LZMA ? 63 : 10;
+        header.flags = record.flags;
+        header.method = record.method;
+        header.time = record.time;
+        header.date = record.date;
+        header.crc = record.crc;
+        header.compressed_size = record.compressed_size;
+        header.uncompressed_size = record.uncompressed_size;
+        header.name_length = record.name_length;
+        output.write((const char*)&header, sizeof(header));
+        output.write(names.data() + record.name_offset, record.name_length);
+    }
+
+    bool Fail(const std::string& name)
+    {
+        ConsolePrintf(RED, "Failed to write the pakfile entry %s\n", name.c_str());
+        return false;
+    }
+
+    bool WriteEntry(const std::string& name, std::istream& source, uint64 offset, uint64 size, uint16 time, uint16 date)
+    {
+        if (size > 0xFFFFFFFF || Position() > 0xFFFFFFFF || name.length() > 0xFFFF)
+        {
+            ConsolePrintf(RED, "The pakfile entry %s is too large for the bsp format\n", name.c_str());
+            return false;
+        }
+
+        PooledBuffer buffer(pool);
+        Record record = MakeRecord(name, time, date);
+        record.uncompressed_size = (uint32)size;
+
+        // Let the policy judge the entry by its head, which stays in the buffer
+        CompressionDecision decision;
+        size_t sample_size = policy ? (size_t)std::min<uint64>(size, std::min<size_t>(policy->SampleSize(), pool.BufferSize())) : 0;
+        if (sample_size)
+        {
+            source.clear();
+            if (source.seekg(offset).read((char*)buffer.data, sample_size).fail())
+                return Fail(name);
+
+            decision = policy->Decide(name, buffer.data, sample_size, size);
+        }
+
+        // Zip LZMA data starts with the encoder version and the size of the properties that follow
+        const uint8 lzma_prefix[4] = { 9, 20, LZMA_PROPS_SIZE, 0 };
+        std::streamoff header_pos = output.tellp();
+        record.method = decision.compress ? ZIP_METHOD_LZMA : ZIP_METHOD_STORE;
+        WriteLocalHeader(record);
+        std::streamoff data_pos = output.tellp();
+
+        bool compressed = false;
+        if (decision.complete)
+        {
+            output.write((const char*)lzma_prefix, sizeof(lzma_prefix));
+            output.write((const char*)decision.props, sizeof(decision.props));
+            output.write((const char*)decision.data.data(), decision.data.size());
+            record.crc = CRC32(buffer.data, sample_size);
+            record.compressed_size = (uint32)(sizeof(lzma_prefix) + sizeof(decision.props) + decision.data.size());
+            policy->RecordCompressed(name, size, record.compressed_size, decision.seconds);
+            compressed = true;
+        }
+        else if (decision.compress)
+        {
+            auto compress_start = std::chrono::steady_clock::now();
+            output.write((const char*)lzma_prefix, sizeof(lzma_prefix));
+            output.write((const char*)decision.props, sizeof(decision.props));
+
+            uint64 limit = (uint64)(size * policy->MinRatio());
+            LZMAStreamResult result = LZMACompressStream(source, offset, size, output, limit, limits.dictionary_size);
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - compress_start).count();
+            if (result.read_error)
+                return Fail(name);
+
+            if (result.success)
+            {
+                std::streamoff data_end = output.tellp();
+                output.seekp(data_pos + (std::streamoff)sizeof(lzma_prefix));
+                output.write((const char*)result.props, sizeof(result.props));
+                output.seekp(data_end);
+
+                record.crc = result.crc;
+                record.compressed_size = (uint32)(sizeof(lzma_prefix) + sizeof(result.props) + result.written);
+                policy->RecordCompressed(name, size, record.compressed_size, decision.seconds + seconds);
+                compressed = true;
+            }
+            else
+            {
+                // Didn't shrink enough, so rewind and store it instead
+                output.clear();
+                output.seekp(data_pos);
+                decision.seconds += seconds;
+            }
+        }
+
+        if (!compressed)
+        {
+            record.method = ZIP_METHOD_STORE;
+            record.compressed_size = (uint32)size;
+            if (!CopyStreamRange(source, offset, size, output, buffer.data, pool.BufferSize(), &record.crc))
+                return Fail(name);
+
+            if (policy)
+                policy->RecordStored(name, size, decision, 0.0);
+        }
+
+        // Now that the data is known, fill in the local header
+        std::streamoff end_pos = output.tellp();
+        output.seekp(header_pos);
+        WriteLocalHeader(record);
+        output.seekp(end_pos);
+
+        records.push_back(record);
+        return !output.fail() || Fail(name);
+    }
+
+    std::ostream& output;
+    BufferPool& pool;
+    CompressionPolicy* policy;
+    const PackerLimits& limits;
+    std::streamoff start;
+    std::vector<Record> records;
+    std::string names;
+};
+
+// Checks that every lump of a header lies after it and inside the file, without overlapping another. Empty lumps can
+// point anywhere, as nothing is read from them
+static bool IsConsistentHeader(const BSPHeader& header, uint64 file_size)
+{
+    std::vector<std::pair<uint64, uint64>> ranges;
+    for (const BSPLump& lump : header.lumps)
+    {
+        if (lump.fileofs < 0 || lump.filelen < 0 || (lump.filelen && (uint64)lump.fileofs + lump.filelen > file_size))
+            return false;
+
+        if (lump.filelen)
+            ranges.emplace_back((uint64)lump.fileofs, (uint64)lump.fileofs + lump.filelen);
+    }
+
+    std::sort(ranges.begin(), ranges.end());
+    for (size_t i = 0; i < ranges.size(); i++)
+        if (ranges[i].first < sizeof(header) || (i && ranges[i].first < ranges[i - 1].second))
+            return false;
+
+    return header.ident == BSP_IDENT;
+}
+
+// Finds out whether any lump, game lump child or pakfile entry of a bsp is LZMA compressed
+static bool ReadBSPCompression(const std::string& path, bool& compressed)
+{
+    std::ifstream stream(path, std::ios::binary);
+    BSPHeader header;
+    if (stream.fail() || stream.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+        return false;
+
+    compressed = std::any_of(std::begin(header.lumps), std::end(header.lumps), [](const BSPLump& lump) { return lump.uncompressed_size != 0; });
+    if (compressed)
+        return true;
+
+    const BSPLump& game_lump = header.lumps[BSP_LUMP_GAME_LUMP];
+    int32 count = 0;
+    if (game_lump.filelen >= (int32)sizeof(count))
+    {
+        if (stream.seekg(game_lump.fileofs).read((char*)&count, sizeof(count)).fail() || count < 0 || sizeof(count) + (uint64)count * sizeof(BSPGameLump) > (uint64)game_lump.filelen)
+            return false;
+
+        std::vector<BSPGameLump> children(count);
+        if (count && stream.read((char*)children.data(), count * sizeof(BSPGameLump)).fail())
+            return false;
+
+        compressed = std::any_of(children.begin(), children.end(), [](const BSPGameLump& child) { return (child.flags & GAME_LUMP_FLAG_COMPRESSED) != 0; });
+        if (compressed)
+            return true;
+    }
+
+    const BSPLump& pakfile = header.lumps[BSP_LUMP_PAKFILE];
+    std::vector<ZipEntry> entries;
+    if (pakfile.filelen > 0 && !ReadZipDirectory(stream, (uint64)pakfile.fileofs, (uint64)pakfile.filelen, entries))
+        return false;
+
+    compressed = std::any_of(entries.begin(), entries.end(), [](const ZipEntry& entry) { return entry.method != ZIP_METHOD_STORE; });
+    return true;
+}
+
+// Builds an output bsp from a source bsp and a list of assets, streaming everything through bounded buffers. Lumps and
+// pakfile entries the source already compressed are kept as they are
+class BSPPacker
+{
+
+public:
+
+    BSPPacker(BufferPool& pool, CompressionPolicy& policy, const PackerLimits& limits, const OutputSettings& output_settings)
+        : pool(pool), policy(policy), limits(limits), output_settings(output_settings) {}
+
+    void PrintMergeSummary() const
+    {
+        if (merge_stats.copied || merge_stats.compressed || merge_stats.replaced)
+            ConsolePrintf(AQUA, "Existing pakfile entries: %llu copied as they were, %llu stored ones left to the compression policy, %llu replaced by assets\n", merge_stats.copied.load(), merge_stats.compressed.load(), merge_stats.replaced.load());
+    }
+
+    // Asset lists hold pairs of internal and source paths. When an internal path repeats, the last one wins, and assets replace existing pakfile entries
+    bool Pack(const std::string& source_path, const std::vector<const std::vector<std::string>*>& asset_lists, const std::string& output_path, bool compress, LumpStrip* strip = nullptr)
+    {
+        std::ifstream input(source_path, std::ios::binary);
+        BSPHeader header;
+        if (input.fail() || input.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+        {
+            ConsolePrintf(RED, "Failed to read a valid bsp header from %s\n", source_path.c_str());
+            return false;
+        }
+
+        // The output can't be much larger than the source and every asset stored. Files that can't be measured count
+        // as empty, and are reported when they fail to be read
+        std::error_code ec;
+        auto file_size = [&](const std::string& path)
+        {
+            uint64 size = std::filesystem::file_size(path, ec);
+            return ec ? 0 : size;
+        };
+
+        uint64 expected_size = file_size(source_path);
+        for (const std::vector<std::string>* list : asset_lists)
+            for (size_t i = 0; i + 1 < list->size(); i += 2)
+                expected_size += file_size((*list)[i + 1]) + sizeof(ZipLocalFileHeader) + sizeof(ZipCentralFileHeader) + (*list)[i].length() * 2;
+
+        std::string temp_path(output_path + ".tmp");
+        OutputFile output_file;
+        std::ostream output(&output_file);
+        if (!output_file.Open(temp_path, expected_size, output_settings))
+        {
+            ConsolePrintf(RED, "Failed to create %s\n", temp_path.c_str());
+            return false;
+        }
+
+        // Keep the original lump order, but always put the pakfile last. Stripped lumps are left empty, and empty lumps
+        // don't keep offsets into the source
+        BSPHeader new_header = header;
+        std::vector<int> order;
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+        {
+            if (strip && (strip->lumps >> i) & 1)
+            {
+                strip->saved[i] = (uint64)std::max(header.lumps[i].filelen, 0);
+                new_header.lumps[i].fileofs = new_header.lumps[i].filelen = 0;
+                new_header.lumps[i].uncompressed_size = 0;
+            }
+            else if (i != BSP_LUMP_PAKFILE && header.lumps[i].filelen > 0)
+                order.push_back(i);
+            else if (i != BSP_LUMP_PAKFILE && !header.lumps[i].filelen)
+                new_header.lumps[i].fileofs = 0;
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return header.lumps[a].fileofs < header.lumps[b].fileofs; });
+        output.write((const char*)&new_header, sizeof(new_header));
+
+        PooledBuffer buffer(pool);
+        for (int index : order)
+        {
+            if (!WriteLump(input, output, header.lumps[index], new_header.lumps[index], index, compress, buffer.data, strip))
+            {
+                ConsolePrintf(RED, "Failed to write lump %d of %s\n", index, output_path.c_str());
+                return false;
+            }
+        }
+
+        PadTo4(output);
+        BSPLump& pakfile = new_header.lumps[BSP_LUMP_PAKFILE];
+        pakfile.fileofs = (int32)output.tellp();
+        pakfile.uncompressed_size = 0;
+
+        uint64 pakfile_size = 0;
+        if (!WritePakfile(input, source_path, header.lumps[BSP_LUMP_PAKFILE], asset_lists, output, compress, pakfile_size))
+            return false;
+
+        pakfile.filelen = (int32)pakfile_size;
+        uint64 total_size = (uint64)output.tellp();
+        output.seekp(0);
+        output.write((const char*)&new_header, sizeof(new_header));
+        bool closed = output_file.Close();
+        input.close();
+        if (output.fail() || !closed || total_size > (uint64)std::numeric_limits<int32>::max())
+        {
+            ConsolePrintf(RED, "Failed to write %s\n", temp_path.c_str());
+            return false;
+        }
+
+        if (!IsConsistentHeader(new_header, total_size))
+        {
+            ConsolePrintf(RED, "The rewritten header of %s has lumps outside the file or overlapping each other\n", temp_path.c_str());
+            return false;
+        }
+
+        // Entries that were compressed and then stored can leave stale bytes past the end
+        std::filesystem::resize_file(temp_path, total_size, ec);
+        if (!ec)
+            std::filesystem::rename(temp_path, output_path, ec);
+
+        if (ec)
+        {
+            ConsolePrintf(RED, "Failed to move %s to %s\n", temp_path.c_str(), output_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Writes a copy of a bsp with every LZMA compressed lump, game lump child and pakfile entry decompressed. Compressed
+    // lumps are decompressed on the packer's threads ahead of the writer, which copies the rest in between and streams
+    // lumps too large to hold in memory itself
+    bool Decompress(const std::string& source_path, const std::string& output_path)
+    {
+        std::ifstream input(source_path, std::ios::binary);
+        BSPHeader header;
+        if (input.fail() || input.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+        {
+            ConsolePrintf(RED, "Failed to read a valid bsp header from %s\n", source_path.c_str());
+            return false;
+        }
+
+        if (header.lumps[BSP_LUMP_PAKFILE].uncompressed_size || header.lumps[BSP_LUMP_GAME_LUMP].uncompressed_size)
+        {
+            ConsolePrintf(RED, "The pakfile or game lump of %s is compressed as a whole, which Source doesn't do\n", source_path.c_str());
+            return false;
+        }
+
+        std::error_code ec;
+        uint64 expected_size = std::filesystem::file_size(source_path, ec);
+        if (ec)
+            expected_size = 0;
+
+        std::vector<int> order;
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+        {
+            expected_size += header.lumps[i].uncompressed_size;
+            if (i != BSP_LUMP_PAKFILE && header.lumps[i].filelen > 0)
+                order.push_back(i);
+        }
+
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return header.lumps[a].fileofs < header.lumps[b].fileofs; });
+
+        std::string temp_path(output_path + ".tmp");
+        OutputFile output_file;
+        std::ostream output(&output_file);
+        if (!output_file.Open(temp_path, expected_size, output_settings))
+        {
+            ConsolePrintf(RED, "Failed to create %s\n", temp_path.c_str());
+            return false;
+        }
+
+        std::vector<int> jobs;
+        for (int index : order)
+            if (header.lumps[index].uncompressed_size && header.lumps[index].uncompressed_size <= limits.entry_limit && (uint64)header.lumps[index].filelen <= limits.entry_limit)
+                jobs.push_back(index);
+
+        struct DecompressedLump
+        {
+            bool done = false;
+            bool failed = false;
+            std::vector<uint8> data;
+        };
+
+        size_t window = (size_t)std::max<uint32>(limits.threads, 1) * 2;
+        std::vector<DecompressedLump> decompressed(jobs.size());
+        std::mutex mutex;
+        std::condition_variable work_available, lump_ready;
+        size_t next_job = 0;
+        size_t next_write = 0;
+        bool aborted = false;
+
+        auto worker = [&]()
+        {
+            std::ifstream stream(source_path, std::ios::binary);
+            while (true)
+            {
+                size_t job;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    work_available.wait(lock, [&]() { return aborted || next_job >= jobs.size() || next_job < next_write + window; });
+                    if (aborted || next_job >= jobs.size())
+                        return;
+
+                    job = next_job++;
+                }
+
+                std::vector<uint8> data;
+                bool read = ReadLZMALump(stream, header.lumps[jobs[job]], data);
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    decompressed[job].data = std::move(data);
+                    decompressed[job].failed = !read;
+                    decompressed[job].done = true;
+                }
+
+                lump_ready.notify_all();
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (uint32 i = 0; i < std::min<size_t>(std::max<uint32>(limits.threads, 1), jobs.size()); i++)
+            threads.emplace_back(worker);
+
+        BSPHeader new_header = header;
+        for (BSPLump& lump : new_header.lumps)
+            if (!lump.filelen)
+                lump.fileofs = 0;
+
+        output.write((const char*)&new_header, sizeof(new_header));
+
+        PooledBuffer buffer(pool);
+        bool success = true;
+        size_t job = 0;
+        for (int index : order)
+        {
+            const BSPLump& src = header.lumps[index];
+            BSPLump& dst = new_header.lumps[index];
+            PadTo4(output);
+            dst.fileofs = (int32)output.tellp();
+            dst.uncompressed_size = 0;
+
+            if (index == BSP_LUMP_GAME_LUMP)
+                success = WriteDecompressedGameLump(input, src, output, buffer.data, pool.BufferSize());
+            else if (!src.uncompressed_size)
+                success = CopyStreamRange(input, src.fileofs, src.filelen, output, buffer.data, pool.BufferSize());
+            else if (job < jobs.size() && jobs[job] == index)
+            {
+                std::vector<uint8> data;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    lump_ready.wait(lock, [&]() { return decompressed[job].done; });
+                    success = !decompressed[job].failed;
+                    data = std::move(decompressed[job].data);
+                    next_write = ++job;
+                }
+
+                work_available.notify_all();
+                success = success && !output.write((const char*)data.data(), data.size()).fail();
+                g_PackMemory.Add(-(int64)data.capacity());
+            }
+            else
+            {
+                LZMALumpHeader lzma_header;
+                input.clear();
+                success = !input.seekg(src.fileofs).read((char*)&lzma_header, sizeof(lzma_header)).fail() && IsValidLZMALump(lzma_header, src)
+                    && LZMADecompressStream(input, (uint64)src.fileofs + sizeof(lzma_header), lzma_header.lzma_size, lzma_header.properties, lzma_header.actual_size, output, buffer.data, pool.BufferSize());
+            }
+
+            if (!success)
+            {
+                ConsolePrintf(RED, "Failed to decompress lump %d of %s\n", index, source_path.c_str());
+                break;
+            }
+
+            dst.filelen = (int32)((uint64)output.tellp() - dst.fileofs);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            aborted = true;
+        }
+
+        work_available.notify_all();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        // Lumps decompressed ahead of a failure were never written
+        for (size_t i = job; i < decompressed.size(); i++)
+            g_PackMemory.Add(-(int64)decompressed[i].data.capacity());
+
+        if (!success)
+            return false;
+
+        PadTo4(output);
+        BSPLump& pakfile = new_header.lumps[BSP_LUMP_PAKFILE];
+        pakfile.fileofs = (int32)output.tellp();
+
+        uint64 pakfile_size = 0;
+        if (!DecompressPakfile(input, header.lumps[BSP_LUMP_PAKFILE], output, pakfile_size))
+            return false;
+
+        pakfile.filelen = (int32)pakfile_size;
+        uint64 total_size = (uint64)output.tellp();
+        output.seekp(0);
+        output.write((const char*)&new_header, sizeof(new_header));
+        bool closed = output_file.Close();
+        input.close();
+        if (output.fail() || !closed || total_size > (uint64)std::numeric_limits<int32>::max())
+        {
+            ConsolePrintf(RED, "Failed to write %s\n", temp_path.c_str());
+            return false;
+        }
+
+        std::filesystem::resize_file(temp_path, total_size, ec);
+        if (!ec)
+            std::filesystem::rename(temp_path, output_path, ec);
+
+        if (ec)
+        {
+            ConsolePrintf(RED, "Failed to move %s to %s\n", temp_path.c_str(), output_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Replaces or appends the changed assets of an output whose pakfile is the last thing in the file, then rewrites
+    // the central directory and the lump header in place. Returns false if the output has to be rebuilt instead
+    bool Patch(const std::string& output_path, const std::vector<const std::vector<std::string>*>& asset_lists, bool compress, const std::vector<std::string>& previous_assets, size_t& changed)
+    {
+        std::fstream stream(output_path, std::ios::binary | std::ios::in | std::ios::out);
+        BSPHeader header;
+        if (stream.fail() || stream.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+            return false;
+
+        uint64 file_size = std::filesystem::file_size(output_path);
+        auto output_time = std::filesystem::last_write_time(output_path);
+        BSPLump& pakfile = header.lumps[BSP_LUMP_PAKFILE];
+        if (pakfile.filelen <= 0 || pakfile.uncompressed_size || (uint64)pakfile.fileofs + pakfile.filelen != file_size)
+            return false;
+
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+            if (i != BSP_LUMP_PAKFILE && header.lumps[i].filelen > 0 && header.lumps[i].fileofs + header.lumps[i].filelen > pakfile.fileofs)
+                return false;
+
+        std::vector<ZipEntry> entries;
+        uint64 directory_offset = 0;
+        if (!ReadZipDirectory(stream, (uint64)pakfile.fileofs, (uint64)pakfile.filelen, entries, &directory_offset))
+            return false;
+
+        std::unordered_map<std::string, const std::string*> asset_sources;
+        std::vector<const std::string*> assets;
+        CollectAssets(asset_lists, asset_sources, assets);
+
+        // A removed asset may have hidden an entry of the source's pakfile, which only a rebuild brings back
+        for (const std::string& name : previous_assets)
+            if (!asset_sources.contains(name))
+                return false;
+
+        std::unordered_map<std::string, size_t> entry_indices;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            std::string key = ToLower(entries[i].name);
+            FixSlashes(key);
+            entry_indices[key] = i;
+        }
+
+        // Assets with the same size and time as their entry are unchanged, and ones that only differ in time are checked by CRC
+        std::vector<bool> replaced(entries.size());
+        std::vector<const std::string*> changed_assets;
+        for (const std::string* internal_path : assets)
+        {
+            std::string key = ToLower(*internal_path);
+            const std::string& source = *asset_sources[key];
+            auto found = entry_indices.find(key);
+            if (found != entry_indices.end())
+            {
+                const ZipEntry& entry = entries[found->second];
+                if (!IsAssetChanged(entry, source, output_time))
+                    continue;
+
+                replaced[found->second] = true;
+            }
+
+            changed_assets.push_back(internal_path);
+        }
+
+        changed = changed_assets.size();
+        if (!changed)
+            return true;
+
+        // Replaced entries are left behind as dead space, so rebuild once too much of the pakfile is wasted
+        uint64 live_bytes = 0;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (entries[i].local_offset >= directory_offset)
+                return false;
+
+            if (!replaced[i])
+                live_bytes += sizeof(ZipLocalFileHeader) + entries[i].name.length() + entries[i].compressed_size;
+        }
+
+        if (directory_offset < live_bytes || directory_offset - live_bytes > directory_offset / 4)
+            return false;
+
+        PakfileWriter writer(stream, pool, compress ? &policy : nullptr, limits, pakfile.fileofs);
+        for (size_t i = 0; i < entries.size(); i++)
+            if (!replaced[i])
+                writer.Keep(entries[i]);
+
+        stream.clear();
+        stream.seekp(pakfile.fileofs + directory_offset);
+        std::vector<PakfileSource> files;
+        for (const std::string* internal_path : changed_assets)
+            files.push_back({ internal_path, asset_sources[ToLower(*internal_path)] });
+
+        if (!writer.AddFiles(files))
+            return false;
+
+        uint64 pakfile_size = 0;
+        if (!writer.Finish(pakfile_size) || (uint64)pakfile.fileofs + pakfile_size > (uint64)std::numeric_limits<int32>::max())
+            return false;
+
+        pakfile.filelen = (int32)pakfile_size;
+        stream.seekp(0);
+        stream.write((const char*)&header, sizeof(header));
+        stream.close();
+        if (stream.fail())
+            return false;
+
+        std::error_code ec;
+        std::filesystem::resize_file(output_path, (uint64)pakfile.fileofs + pakfile_size, ec);
+        return !ec;
+    }
+
+private:
+
+    // Pairs internal paths with their source paths. When an internal path repeats, the last one wins
+    static void CollectAssets(const std::vector<const std::vector<std::string>*>& asset_lists, std::unordered_map<std::string, const std::string*>& asset_sources, std::vector<const std::string*>& assets)
+    {
+        for (const std::vector<std::string>* list : asset_lists)
+        {
+            for (size_t i = 0; i + 1 < list->size(); i += 2)
+            {
+                std::string key = ToLower((*list)[i]);
+                if (!asset_sources.contains(key))
+                    assets.push_back(&(*list)[i]);
+
+                asset_sources[key] = &(*list)[i + 1];
+            }
+        }
+    }
+
+    // Zip times only have a two second resolution, so they're only trusted for assets last written well before the output
+    bool IsAssetChanged(const ZipEntry& entry, const std::string& source, std::filesystem::file_time_type output_time)
+    {
+        std::error_code ec;
+        uint64 size = std::filesystem::file_size(source, ec);
+        if (ec || size != entry.uncompressed_size)
+            return true;
+
+        uint16 time, date;
+        GetDosTime(source, time, date);
+        if (time == entry.time && date == entry.date && std::filesystem::last_write_time(source, ec) + std::chrono::seconds(2) < output_time)
+            return false;
+
+        std::ifstream stream(source, std::ios::binary);
+        PooledBuffer buffer(pool);
+        uint32 crc = 0;
+        while (stream.read((char*)buffer.data, pool.BufferSize()) || stream.gcount())
+            crc = CRC32(buffer.data, (size_t)stream.gcount(), crc);
+
+        return crc != entry.crc;
+    }
+
+    static void PadTo4(std::ostream& output)
+    {
+        static const char zeros[4] = {};
+        std::streamoff pos = output.tellp();
+        if (pos % 4)
+            output.write(zeros, 4 - pos % 4);
+    }
+
+    static bool IsValidLZMALump(const LZMALumpHeader& lzma_header, const BSPLump& lump)
+    {
+        return lzma_header.id == LZMA_LUMP_ID && lzma_header.actual_size == lump.uncompressed_size && sizeof(lzma_header) + (uint64)lzma_header.lzma_size <= (uint64)lump.filelen;
+    }
+
+    // Reads and decompresses a compressed lump. The decompressed data is counted as packing memory until it's freed, and
+    // the compressed data while it's held
+    static bool ReadLZMALump(std::istream& input, const BSPLump& lump, std::vector<uint8>& data)
+    {
+        LZMALumpHeader lzma_header;
+        input.clear();
+        if (input.seekg(lump.fileofs).read((char*)&lzma_header, sizeof(lzma_header)).fail() || !IsValidLZMALump(lzma_header, lump))
+            return false;
+
+        data.resize(lzma_header.actual_size);
+        g_PackMemory.Add((int64)data.capacity());
+
+        std::vector<uint8> compressed(lzma_header.lzma_size);
+        g_PackMemory.Add((int64)compressed.capacity());
+        bool success = !input.read((char*)compressed.data(), compressed.size()).fail()
+            && LZMADecompress(compressed.data(), compressed.size(), lzma_header.properties, data.data(), data.size());
+        g_PackMemory.Add(-(int64)compressed.capacity());
+        return success;
+    }
+
+    // Finds where the data of a pakfile entry starts, past its local header
+    static bool FindEntryData(std::istream& input, const BSPLump& pakfile, const ZipEntry& entry, uint64& data_offset)
+    {
+        ZipLocalFileHeader local;
+        input.clear();
+        if (input.seekg(pakfile.fileofs + entry.local_offset).read((char*)&local, sizeof(local)).fail() || local.signature != ZIP_LOCAL_FILE_SIGNATURE)
+            return false;
+
+        data_offset = (uint64)pakfile.fileofs + entry.local_offset + sizeof(local) + local.name_length + local.extra_length;
+        return true;
+    }
+
+    // Copies a pakfile with its LZMA entries decompressed and stored
+    bool DecompressPakfile(std::istream& input, const BSPLump& src, std::ostream& output, uint64& size)
+    {
+        PakfileWriter writer(output, pool, nullptr, limits);
+        std::vector<ZipEntry> entries;
+        if (src.filelen > 0 && !ReadZipDirectory(input, (uint64)src.fileofs, (uint64)src.filelen, entries))
+        {
+            ConsolePrintf(RED, "Failed to read the existing pakfile\n");
+            return false;
+        }
+
+        // Zip LZMA data starts with the encoder version and the size of the properties that follow. Entries above the entry
+        // limit, or above a pooled buffer when there's none, are decompressed straight into the output
+        const size_t lzma_prefix_size = 4 + LZMA_PROPS_SIZE;
+        uint64 entry_limit = std::max<uint64>(limits.entry_limit, pool.BufferSize());
+        for (const ZipEntry& entry : entries)
+        {
+            uint64 data_offset = 0;
+            bool added = FindEntryData(input, src, entry, data_offset);
+            if (added && entry.method == ZIP_METHOD_STORE)
+                added = writer.AddEntry(entry, input, data_offset);
+            else if (added && entry.method == ZIP_METHOD_LZMA && std::max(entry.compressed_size, entry.uncompressed_size) > entry_limit)
+                added = writer.AddDecompressedStream(entry, input, data_offset);
+            else if (added && entry.method == ZIP_METHOD_LZMA && entry.compressed_size > lzma_prefix_size)
+            {
+                // Both buffers count until the writer takes over the decompressed data
+                std::vector<uint8> compressed(entry.compressed_size);
+                std::vector<uint8> data(entry.uncompressed_size);
+                int64 held = (int64)(compressed.capacity() + data.capacity());
+                g_PackMemory.Add(held);
+                added = !input.seekg(data_offset).read((char*)compressed.data(), compressed.size()).fail()
+                    && LZMADecompress(compressed.data() + lzma_prefix_size, compressed.size() - lzma_prefix_size, compressed.data() + 4, data.data(), data.size())
+                    && CRC32(data.data(), data.size()) == entry.crc;
+
+                compressed = std::vector<uint8>();
+                g_PackMemory.Add(-held);
+                added = added && writer.AddDecompressed(entry, std::move(data));
+            }
+            else
+                added = false;
+
+            if (!added)
+            {
+                ConsolePrintf(RED, "Failed to decompress the existing pakfile entry %s\n", entry.name.c_str());
+                return false;
+            }
+        }
+
+        return writer.Finish(size);
+    }
+
+    // Writes a game lump with its compressed children decompressed, streaming each child through the buffer. Compressed
+    // children are followed by an empty one whose offset marks where the last of them ends, which is dropped
+    static bool WriteDecompressedGameLump(std::istream& input, const BSPLump& src, std::ostream& output, uint8* buffer, size_t buffer_size)
+    {
+        int32 count = 0;
+        input.clear();
+        if ((uint64)src.filelen < sizeof(count) || input.seekg(src.fileofs).read((char*)&count, sizeof(count)).fail())
+            return false;
+
+        if (count < 0 || sizeof(count) + (uint64)count * sizeof(BSPGameLump) > (uint64)src.filelen)
+            return false;
+
+        std::vector<BSPGameLump> children(count);
+        if (input.read((char*)children.data(), count * sizeof(BSPGameLump)).fail())
+            return false;
+
+        uint64 lump_size = (uint64)src.filelen;
+        if (std::none_of(children.begin(), children.end(), [](const BSPGameLump& child) { return (child.flags & GAME_LUMP_FLAG_COMPRESSED) != 0; }))
+            return WriteGameLump(input, src, output, buffer, buffer_size);
+
+        size_t kept = children.size();
+        if (kept && !children.back().id && !children.back().filelen)
+            kept--;
+
+        // The directory is filled in once the children have been written and their sizes are known
+        int32 kept_count = (int32)kept;
+        std::streamoff directory_pos = output.tellp();
+        output.write((const char*)&kept_count, sizeof(kept_count));
+        output.write((const char*)children.data(), kept * sizeof(BSPGameLump));
+        std::vector<BSPGameLump> rebuilt(children.begin(), children.begin() + kept);
+        for (size_t i = 0; i < kept; i++)
+        {
+            // A compressed child's length is its decompressed size, so where it ends comes from the child after it
+            BSPGameLump& child = rebuilt[i];
+            uint64 start = (uint64)(child.fileofs - src.fileofs);
+            uint64 end = i + 1 < children.size() ? (uint64)(children[i + 1].fileofs - src.fileofs) : lump_size;
+            if (child.fileofs < src.fileofs || start > end || end > lump_size)
+                return false;
+
+            uint64 child_start = (uint64)output.tellp();
+            bool written = false;
+            if (child.flags & GAME_LUMP_FLAG_COMPRESSED)
+            {
+                LZMALumpHeader lzma_header;
+                input.clear();
+                written = end - start >= sizeof(lzma_header) && !input.seekg(src.fileofs + start).read((char*)&lzma_header, sizeof(lzma_header)).fail()
+                    && lzma_header.id == LZMA_LUMP_ID && sizeof(lzma_header) + (uint64)lzma_header.lzma_size <= end - start
+                    && LZMADecompressStream(input, src.fileofs + start + sizeof(lzma_header), lzma_header.lzma_size, lzma_header.properties, lzma_header.actual_size, output, buffer, buffer_size);
+            }
+            else
+                written = start + (uint64)child.filelen <= lump_size && CopyStreamRange(input, src.fileofs + start, child.filelen, output, buffer, buffer_size);
+
+            if (!written)
+                return false;
+
+            child.flags &= ~GAME_LUMP_FLAG_COMPRESSED;
+            child.fileofs = (int32)child_start;
+            child.filelen = (int32)((uint64)output.tellp() - child_start);
+        }
+
+        std::streamoff end_pos = output.tellp();
+        output.seekp(directory_pos + (std::streamoff)sizeof(kept_count));
+        output.write((const char*)rebuilt.data(), kept * sizeof(BSPGameLump));
+        output.seekp(end_pos);
+        return !output.fail();
+    }
+
+    // Writes a game lump at the output's position, moving its children's absolute offsets along with it. Only the
+    // directory is held, and the children are streamed through the buffer. Offsets at the very end of the lump move too,
+    // for the empty child that ends a compressed game lump
+    static bool WriteGameLump(std::istream& input, const BSPLump& src, std::ostream& output, uint8* buffer, size_t buffer_size)
+    {
+        int32 count = 0;
+        input.clear();
+        if ((uint64)src.filelen < sizeof(count))
+            return CopyStreamRange(input, src.fileofs, src.filelen, output, buffer, buffer_size);
+
+        if (input.seekg(src.fileofs).read((char*)&count, sizeof(count)).fail())
+            return false;
+
+        // A directory that claims more children than the lump holds is copied as far as it goes
+        size_t listed = (size_t)std::clamp<int64>(count, 0, ((int64)src.filelen - (int64)sizeof(count)) / (int64)sizeof(BSPGameLump));
+        std::vector<BSPGameLump> children(listed);
+        if (input.read((char*)children.data(), listed * sizeof(BSPGameLump)).fail())
+            return false;
+
+        int32 new_offset = (int32)output.tellp();
+        for (BSPGameLump& child : children)
+            if (child.fileofs >= src.fileofs && child.fileofs <= src.fileofs + src.filelen)
+                child.fileofs += new_offset - src.fileofs;
+
+        uint64 directory_size = sizeof(count) + listed * sizeof(BSPGameLump);
+        output.write((const char*)&count, sizeof(count));
+        output.write((const char*)children.data(), listed * sizeof(BSPGameLump));
+        return CopyStreamRange(input, src.fileofs + directory_size, (uint64)src.filelen - directory_size, output, buffer, buffer_size);
+    }
+
+    // Writes a game lump without the children of the given ids, streaming the rest through the buffer and filling in the
+    // directory once they're written. A compressed child's length is its decompressed size, so its data runs to where
+    // the child after it starts
+    static bool WriteStrippedGameLump(std::istream& input, const BSPLump& src, std::ostream& output, uint8* buffer, size_t buffer_size, const std::vector<uint32>& ids)
+    {
+        int32 count = 0;
+        input.clear();
+        if ((uint64)src.filelen < sizeof(count) || input.seekg(src.fileofs).read((char*)&count, sizeof(count)).fail())
+            return false;
+
+        if (count < 0 || sizeof(count) + (uint64)count * sizeof(BSPGameLump) > (uint64)src.filelen)
+            return false;
+
+        std::vector<BSPGameLump> children(count);
+        if (input.read((char*)children.data(), count * sizeof(BSPGameLump)).fail())
+            return false;
+
+        uint64 lump_size = (uint64)src.filelen;
+        std::vector<BSPGameLump> kept;
+        std::vector<std::pair<uint64, uint64>> ranges;
+        for (int32 i = 0; i < count; i++)
+        {
+            const BSPGameLump& child = children[i];
+            bool terminator = !child.id && !child.filelen;
+            if (!terminator && std::find(ids.begin(), ids.end(), (uint32)child.id) != ids.end())
+                continue;
+
+            bool compressed = (child.flags & GAME_LUMP_FLAG_COMPRESSED) != 0;
+            uint64 start = 0, end = 0;
+            if (!terminator && (compressed || child.filelen))
+            {
+                if (child.fileofs < src.fileofs)
+                    return false;
+
+                start = (uint64)(child.fileofs - src.fileofs);
+                end = !compressed ? start + (uint64)child.filelen : i + 1 < count ? (uint64)(children[i + 1].fileofs - src.fileofs) : lump_size;
+                if (start > end || end > lump_size)
+                    return false;
+            }
+
+            kept.push_back(child);
+            ranges.emplace_back(start, end);
+        }
+
+        int32 kept_count = (int32)kept.size();
+        std::streamoff directory_pos = output.tellp();
+        output.write((const char*)&kept_count, sizeof(kept_count));
+        output.write((const char*)kept.data(), kept.size() * sizeof(BSPGameLump));
+        for (size_t i = 0; i < kept.size(); i++)
+        {
+            kept[i].fileofs = (int32)output.tellp();
+            if (!CopyStreamRange(input, src.fileofs + ranges[i].first, ranges[i].second - ranges[i].first, output, buffer, buffer_size))
+                return false;
+        }
+
+        std::streamoff end_pos = output.tellp();
+        output.seekp(directory_pos + (std::streamoff)sizeof(kept_count));
+        output.write((const char*)kept.data(), kept.size() * sizeof(BSPGameLump));
+        output.seekp(end_pos);
+        return !output.fail();
+    }
+
+    bool WriteLump(std::istream& input, std::ostream& output, const BSPLump& src, BSPLump& dst, int index, bool compress, uint8* buffer, LumpStrip* strip)
+    {
+        PadTo4(output);
+        dst.fileofs = (int32)output.tellp();
+
+        // The game lump stores absolute offsets to its children, which move along with it
+        if (index == BSP_LUMP_GAME_LUMP)
+        {
+            if (!strip || strip->game_lumps.empty())
+                return WriteGameLump(input, src, output, buffer, pool.BufferSize());
+
+            if (!WriteStrippedGameLump(input, src, output, buffer, pool.BufferSize(), strip->game_lumps))
+                return false;
+
+            dst.filelen = (int32)((uint64)output.tellp() - dst.fileofs);
+            strip->saved[index] = (uint64)src.filelen - dst.filelen;
+            return true;
+        }
+
+        if (compress && !src.uncompressed_size && (size_t)src.filelen > sizeof(LZMALumpHeader))
+        {
+            LZMALumpHeader lzma_header = { LZMA_LUMP_ID, (uint32)src.filelen };
+            output.write((const char*)&lzma_header, sizeof(lzma_header));
+
+            uint64 limit = src.filelen - sizeof(lzma_header) - 1;
+            LZMAStreamResult result = LZMACompressStream(input, src.fileofs, src.filelen, output, limit, limits.dictionary_size);
+            if (result.read_error)
+                return false;
+
+            if (result.success)
+            {
+                lzma_header.lzma_size = (uint32)result.written;
+                memcpy(lzma_header.properties, result.props, sizeof(result.props));
+                output.seekp(dst.fileofs);
+                output.write((const char*)&lzma_header, sizeof(lzma_header));
+                output.seekp(0, std::ios::end);
+                dst.filelen = (int32)(sizeof(lzma_header) + result.written);
+                dst.uncompressed_size = (uint32)src.filelen;
+                return !output.fail();
+            }
+
+            output.clear();
+            output.seekp(dst.fileofs);
+        }
+
+        return CopyStreamRange(input, src.fileofs, src.filelen, output, buffer, pool.BufferSize());
+    }
+
+    // Merges the source's pakfile with the assets. Assets replace entries of the same internal path, and when the pakfile
+    // holds a path more than once, its last entry is kept. Compressed entries are copied as they are, and stored ones are
+    // compressed alongside the assets if the map is compressed
+    bool WritePakfile(std::istream& input, const std::string& source_path, const BSPLump& src, const std::vector<const std::vector<std::string>*>& asset_lists, std::ostream& output, bool compress, uint64& size)
+    {
+        std::unordered_map<std::string, const std::string*> asset_sources;
+        std::vector<const std::string*> assets;
+        CollectAssets(asset_lists, asset_sources, assets);
+
+        PakfileWriter writer(output, pool, compress ? &policy : nullptr, limits);
+        std::vector<ZipEntry> entries;
+        std::vector<PakfileSource> files;
+        if (src.filelen > 0)
+        {
+            if (!ReadZipDirectory(input, (uint64)src.fileofs, (uint64)src.filelen, entries))
+            {
+                ConsolePrintf(RED, "Failed to read the existing pakfile\n");
+                return false;
+            }
+
+            std::unordered_map<std::string, size_t> last_entries;
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                std::string key = ToLower(entries[i].name);
+                FixSlashes(key);
+                last_entries[key] = i;
+            }
+
+            std::vector<size_t> kept;
+            for (size_t i = 0; i < entries.size(); i++)
+            {
+                std::string key = ToLower(entries[i].name);
+                FixSlashes(key);
+                if (asset_sources.contains(key))
+                    merge_stats.replaced++;
+                else if (last_entries[key] == i)
+                    kept.push_back(i);
+            }
+
+            if (limits.deterministic)
+                std::stable_sort(kept.begin(), kept.end(), [&](size_t a, size_t b) { return entries[a].name < entries[b].name; });
+
+            for (size_t i : kept)
+            {
+                const ZipEntry& entry = entries[i];
+                uint64 data_offset = 0;
+                if (!FindEntryData(input, src, entry, data_offset))
+                {
+                    ConsolePrintf(RED, "Failed to find the existing pakfile entry %s\n", entry.name.c_str());
+                    return false;
+                }
+
+                bool raw = !compress || entry.method != ZIP_METHOD_STORE;
+                files.push_back({ &entry.name, &source_path, &entry, data_offset, raw });
+                (raw ? merge_stats.copied : merge_stats.compressed)++;
+            }
+        }
+
+        // Folders are listed in whatever order the file system likes, so deterministic outputs sort the assets by path
+        if (limits.deterministic)
+            std::sort(assets.begin(), assets.end(), [](const std::string* a, const std::string* b) { return ToLower(*a) < ToLower(*b); });
+
+        for (const std::string* internal_path : assets)
+            files.push_back({ internal_path, asset_sources[ToLower(*internal_path)] });
+
+        if (limits.order)
+            limits.order->Sort(files);
+
+        if (!writer.AddFiles(files))
+            return false;
+
+        return writer.Finish(size);
+    }
+
+    // Counted across every map packed, which may be several at once
+    struct MergeStats
+    {
+        std::atomic<uint64> copied = 0;
+        std::atomic<uint64> compressed = 0;
+        std::atomic<uint64> replaced = 0;
+    };
+
+    BufferPool& pool;
+    CompressionPolicy& policy;
+    const PackerLimits& limits;
+    const OutputSettings& output_settings;
+    MergeStats merge_stats;
+};
+
+// Checks that a packed bsp is complete: a valid header, every lump inside the file and a readable pakfile
+static bool VerifyBSP(const std::string& path)
+{
+    std::ifstream stream(path, std::ios::binary | std::ios::ate);
+    BSPHeader header;
+    uint64 file_size = (uint64)stream.tellg();
+    if (stream.fail() || file_size < sizeof(header) || stream.seekg(0).read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+        return false;
+
+    for (const BSPLump& lump : header.lumps)
+        if (lump.fileofs < 0 || lump.filelen < 0 || (lump.filelen && (uint64)lump.fileofs + lump.filelen > file_size))
+            return false;
+
+    const BSPLump& pakfile = header.lumps[BSP_LUMP_PAKFILE];
+    std::vector<ZipEntry> entries;
+    return !pakfile.filelen || ReadZipDirectory(stream, (uint64)pakfile.fileofs, (uint64)pakfile.filelen, entries);
+}
+
+struct UploadRetrySettings
+{
+    uint32 max_attempts = 5;
+    double base_delay_seconds = 5.0;
+    double max_delay_seconds = 300.0;
+};
+
+struct SourceCacheSettings
+{
+    bool enabled = false;
+    std::string path;
+    uint64 max_size_mb = 8192;
+};
+
+// Keeps decompressed source bsps keyed by the hash of the source's contents, evicting the least recently used ones past
+// the size limit. A hit bumps the file's write time, which is what the eviction order is based on, and pins the file
+// until it's released so another map's eviction can't remove it while it's being packed from
+class SourceCache
+{
+
+public:
+
+    SourceCache(const SourceCacheSettings& settings) : settings(settings) {}
+
+    bool Enabled() const
+    {
+        return settings.enabled;
+    }
+
+    bool Find(uint64 hash, std::string& path)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        path = settings.path + HashToString(hash) + ".bsp";
+        std::error_code ec;
+        if (!CreateCacheDirectory() || !std::filesystem::is_regular_file(path, ec))
+        {
+            misses++;
+            return false;
+        }
+
+        std::filesystem::last_write_time(path, std::filesystem::file_time_type::clock::now(), ec);
+        pinned[HashToString(hash)]++;
+        hits++;
+        return true;
+    }
+
+    // Lets a bsp returned by Find be evicted again
+    void Release(uint64 hash)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = pinned.find(HashToString(hash));
+        if (found != pinned.end() && !--found->second)
+            pinned.erase(found);
+    }
+
+    // Copies a decompressed bsp into the cache and evicts whatever no longer fits
+    void Store(uint64 hash, const std::string& decompressed_path, const std::string& name)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (!CreateCacheDirectory())
+                return;
+        }
+
+        std::string path(settings.path + HashToString(hash) + ".bsp");
+        std::string temp(path + "." + name + ".tmp");
+        std::error_code ec;
+        if (!std::filesystem::copy_file(decompressed_path, temp, std::filesystem::copy_options::overwrite_existing, ec))
+        {
+            ConsolePrintf(RED, "Failed to add %s to the source cache\n", name.c_str());
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        std::filesystem::rename(temp, path, ec);
+        if (ec)
+            std::filesystem::remove(temp, ec);
+
+        Evict();
+    }
+
+    void PrintSummary()
+    {
+        if (settings.enabled)
+            ConsolePrintf(AQUA, "Source cache: %llu hits, %llu misses, %llu evicted\n", hits, misses, evicted);
+    }
+
+private:
+
+    // The directory is only created once a map actually uses the cache
+    bool CreateCacheDirectory()
+    {
+        if (directory_created)
+            return true;
+
+        std::error_code ec;
+        if (!std::filesystem::create_directories(settings.path, ec) && !std::filesystem::is_directory(settings.path, ec))
+        {
+            if (!directory_failed)
+                ConsolePrintf(RED, "Failed to create the source cache directory at %s\n", settings.path.c_str());
+
+            directory_failed = true;
+            return false;
+        }
+
+        directory_created = true;
+        return true;
+    }
+
+    void Evict()
+    {
+        struct CachedFile
+        {
+            std::filesystem::path path;
+            std::filesystem::file_time_type time;
+            uint64 size;
+        };
+
+        std::vector<CachedFile> files;
+        uint64 total_size = 0;
+        std::error_code ec;
+        for (const auto& entry : std::filesystem::directory_iterator(settings.path, ec))
+        {
+            if (!entry.is_regular_file(ec) || entry.path().extension() != ".bsp")
+                continue;
+
+            files.push_back({ entry.path(), entry.last_write_time(ec), entry.file_size(ec) });
+            total_size += files.back().size;
+        }
+
+        std::sort(files.begin(), files.end(), [](const CachedFile& a, const CachedFile& b) { return a.time < b.time; });
+
+        uint64 limit = settings.max_size_mb * 1048576;
+        for (size_t i = 0; i < files.size() && total_size > limit; i++)
+        {
+            // Files another map is packing from are skipped
+            if (pinned.contains(files[i].path.stem().string()))
+                continue;
+
+            if (std::filesystem::remove(files[i].path, ec))
+            {
+                total_size -= files[i].size;
+                evicted++;
+            }
+        }
+    }
+
+    const SourceCacheSettings& settings;
+    std::mutex mutex;
+    std::unordered_map<std::string, uint32> pinned;
+    bool directory_created = false;
+    bool directory_failed = false;
+    uint64 hits = 0;
+    uint64 misses = 0;
+    uint64 evicted = 0;
+};
+
+struct SharedVPKSettings
+{
+    bool enabled = false;
+    std::string name = "shared_assets";
+    uint32 chunk_size_mb = 200;
+};
+
+const uint32 VPK_SIGNATURE = 0x55AA1234;
+const uint16 VPK_ENTRY_TERMINATOR = 0xFFFF;
+
+// Writes assets once into a multi-chunk VPK (version 1) rather than into every map. The directory tree is built in
+// memory and written in one piece, and since every offset follows from the file sizes, the chunks are written in
+// parallel, each by one thread
+class VPKWriter
+{
+
+public:
+
+    VPKWriter(const SharedVPKSettings& settings, const OutputSettings& output_settings, uint32 threads)
+        : settings(settings), output_settings(output_settings), threads(std::max<uint32>(threads, 1)) {}
+
+    // Asset lists hold pairs of internal and source paths. When an internal path repeats, the last one wins
+    bool Write(const std::string& directory, const std::vector<std::string>& assets, uint64& total_bytes)
+    {
+        std::map<std::string, const std::string*> sources;
+        for (size_t i = 0; i + 1 < assets.size(); i += 2)
+        {
+            std::string key = ToLower(assets[i]);
+            FixSlashes(key);
+            sources[key] = &assets[i + 1];
+        }
+
+        // Entries are laid out in the order of the tree, extension first, so each chunk's files are next to each other in the directory
+        std::vector<Entry> entries;
+        for (auto& [key, source] : sources)
+        {
+            Entry entry;
+            size_t slash = key.find_last_of('/');
+            std::string file = slash == std::string::npos ? key : key.substr(slash + 1);
+            size_t dot = file.find_last_of('.');
+            entry.path = slash == std::string::npos ? " " : key.substr(0, slash);
+            entry.name = dot == std::string::npos ? file : file.substr(0, dot);
+            entry.extension = dot == std::string::npos ? " " : file.substr(dot + 1);
+            entry.source = source;
+
+            std::error_code ec;
+            entry.size = std::filesystem::file_size(*source, ec);
+            if (ec || entry.size > 0xFFFFFFFF)
+            {
+                ConsolePrintf(RED, ec ? "Failed to read %s\n" : "%s is too large for a VPK\n", source->c_str());
+                return false;
+            }
+
+            entries.push_back(entry);
+        }
+
+        std::sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return std::tie(a.extension, a.path, a.name) < std::tie(b.extension, b.path, b.name); });
+
+        // Fill each chunk up to its size. Files larger than a chunk get one of their own
+        uint64 chunk_size = (uint64)settings.chunk_size_mb << 20;
+        std::vector<std::pair<size_t, size_t>> chunks;
+        uint64 offset = 0;
+        total_bytes = 0;
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            if (chunks.empty() || (offset && offset + entries[i].size > chunk_size))
+            {
+                chunks.emplace_back(i, i);
+                offset = 0;
+            }
+
+            entries[i].archive = (uint16)(chunks.size() - 1);
+            entries[i].offset = (uint32)offset;
+            chunks.back().second = i + 1;
+            offset += entries[i].size;
+            total_bytes += entries[i].size;
+        }
+
+        if (chunks.size() >= 0x7FFF)
+        {
+            ConsolePrintf(RED, "The shared VPK would need %llu chunks, more than a VPK can have. Raise \"chunk_size_mb\"\n", (uint64)chunks.size());
+            return false;
+        }
+
+        std::atomic<size_t> next_chunk = 0;
+        std::atomic<bool> failed = false;
+        auto worker = [&]()
+        {
+            for (size_t i = next_chunk++; i < chunks.size() && !failed; i = next_chunk++)
+                if (!WriteChunk(ChunkPath(directory, i), entries, chunks[i].first, chunks[i].second))
+                    failed = true;
+        };
+
+        std::vector<std::thread> workers;
+        for (uint32 i = 1; i < std::min<size_t>(threads, chunks.size()); i++)
+            workers.emplace_back(worker);
+
+        worker();
+        for (std::thread& thread : workers)
+            thread.join();
+
+        if (failed)
+            return false;
+
+        // Chunks left over from a larger VPK would only confuse whoever mounts it
+        std::error_code ec;
+        for (size_t i = chunks.size(); std::filesystem::exists(ChunkPath(directory, i), ec); i++)
+            std::filesystem::remove(ChunkPath(directory, i), ec);
+
+        std::vector<uint8> tree = BuildTree(entries);
+        std::vector<uint8> dir(sizeof(uint32) * 3);
+        uint32 header[3] = { VPK_SIGNATURE, 1, (uint32)tree.size() };
+        memcpy(dir.data(), header, sizeof(header));
+        dir.insert(dir.end(), tree.begin(), tree.end());
+
+        std::string dir_path(directory + settings.name + "_dir.vpk");
+        if (!WriteFileContents(dir_path, dir.data(), dir.size()))
+        {
+            ConsolePrintf(RED, "Failed to write %s\n", dir_path.c_str());
+            return false;
+        }
+
+        chunk_count = (uint32)chunks.size();
+        return true;
+    }
+
+    uint32 ChunkCount() const
+    {
+        return chunk_count;
+    }
+
+private:
+
+    struct Entry
+    {
+        std::string extension;
+        std::string path;
+        std::string name;
+        const std::string* source = nullptr;
+        uint64 size = 0;
+        uint32 crc = 0;
+        uint16 archive = 0;
+        uint32 offset = 0;
+    };
+
+    std::string ChunkPath(const std::string& directory, size_t index) const
+    {
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "_%03u.vpk", (uint32)index);
+        return directory + settings.name + suffix;
+    }
+
+    // Copies the files of [first, last) into a chunk, working out their CRCs on the way
+    bool WriteChunk(const std::string& path, std::vector<Entry>& entries, size_t first, size_t last)
+    {
+        uint64 size = 0;
+        for (size_t i = first; i < last; i++)
+            size += entries[i].size;
+
+        OutputFile output_file;
+        std::ostream output(&output_file);
+        if (!output_file.Open(path, size, output_settings))
+        {
+            ConsolePrintf(RED, "Failed to create %s\n", path.c_str());
+            return false;
+        }
+
+        std::vector<char> buffer(PACK_BUFFER_SIZE);
+        for (size_t i = first; i < last; i++)
+        {
+            Entry& entry = entries[i];
+            std::ifstream input(*entry.source, std::ios::binary);
+            uint64 remaining = entry.size;
+            entry.crc = 0;
+            while (remaining && input.read(buffer.data(), (std::streamsize)std::min<uint64>(buffer.size(), remaining)))
+            {
+                size_t read = (size_t)input.gcount();
+                entry.crc = CRC32(buffer.data(), read, entry.crc);
+                output.write(buffer.data(), read);
+                remaining -= read;
+            }
+
+            if (remaining || output.fail())
+            {
+                ConsolePrintf(RED, "Failed to copy %s into %s\n", entry.source->c_str(), path.c_str());
+                output_file.Close();
+                return false;
+            }
+        }
+
+        if (!output_file.Close())
+        {
+            ConsolePrintf(RED, "Failed to write %s\n", path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // Extensions hold paths, which hold file names, each level ended by an empty string
+    static std::vector<uint8> BuildTree(const std::vector<Entry>& entries)
+    {
+        std::vector<uint8> tree;
+        auto add_string = [&](const std::string& value)
+        {
+            tree.insert(tree.end(), value.begin(), value.end());
+            tree.push_back(0);
+        };
+
+        auto add = [&](const auto& value)
+        {
+            const uint8* bytes = (const uint8*)&value;
+            tree.insert(tree.end(), bytes, bytes + sizeof(value));
+        };
+
+        for (size_t i = 0; i < entries.size(); i++)
+        {
+            const Entry& entry = entries[i];
+            bool new_extension = !i || entry.extension != entries[i - 1].extension;
+            bool new_path = new_extension || entry.path != entries[i - 1].path;
+            if (new_extension)
+                add_string(entry.extension);
+
+            if (new_path)
+                add_string(entry.path);
+
+            add_string(entry.name);
+            add(entry.crc);
+            add((uint16)0);
+            add(entry.archive);
+            add(entry.offset);
+            add((uint32)entry.size);
+            add(VPK_ENTRY_TERMINATOR);
+
+            bool path_ends = i + 1 == entries.size() || entries[i + 1].extension != entry.extension || entries[i + 1].path != entry.path;
+            bool extension_ends = i + 1 == entries.size() || entries[i + 1].extension != entry.extension;
+            if (path_ends)
+                tree.push_back(0);
+
+            if (extension_ends)
+                tree.push_back(0);
+        }
+
+        tree.push_back(0);
+        return tree;
+    }
+
+    const SharedVPKSettings& settings;
+    const OutputSettings& output_settings;
+    uint32 threads;
+    uint32 chunk_count = 0;
+};
+
+// A read-only view of a whole file
+class MappedFile
+{
+
+public:
+
+    ~MappedFile()
+    {
+        Close();
+    }
+
+    bool Open(const std::string& path)
+    {
+        Close();
+        file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, nullptr);
+        LARGE_INTEGER file_size = {};
+        if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &file_size))
+        {
+            Close();
+            return false;
+        }
+
+        // Empty files can't be mapped, but there's nothing to read from them anyway
+        size = (size_t)file_size.QuadPart;
+        if (!size)
+            return true;
+
+        mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+        view = mapping ? (const uint8*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : nullptr;
+        if (!view)
+        {
+            Close();
+            return false;
+        }
+
+        return true;
+    }
+
+    void Close()
+    {
+        if (view)
+            UnmapViewOfFile(view);
+
+        if (mapping)
+            CloseHandle(mapping);
+
+        if (file != INVALID_HANDLE_VALUE)
+            CloseHandle(file);
+
+        file = INVALID_HANDLE_VALUE;
+        mapping = nullptr;
+        view = nullptr;
+        size = 0;
+    }
+
+    const uint8* Data() const
+    {
+        return view;
+    }
+
+    size_t Size() const
+    {
+        return size;
+    }
+
+private:
+
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = nullptr;
+    const uint8* view = nullptr;
+    size_t size = 0;
+};
+
+struct StockContentSettings
+{
+    bool enabled = false;
+    std::string game_path;
+    std::string cache_path;
+};
+
+// Every file in the game's own VPKs, keyed by the hash of its internal path, so copies of stock content can be left out of
+// the maps. The index is sorted and cached on disk, then mapped and binary searched in place. It's rebuilt whenever the
+// VPK directories it was built from change
+class StockIndex
+{
+
+public:
+
+    StockIndex(const StockContentSettings& settings) : settings(settings) {}
+
+    bool Load()
+    {
+        std::vector<std::string> vpks;
+        std::error_code ec;
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(settings.game_path, ec))
+        {
+            std::string name = ToLower(entry.path().filename().string());
+            if (entry.is_regular_file() && name.length() > 8 && !name.compare(name.length() - 8, 8, "_dir.vpk"))
+                vpks.push_back(entry.path().string());
+        }
+
+        if (ec || vpks.empty())
+        {
+            ConsolePrintf(RED, "Failed to find any VPK directories in %s\n", settings.game_path.c_str());
+            return false;
+        }
+
+        // The names, sizes and dates of the directories stand in for their contents
+        std::sort(vpks.begin(), vpks.end());
+        XXHash64 hasher;
+        for (const std::string& vpk : vpks)
+        {
+            uint64 values[2] = { std::filesystem::file_size(vpk, ec), (uint64)std::filesystem::last_write_time(vpk, ec).time_since_epoch().count() };
+            hasher.Update(vpk.data(), vpk.size());
+            hasher.Update(values, sizeof(values));
+        }
+
+        uint64 signature = hasher.Digest();
+        if (Map(signature))
+            return true;
+
+        std::vector<Entry> entries;
+        for (const std::string& vpk : vpks)
+            if (!ReadDirectory(vpk, entries))
+                return false;
+
+        // Later directories win, the same as a file found twice when the game mounts them
+        std::stable_sort(entries.begin(), entries.end(), [](const Entry& a, const Entry& b) { return a.path_hash < b.path_hash; });
+        std::vector<Entry> unique;
+        for (size_t i = 0; i < entries.size(); i++)
+            if (i + 1 == entries.size() || entries[i + 1].path_hash != entries[i].path_hash)
+                unique.push_back(entries[i]);
+
+        Header header = { STOCK_INDEX_MAGIC, STOCK_INDEX_VERSION, (uint64)unique.size(), signature };
+        std::vector<uint8> contents(sizeof(header) + unique.size() * sizeof(Entry));
+        memcpy(contents.data(), &header, sizeof(header));
+        if (!unique.empty())
+            memcpy(contents.data() + sizeof(header), unique.data(), unique.size() * sizeof(Entry));
+
+        if (!WriteFileContents(settings.cache_path, contents.data(), contents.size()) || !Map(signature))
+        {
+            ConsolePrintf(RED, "Failed to write the stock content index to %s\n", settings.cache_path.c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    uint64 Count() const
+    {
+        return count;
+    }
+
+    // Returns true if the asset is the same file as the one the game ships at its internal path
+    bool Contains(const std::string& internal_path, const std::string& file, std::vector<char>& buffer) const
+    {
+        std::string key = ToLower(internal_path);
+        FixSlashes(key);
+        uint64 hash = HashData(key.data(), key.size());
+        const Entry* last = entries + count;
+        const Entry* entry = std::lower_bound(entries, last, hash, [](const Entry& a, uint64 b) { return a.path_hash < b; });
+        if (entry == last || entry->path_hash != hash)
+            return false;
+
+        // Most edited files differ in size, so they're never read
+        std::error_code ec;
+        if (std::filesystem::file_size(file, ec) != entry->size || ec)
+            return false;
+
+        std::ifstream input(file, std::ios::binary);
+        uint32 crc = 0;
+        while (input.read(buffer.data(), buffer.size()) || input.gcount())
+            crc = CRC32(buffer.data(), (size_t)input.gcount(), crc);
+
+        return input.eof() && crc == entry->crc;
+    }
+
+private:
+
+    static constexpr uint32 STOCK_INDEX_MAGIC = 0x58444953; // SIDX
+    static constexpr uint32 STOCK_INDEX_VERSION = 1;
+
+    struct Header
+    {
+        uint32 magic;
+        uint32 version;
+        uint64 count;
+        uint64 signature;
+    };
+
+    struct Entry
+    {
+        uint64 path_hash;
+        uint32 crc;
+        uint32 size;
+    };
+
+    bool Map(uint64 signature)
+    {
+        if (!file.Open(settings.cache_path) || file.Size() < sizeof(Header))
+            return false;
+
+        Header header;
+        memcpy(&header, file.Data(), sizeof(header));
+        if (header.magic != STOCK_INDEX_MAGIC || header.version != STOCK_INDEX_VERSION || header.signature != signature || file.Size() != sizeof(Header) + header.count * sizeof(Entry))
+        {
+            file.Close();
+            return false;
+        }
+
+        entries = (const Entry*)(file.Data() + sizeof(Header));
+        count = header.count;
+        return true;
+    }
+
+    // Walks the tree of a version 1 or 2 VPK directory, where extensions hold paths, which hold file names
+    bool ReadDirectory(const std::string& path, std::vector<Entry>& output)
+    {
+        MappedFile vpk;
+        if (!vpk.Open(path) || vpk.Size() < sizeof(uint32) * 3)
+        {
+            ConsolePrintf(RED, "Failed to read %s\n", path.c_str());
+            return false;
+        }
+
+        uint32 header[3];
+        memcpy(header, vpk.Data(), sizeof(header));
+        size_t start = header[1] == 1 ? 12 : 28;
+        if (header[0] != VPK_SIGNATURE || (header[1] != 1 && header[1] != 2) || start + header[2] > vpk.Size())
+        {
+            ConsolePrintf(RED, "%s is not a VPK directory\n", path.c_str());
+            return false;
+        }
+
+        const char* data = (const char*)vpk.Data();
+        size_t position = start, end = start + header[2];
+        auto read_string = [&](std::string_view& value)
+        {
+            const char* terminator = (const char*)memchr(data + position, 0, end - position);
+            if (!terminator)
+                return false;
+
+            value = std::string_view(data + position, terminator - (data + position));
+            position = terminator - data + 1;
+            return true;
+        };
+
+        std::string_view extension, directory, name;
+        while (position < end && read_string(extension) && !extension.empty())
+        {
+            while (read_string(directory) && !directory.empty())
+            {
+                while (read_string(name) && !name.empty())
+                {
+                    if (end - position < 18)
+                    {
+                        ConsolePrintf(RED, "%s is truncated\n", path.c_str());
+                        return false;
+                    }
+
+                    uint32 crc, length;
+                    uint16 preload;
+                    memcpy(&crc, data + position, 4);
+                    memcpy(&preload, data + position + 4, 2);
+                    memcpy(&length, data + position + 12, 4);
+                    position += 18 + preload;
+
+                    std::string key;
+                    if (directory != " ")
+                        key.append(directory).append("/");
+
+                    key.append(name);
+                    if (extension != " ")
+                        key.append(".").append(extension);
+
+                    key = ToLower(key);
+                    output.push_back({ HashData(key.data(), key.size()), crc, length + preload });
+                }
+            }
+        }
+
+        return true;
+    }
+
+    const StockContentSettings& settings;
+    MappedFile file;
+    const Entry* entries = nullptr;
+    uint64 count = 0;
+};
+
+// Hands maps from the packing threads to the uploader as soon as they're ready
+class UploadQueue
+{
+
+public:
+
+    void Push(const BSPFileInfo* info)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (closed)
+                return;
+
+            maps.push_back(info);
+        }
+
+        ready.notify_one();
+    }
+
+    // No more maps will be pushed
+    void Close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            closed = true;
+        }
+
+        ready.notify_all();
+    }
+
+    // Returns the next map, or nullptr if none arrived in time
+    const BSPFileInfo* Pop(std::chrono::milliseconds timeout)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        if (!ready.wait_for(lock, timeout, [this]() { return !maps.empty() || closed; }) || maps.empty())
+            return nullptr;
+
+        const BSPFileInfo* info = maps.front();
+        maps.erase(maps.begin());
+        return info;
+    }
+
+    bool Drained()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        return closed && maps.empty();
+    }
+
+private:
+
+    std::vector<const BSPFileInfo*> maps;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool closed = false;
+};
+
+// A fingerprint of an output bsp, so work recorded for it is only trusted while the file is untouched
+static std::string OutputFingerprint(const std::string& path)
+{
+    std::error_code ec;
+    uint64 values[2] = { std::filesystem::file_size(path, ec), 0 };
+    if (ec)
+        return std::string();
+
+    values[1] = (uint64)std::filesystem::last_write_time(path, ec).time_since_epoch().count();
+    return HashToString(HashData(values, sizeof(values)));
+}
+
+// An append-only record of the stages each map finished, one json object per line. Every line is flushed to the disk
+// as soon as it's written, so a crash loses at most the line being written, and lines that don't parse are ignored when
+// resuming
+class Journal
+{
+
+public:
+
+    ~Journal()
+    {
+        if (handle != INVALID_HANDLE_VALUE)
+            CloseHandle(handle);
+    }
+
+    bool Open(const std::string& journal_path, bool resume)
+    {
+        path = journal_path;
+        if (resume)
+            Load();
+
+        // A line cut short by a crash is ended, so the next record starts on a line of its own
+        char last = '\n';
+        std::ifstream existing(path, std::ios::binary | std::ios::ate);
+        if (existing.is_open() && existing.tellg() > 0)
+            existing.seekg(-1, std::ios::end).read(&last, 1);
+
+        existing.close();
+        handle = CreateFileA(path.c_str(), FILE_APPEND_DATA, FILE_SHARE_READ, nullptr, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, nullptr);
+        if (handle == INVALID_HANDLE_VALUE)
+        {
+            ConsolePrintf(RED, "Failed to open the journal %s\n", path.c_str());
+            return false;
+        }
+
+        if (last != '\n')
+            WriteLine(std::string());
+
+        return true;
+    }
+
+    void Record(const std::string& map, const char* stage, const std::string& input_hash, const std::string& output_hash)
+    {
+        json record;
+        record["map"] = map;
+        record["stage"] = stage;
+        record["inputs"] = input_hash;
+        record["output"] = output_hash;
+        record["time"] = (int64)std::time(nullptr);
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (handle == INVALID_HANDLE_VALUE)
+            return;
+
+        WriteLine(record.dump());
+    }
+
+    // Whether a previous run finished this stage for the same inputs, with the output still as it was left
+    bool IsDone(const std::string& map, const char* stage, const std::string& input_hash, const std::string& output_hash)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = finished.find(map + '\n' + stage);
+        return found != finished.end() && !output_hash.empty() && found->second.first == input_hash && found->second.second == output_hash;
+    }
+
+private:
+
+    // Flushed past the OS cache too, so a line that was written survives a power loss
+    void WriteLine(std::string line)
+    {
+        line += '\n';
+        DWORD written = 0;
+        if (!WriteFile(handle, line.data(), (DWORD)line.size(), &written, nullptr) || written != line.size() || !FlushFileBuffers(handle))
+            ConsolePrintf(RED, "Failed to write to the journal %s\n", path.c_str());
+    }
+
+    void Load()
+    {
+        std::ifstream input(path);
+        std::string line;
+        while (std::getline(input, line))
+        {
+            json record = json::parse(line, nullptr, false);
+            if (record.is_discarded() || !record.is_object() || !record.contains("map") || !record.contains("stage") || !record.contains("inputs") || !record.contains("output"))
+                continue;
+
+            if (!record["map"].is_string() || !record["stage"].is_string() || !record["inputs"].is_string() || !record["output"].is_string())
+                continue;
+
+            // Later lines win
+            finished[record["map"].get<std::string>() + '\n' + record["stage"].get<std::string>()] = { record["inputs"].get<std::string>(), record["output"].get<std::string>() };
+        }
+    }
+
+    std::string path;
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    std::mutex mutex;
+    std::unordered_map<std::string, std::pair<std::string, std::string>> finished;
+};
+
+static Journal g_Journal;
+
+static const char* g_LumpNames[BSP_HEADER_LUMPS] =
+{
+    "ENTITIES", "PLANES", "TEXDATA", "VERTEXES", "VISIBILITY", "NODES", "TEXINFO", "FACES",
+    "LIGHTING", "OCCLUSION", "LEAFS", "FACEIDS", "EDGES", "SURFEDGES", "MODELS", "WORLDLIGHTS",
+    "LEAFFACES", "LEAFBRUSHES", "BRUSHES", "BRUSHSIDES", "AREAS", "AREAPORTALS", "PORTALS", "CLUSTERS",
+    "PORTALVERTS", "CLUSTERPORTALS", "DISPINFO", "ORIGINALFACES", "PHYSDISP", "PHYSCOLLIDE", "VERTNORMALS", "VERTNORMALINDICES",
+    "DISP_LIGHTMAP_ALPHAS", "DISP_VERTS", "DISP_LIGHTMAP_SAMPLE_POSITIONS", "GAME_LUMP", "LEAFWATERDATA", "PRIMITIVES", "PRIMVERTS", "PRIMINDICES",
+    "PAKFILE", "CLIPPORTALVERTS", "CUBEMAPS", "TEXDATA_STRING_DATA", "TEXDATA_STRING_TABLE", "OVERLAYS", "LEAFMINDISTTOWATER", "FACE_MACRO_TEXTURE_INFO",
+    "DISP_TRIS", "PHYSCOLLIDESURFACE", "WATEROVERLAYS", "LEAF_AMBIENT_INDEX_HDR", "LEAF_AMBIENT_INDEX", "LIGHTING_HDR", "WORLDLIGHTS_HDR", "LEAF_AMBIENT_LIGHTING_HDR",
+    "LEAF_AMBIENT_LIGHTING", "XZIPPAKFILE", "FACES_HDR", "MAP_FLAGS", "OVERLAY_FADES", "OVERLAY_SYSTEM_LEVELS", "PHYSLEVEL", "DISP_MULTIBLEND"
+};
+
+struct ReportSettings
+{
+    bool enabled = false;
+    uint32 top_entries = 20;
+};
+
+// Breaks a packed bsp down by lump, pakfile extension and pakfile directory
+class BSPReport
+{
+
+public:
+
+    BSPReport(const ReportSettings& settings) : settings(settings) {}
+
+    bool Generate(const std::string& name, const std::string& bsp_path)
+    {
+        std::ifstream stream(bsp_path, std::ios::binary);
+        BSPHeader header;
+        if (stream.fail() || stream.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+        {
+            ConsolePrintf(RED, "%s : Failed to read the bsp header of %s for the report\n", name.c_str(), bsp_path.c_str());
+            return false;
+        }
+
+        uint64 file_size = std::filesystem::file_size(bsp_path);
+        report = json::object();
+        report["map"] = name;
+        report["path"] = bsp_path;
+        report["file_size"] = file_size;
+
+        json lumps = json::array();
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+        {
+            const BSPLump& lump = header.lumps[i];
+            if (lump.filelen <= 0)
+                continue;
+
+            json entry;
+            entry["index"] = i;
+            entry["name"] = g_LumpNames[i];
+            entry["size"] = lump.filelen;
+            entry["uncompressed_size"] = lump.uncompressed_size ? lump.uncompressed_size : (uint32)lump.filelen;
+            entry["compressed"] = lump.uncompressed_size != 0;
+            lumps.push_back(entry);
+        }
+
+        std::sort(lumps.begin(), lumps.end(), [](const json& a, const json& b) { return a["size"].get<int64>() > b["size"].get<int64>(); });
+        report["lumps"] = lumps;
+
+        const BSPLump& pakfile = header.lumps[BSP_LUMP_PAKFILE];
+        entries.clear();
+        if (pakfile.filelen > 0 && !ReadZipDirectory(stream, (uint64)pakfile.fileofs, (uint64)pakfile.filelen, entries))
+        {
+            ConsolePrintf(RED, "%s : Failed to read the pakfile directory of %s for the report\n", name.c_str(), bsp_path.c_str());
+            return false;
+        }
+
+        // Tally pakfile bytes by extension and by top level directory
+        Totals total;
+        std::map<std::string, Totals> by_extension;
+        std::map<std::string, Totals> by_directory;
+        for (const ZipEntry& entry : entries)
+        {
+            std::string ext = GetExtension(entry.name);
+            size_t slash = entry.name.find_first_of("/\\");
+            std::string directory = slash == std::string::npos ? "(root)" : ToLower(entry.name.substr(0, slash));
+
+            total.Add(entry);
+            by_extension[ext.empty() ? "(none)" : ext].Add(entry);
+            by_directory[directory].Add(entry);
+        }
+
+        json pak;
+        pak["entries"] = total.entries;
+        pak["compressed_bytes"] = total.compressed_bytes;
+        pak["uncompressed_bytes"] = total.uncompressed_bytes;
+        pak["ratio"] = total.Ratio();
+        pak["by_extension"] = TotalsToJson(by_extension);
+        pak["by_directory"] = TotalsToJson(by_directory);
+
+        std::vector<const ZipEntry*> largest;
+        for (const ZipEntry& entry : entries)
+            largest.push_back(&entry);
+
+        size_t top = std::min<size_t>(settings.top_entries, largest.size());
+        std::partial_sort(largest.begin(), largest.begin() + top, largest.end(), [](const ZipEntry* a, const ZipEntry* b) { return a->compressed_size > b->compressed_size; });
+
+        json top_entries = json::array();
+        for (size_t i = 0; i < top; i++)
+        {
+            json entry;
+            entry["name"] = largest[i]->name;
+            entry["compressed_bytes"] = largest[i]->compressed_size;
+            entry["uncompressed_bytes"] = largest[i]->uncompressed_size;
+            entry["method"] = largest[i]->method == ZIP_METHOD_LZMA ? "lzma" : largest[i]->method == ZIP_METHOD_STORE ? "store" : "other";
+            top_entries.push_back(entry);
+        }
+
+        pak["largest_entries"] = top_entries;
+        report["pakfile"] = pak;
+        return true;
+    }
+
+    bool Write(const std::string& path) const
+    {
+        std::ofstream stream(path, std::ios::trunc);
+        if (stream.fail())
+        {
+            ConsolePrintf(RED, "Failed to write the report %s\n", path.c_str());
+            return false;
+        }
+
+        stream << report.dump(4);
+        return !stream.fail();
+    }
+
+    void PrintSummary() const
+    {
+        const json& pak = report["pakfile"];
+        ConsolePrintf(AQUA, "- Size: %.2f MB (pakfile %.2f MB of %.2f MB uncompressed, %llu entries)\n",
+            report["file_size"].get<uint64>() / 1048576.0, pak["compressed_bytes"].get<uint64>() / 1048576.0,
+            pak["uncompressed_bytes"].get<uint64>() / 1048576.0, pak["entries"].get<uint64>());
+
+        ConsolePrintf(AQUA, "- Largest lumps:");
+        for (size_t i = 0; i < std::min<size_t>(3, report["lumps"].size()); i++)
+            ConsolePrintf(WHITE, " %s (%.2f MB)", report["lumps"][i]["name"].get<std::string>().c_str(), report["lumps"][i]["size"].get<int64>() / 1048576.0);
+        ConsolePrintf(DEFAULT, "\n");
+
+        PrintLargestGroups("- Largest types:", pak["by_extension"]);
+        PrintLargestGroups("- Largest folders:", pak["by_directory"]);
+
+        if (!pak["largest_entries"].empty())
+        {
+            const json& largest = pak["largest_entries"][0];
+            ConsolePrintf(AQUA, "- Largest entry: ");
+            ConsolePrintf(WHITE, "%s (%.2f MB)\n", largest["name"].get<std::string>().c_str(), largest["compressed_bytes"].get<uint64>() / 1048576.0);
+        }
+    }
+
+    json report;
+
+private:
+
+    struct Totals
+    {
+        uint64 entries = 0;
+        uint64 compressed_bytes = 0;
+        uint64 uncompressed_bytes = 0;
+
+        void Add(const ZipEntry& entry)
+        {
+            ++entries;
+            compressed_bytes += entry.compressed_size;
+            uncompressed_bytes += entry.uncompressed_size;
+        }
+
+        double Ratio() const
+        {
+            return uncompressed_bytes ? compressed_bytes / (double)uncompressed_bytes : 1.0;
+        }
+    };
+
+    static json TotalsToJson(const std::map<std::string, Totals>& groups)
+    {
+        std::vector<std::pair<std::string, Totals>> sorted(groups.begin(), groups.end());
+        std::sort(sorted.begin(), sorted.end(), [](const auto& a, const auto& b) { return a.second.compressed_bytes > b.second.compressed_bytes; });
+
+        json result = json::object();
+        for (const auto& [key, totals] : sorted)
+        {
+            json group;
+            group["entries"] = totals.entries;
+            group["compressed_bytes"] = totals.compressed_bytes;
+            group["uncompressed_bytes"] = totals.uncompressed_bytes;
+            group["ratio"] = totals.Ratio();
+            result[key] = group;
+        }
+
+        return result;
+    }
+
+    static void PrintLargestGroups(const char* label, const json& groups)
+    {
+        ConsolePrintf(AQUA, "%s", label);
+        size_t count = 0;
+        for (auto& [key, group] : groups.items())
+        {
+            if (count++ == 3)
+                break;
+
+            ConsolePrintf(WHITE, " %s (%.2f MB, %.0f%%%%)", key.c_str(), group["compressed_bytes"].get<uint64>() / 1048576.0, group["ratio"].get<double>() * 100.0);
+        }
+
+        ConsolePrintf(DEFAULT, "\n");
+    }
+
+    const ReportSettings& settings;
+    std::vector<ZipEntry> entries;
+};
+
+// Speeds measured while packing and uploading, kept between runs so a plan can tell how long the next run will take
+class ThroughputHistory
+{
+
+public:
+
+    void Load(const std::string& history_path)
+    {
+        path = history_path;
+        std::ifstream stream(path);
+        json data = json::parse(stream, nullptr, false);
+        if (stream.fail() || data.is_discarded() || !data.is_object())
+            return;
+
+        pack_stored = data.value("pack_stored_bytes_per_second", 0.0);
+        pack_compressed = data.value("pack_compressed_bytes_per_second", 0.0);
+        upload = data.value("upload_bytes_per_second", 0.0);
+    }
+
+    // Replaces the speeds this run measured, and keeps the rest
+    void Save()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto [measured, speed] : { std::make_pair(&measured_stored, &pack_stored), std::make_pair(&measured_compressed, &pack_compressed), std::make_pair(&measured_upload, &upload) })
+            if (measured->seconds > 0.0)
+                *speed = measured->bytes / measured->seconds;
+
+        json data;
+        data["pack_stored_bytes_per_second"] = pack_stored;
+        data["pack_compressed_bytes_per_second"] = pack_compressed;
+        data["upload_bytes_per_second"] = upload;
+        std::string text = data.dump(4);
+        if (!path.empty() && !WriteFileContents(path, (const uint8*)text.data(), text.size()))
+            ConsolePrintf(RED, "Failed to write %s\n", path.c_str());
+    }
+
+    // Bytes are the source and assets a map was packed from
+    void AddPack(bool compressed, uint64 bytes, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        Measured& measured = compressed ? measured_compressed : measured_stored;
+        measured.bytes += (double)bytes;
+        measured.seconds += seconds;
+    }
+
+    void AddUpload(uint64 bytes, double seconds)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        measured_upload.bytes += (double)bytes;
+        measured_upload.seconds += seconds;
+    }
+
+    // Returns 0 when no run has measured it yet
+    double PackSpeed(bool compressed) const
+    {
+        return compressed ? pack_compressed : pack_stored;
+    }
+
+    double UploadSpeed() const
+    {
+        return upload;
+    }
+
+private:
+
+    struct Measured
+    {
+        double bytes = 0.0;
+        double seconds = 0.0;
+    };
+
+    std::string path;
+    std::mutex mutex;
+    double pack_stored = 0.0;
+    double pack_compressed = 0.0;
+    double upload = 0.0;
+    Measured measured_stored;
+    Measured measured_compressed;
+    Measured measured_upload;
+};
+
+static std::string FormatDuration(double seconds)
+{
+    char text[32];
+    uint64 total = (uint64)std::llround(seconds);
+    if (total >= 3600)
+        snprintf(text, sizeof(text), "%lluh %02llum", total / 3600, total % 3600 / 60);
+    else if (total >= 60)
+        snprintf(text, sizeof(text), "%llum %02llus", total / 60, total % 60);
+    else
+        snprintf(text, sizeof(text), "%llus", total);
+
+    return text;
+}
+
+enum class AssetRule
+{
+    Extension,
+    Include,
+    Exclude
+};
+
+// Glob rules for the internal paths of assets found while walking folders, compiled into a single NFA so every rule
+// is matched in one pass over the path's bytes. `*` and `?` don't cross a `/` and `**` does. `**/` matches zero or
+// more whole folders, so `a/**/b` matches `a/b` and `a/x/y/b` but not `a/xb`. Rules without a `/` before their end
+// match a name at any depth, rules with one are anchored to the internal root, and rules ending with `/` only match
+// folders. An include rule that matches a folder includes every file below it
+class AssetFilter
+{
+
+public:
+
+    // The active states of every rule, sized once by Start so feeding bytes never allocates
+    using State = std::vector<uint64>;
+
+    bool AddRule(const std::string& pattern, AssetRule kind)
+    {
+        if (pattern.empty())
+            return false;
+
+        std::string_view glob = pattern;
+        Rule rule;
+        rule.kind = kind;
+        rule.anchored = glob.find('/', 1) < glob.length() - 1 || glob.front() == '/';
+        if (glob.front() == '/')
+            glob.remove_prefix(1);
+
+        if (!glob.empty() && glob.back() == '/')
+        {
+            rule.folders_only = true;
+            glob.remove_suffix(1);
+        }
+
+        if (glob.empty())
+            return false;
+
+        rule.start = (uint32)tokens.size();
+        for (size_t i = 0; i < glob.length(); i++)
+        {
+            if (glob[i] == '*' && i + 1 < glob.length() && glob[i + 1] == '*')
+            {
+                bool folders = i + 2 < glob.length() && glob[i + 2] == '/';
+                tokens.push_back({ folders ? Token::AnyFolders : Token::AnyBytes, 0 });
+                i += folders ? 2 : 1;
+            }
+            else if (glob[i] == '*')
+                tokens.push_back({ Token::AnyName, 0 });
+            else if (glob[i] == '?')
+                tokens.push_back({ Token::AnyByte, 0 });
+            else
+                tokens.push_back({ Token::Byte, (uint8)glob[i] });
+        }
+
+        rule.accept = (uint32)tokens.size();
+        tokens.push_back({ Token::Accept, 0 });
+        rules.push_back(rule);
+        return true;
+    }
+
+    bool HasRules(AssetRule kind) const
+    {
+        return std::any_of(rules.begin(), rules.end(), [kind](const Rule& rule) { return rule.kind == kind; });
+    }
+
+    void Start(State& state) const
+    {
+        state.assign((tokens.size() + 63) / 64, 0);
+        for (const Rule& rule : rules)
+            Set(state, rule.start);
+
+        Close(state, true);
+    }
+
+    void Feed(State& state, const char* bytes, size_t length) const
+    {
+        for (size_t i = 0; i < length; i++)
+            Step(state, (uint8)bytes[i]);
+    }
+
+    void Feed(State& state, char byte) const
+    {
+        Step(state, (uint8)byte);
+    }
+
+    // Fed a folder's internal path, without a trailing slash
+    bool ExcludesFolder(const State& state) const
+    {
+        for (const Rule& rule : rules)
+            if (rule.kind == AssetRule::Exclude && IsSet(state, rule.accept))
+                return true;
+
+        return false;
+    }
+
+    // Fed a folder's internal path, without a trailing slash
+    bool IncludesFolder(const State& state) const
+    {
+        for (const Rule& rule : rules)
+            if (rule.kind == AssetRule::Include && rule.folders_only && IsSet(state, rule.accept))
+                return true;
+
+        return false;
+    }
+
+    // Fed a file's internal path. Files anywhere below a folder an include rule matched are included too
+    bool IncludesFile(const State& state, bool folder_included) const
+    {
+        bool extension = false;
+        bool included = folder_included || !HasRules(AssetRule::Include);
+        for (const Rule& rule : rules)
+        {
+            if (rule.folders_only || !IsSet(state, rule.accept))
+                continue;
+
+            if (rule.kind == AssetRule::Exclude)
+                return false;
+
+            (rule.kind == AssetRule::Extension ? extension : included) = true;
+        }
+
+        return extension && included;
+    }
+
+private:
+
+    struct Token
+    {
+        enum : uint8
+        {
+            Byte,
+            AnyByte,
+            AnyName,
+            AnyBytes,
+            AnyFolders,
+            Accept
+        } type;
+        uint8 byte;
+    };
+
+    struct Rule
+    {
+        AssetRule kind = AssetRule::Include;
+        bool anchored = false;
+        bool folders_only = false;
+        uint32 start = 0;
+        uint32 accept = 0;
+    };
+
+    static bool IsSet(const State& state, uint32 index)
+    {
+        return (state[index / 64] >> (index % 64)) & 1;
+    }
+
+    static void Set(State& state, uint32 index)
+    {
+        state[index / 64] |= 1ull << (index % 64);
+    }
+
+    // Every transition moves forward by at most one state, so walking the states backwards updates them in place
+    void Step(State& state, uint8 byte) const
+    {
+        for (size_t word = state.size(); word--;)
+        {
+            uint64 bits = state[word];
+            while (bits)
+            {
+                uint32 bit = 63 - std::countl_zero(bits);
+                bits &= ~(1ull << bit);
+
+                uint32 index = (uint32)word * 64 + bit;
+                const Token& token = tokens[index];
+                bool stay = token.type == Token::AnyBytes || token.type == Token::AnyFolders || (token.type == Token::AnyName && byte != '/');
+                bool advance = (token.type == Token::Byte && token.byte == byte) || (token.type == Token::AnyByte && byte != '/') || (token.type == Token::AnyFolders && byte == '/');
+                if (!stay)
+                    state[word] &= ~(1ull << bit);
+
+                if (advance)
+                    Set(state, index + 1);
+            }
+        }
+
+        // Unanchored rules start over at every folder
+        if (byte == '/')
+            for (const Rule& rule : rules)
+                if (!rule.anchored)
+                    Set(state, rule.start);
+
+        Close(state, byte == '/');
+    }
+
+    // Wildcards can match nothing, so they also activate the state after them. `**/` only matches no folders where a
+    // folder starts, as within a name it would let `a/**/b` match `a/xb`, and otherwise moves on when it reads a `/`
+    void Close(State& state, bool folder_start) const
+    {
+        for (size_t word = 0; word < state.size(); word++)
+        {
+            uint64 bits = state[word];
+            while (bits)
+            {
+                uint32 bit = std::countr_zero(bits);
+                bits &= ~(1ull << bit);
+
+                uint32 index = (uint32)word * 64 + bit;
+                uint8 type = tokens[index].type;
+                if (type != Token::AnyName && type != Token::AnyBytes && (type != Token::AnyFolders || !folder_start))
+                    continue;
+
+                Set(state, index + 1);
+                if (bit < 63)
+                    bits |= 1ull << (bit + 1);
+            }
+        }
+    }
+
+    std::vector<Token> tokens;
+    std::vector<Rule> rules;
+};
+
+// Matches single rules against paths whose outcome is known and prints any that disagree. A wrong match silently drops
+// assets from the packed maps, so this is worth running after the matcher changes
+static bool CheckAssetFilter()
+{
+    struct Case
+    {
+        const char* rule;
+        AssetRule kind;
+        const char* path;
+        bool folder;
+        bool matches;
+    };
+
+    const Case cases[] =
+    {
+        { "materials/**/a.vtf", AssetRule::Include, "materials/a.vtf", false, true },
+        { "materials/**/a.vtf", AssetRule::Include, "materials/x/y/a.vtf", false, true },
+        { "materials/**/a.vtf", AssetRule::Include, "materials/xa.vtf", false, false },
+        { "materials/**/a.vtf", AssetRule::Include, "materials/foo/bara.vtf", false, false },
+        { "**/b.vtf", AssetRule::Include, "b.vtf", false, true },
+        { "**/b.vtf", AssetRule::Include, "a/b.vtf", false, true },
+        { "**/b.vtf", AssetRule::Include, "ab.vtf", false, false },
+        { "materials/**", AssetRule::Include, "materials/x/y.vtf", false, true },
+        { "*.vtf", AssetRule::Include, "materials/x/y.vtf", false, true },
+        { "materials/*.vtf", AssetRule::Include, "materials/x/y.vtf", false, false },
+        { "**/old/", AssetRule::Exclude, "old", true, true },
+        { "**/old/", AssetRule::Exclude, "x/old", true, true },
+        { "**/old/", AssetRule::Exclude, "bold", true, false },
+        { "**/old/", AssetRule::Exclude, "x/bold", true, false },
+        { "old/", AssetRule::Exclude, "x/old", true, true },
+        { "materials/", AssetRule::Include, "materials", true, true },
+        { "materials/", AssetRule::Include, "x/materials", true, true },
+        { "/materials/", AssetRule::Include, "x/materials", true, false },
+    };
+
+    bool passed = true;
+    for (const Case& test : cases)
+    {
+        AssetFilter filter;
+        filter.AddRule("*", AssetRule::Extension);
+        filter.AddRule(test.rule, test.kind);
+
+        AssetFilter::State state;
+        filter.Start(state);
+        filter.Feed(state, test.path, strlen(test.path));
+
+        bool matches = !test.folder ? filter.IncludesFile(state, false) == (test.kind == AssetRule::Include)
+            : test.kind == AssetRule::Exclude ? filter.ExcludesFolder(state) : filter.IncludesFolder(state);
+
+        if (matches != test.matches)
+        {
+            ConsolePrintf(RED, "\"%s\" %s %s, which it shouldn't\n", test.rule, matches ? "matched" : "didn't match", test.path);
+            passed = false;
+        }
+    }
+
+    ConsolePrintf(passed ? AQUA : RED, "%s\n", passed ? "Every asset rule case matched as expected" : "Some asset rule cases didn't match as expected");
+    return passed;
+}
+
+struct Config
+{
+
+public:
+
+    bool ParseConfig(const std::string& config_name, BSPInfoList& bsplist)
+    {
+        // Load json file
+        std::ifstream stream(config_name);
+        if (stream.fail())
+        {
+            ConsolePrintf(RED, "Failed to open %s. Does the file exist?\n", config_name);
+            return false;
+        }
+
+        ConsolePrintf(WHITE, "> Parsing Settings & Maps\n\n");
+        g_AllocProfiler.SetStage(PROFILE_STAGE_CONFIG);
+
+        json data = json::parse(stream, nullptr, false, true);
+        if (data.is_discarded())
+        {
+            ConsolePrintf(RED, "Found syntax errors within config.json\n");
+            return false;
+        }
+        
+        bool bSuccess = true;
+        if (!ParseSettings(data))
+        {
+            stream.close();
+            return false;
+        }
+
+        // Asset folders are walked while the maps are parsed
+        g_AllocProfiler.SetStage(PROFILE_STAGE_SCANNING);
+        if (!ParseMaps(data, bsplist))
+        {
+            stream.close();
+            return false;
+        }
+
+        if (!ParseSharedAssets(data))
+        {
+            stream.close();
+            return false;
+        }
+
+        if (stock_content_settings.enabled && !FilterStockAssets(bsplist))
+        {
+            stream.close();
+            return false;
+        }
+
+        // Shared assets go to the VPK instead, so the maps only see their own
+        if (shared_vpk_settings.enabled)
+        {
+            vpk_assets = std::move(shared_assets);
+            shared_assets.clear();
+        }
+
+        // A shard packs its share of the maps and leaves uploading to the merge, which uploads what every shard packed
+        if (shard_count)
+        {
+            upload_maps_to_workshop = false;
+            SelectShard(bsplist);
+        }
+        else if (merge && !LoadShardManifests(bsplist))
+        {
+            stream.close();
+            return false;
+        }
+
+        stream.close();
+        data.clear();
+
+        ConsolePrintf(YELLOW, "- - - - - - - - - - < Settings > - - - - - - - - - -\n\n");
+        ConsolePrintf(AQUA, "Outputting Maps @: \"%s\"\n", base_output_path.c_str());
+        ConsolePrintf(AQUA, force_map_compression ? "Forced BSP Compression: Enabled\n" : "Forced BSP Compression: Disabled\n");
+        ConsolePrintf(AQUA, upload_maps_to_workshop ? "Workshop Uploading: Enabled\n" : "Workshop Uploading: Disabled\n");
+        ConsolePrintf(AQUA, resume ? "Resume: Skipping work finished by previous runs\n" : "Resume: Disabled\n");
+        if (shard_count)
+            ConsolePrintf(AQUA, "Sharding: Packing shard %u of %u, uploads are left to the merge\n", shard_index, shard_count);
+        else
+            ConsolePrintf(AQUA, merge ? "Sharding: Merging the shards' outputs, nothing is packed\n" : "Sharding: Disabled\n");
+
+        ConsolePrintf(AQUA, vtf_settings.enabled ? "VTF Optimization: Enabled (%llu rules)\n" : "VTF Optimization: Disabled\n", (uint64)vtf_settings.rules.size());
+        ConsolePrintf(AQUA, "Packing Memory Limit: %u MB (%u parallel maps)\n", packing_settings.memory_limit_mb, packing_settings.parallel_maps);
+        ConsolePrintf(AQUA, packing_settings.deterministic ? "Deterministic Output: Enabled\n" : "Deterministic Output: Disabled\n");
+        if (check_determinism)
+            ConsolePrintf(AQUA, "Determinism Check: Every map is packed twice and compared\n");
+
+        ConsolePrintf(AQUA, size_budget_mb ? "Size Budget: %u MB\n" : "Size Budget: None\n", size_budget_mb);
+        ConsolePrintf(AQUA, metrics_settings.enabled ? "Metrics: \"%s\" (every %u seconds)\n" : "Metrics: Disabled\n", metrics_settings.path.c_str(), metrics_settings.interval_seconds);
+        ConsolePrintf(AQUA, source_cache_settings.enabled ? "Source Cache: \"%s\" (%llu MB)\n" : "Source Cache: Disabled\n", source_cache_settings.path.c_str(), source_cache_settings.max_size_mb);
+        ConsolePrintf(AQUA, !entry_order_settings.enabled ? "Entry Order: Unchanged\n" : entry_order_settings.profile_path.empty() ? "Entry Order: Grouped\n" : "Entry Order: Grouped after \"%s\"\n", entry_order_settings.profile_path.c_str());
+        ConsolePrintf(AQUA, stock_content_settings.enabled ? "Stock Content: \"%s\"\n" : "Stock Content: Disabled\n", stock_content_settings.game_path.c_str());
+        ConsolePrintf(AQUA, shared_vpk_settings.enabled ? "Shared VPK: \"%s_dir.vpk\" (%u MB chunks)\n" : "Shared VPK: Disabled\n", shared_vpk_settings.name.c_str(), shared_vpk_settings.chunk_size_mb);
+        printf("\n");
+
+        // Estimate every map before anything heavy starts, which samples every lump, so only when the estimates are
+        // wanted. A plan is all that's wanted in plan mode
+        g_AllocProfiler.SetStage(PROFILE_STAGE_PLANNING);
+        throughput.Load(base_output_path + "throughput.json");
+        if (plan || size_budget_mb)
+            PlanMaps(bsplist);
+
+        if (plan)
+            return true;
+
+        ConsolePrintf(WHITE, "Enter \"y\" to confirm these settings. Enter anything else to abort: ");
+        std::string input;
+        std::cin >> input;
+        if (!(!input.compare("y")))
+        {
+            ConsolePrintf(DEFAULT, "\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    // Writes the shared assets once into their VPK, then reports what leaving them out of every map saves
+    bool WriteSharedVPK(const BSPInfoList& bsplist)
+    {
+        ConsolePrintf(YELLOW, "\n - - - - - - - - - - Writing Shared VPK - - - - - - - - - - \n\n");
+        if (vpk_assets.empty())
+        {
+            ConsolePrintf(YELLOW, "There are no shared assets to write\n");
+            return true;
+        }
+
+        uint32 threads = packing_settings.compression_threads ? packing_settings.compression_threads : std::max(1u, std::thread::hardware_concurrency());
+        VPKWriter writer(shared_vpk_settings, packing_settings.output, threads);
+        uint64 total_bytes = 0;
+        if (!writer.Write(base_output_path, vpk_assets, total_bytes))
+            return false;
+
+        // Every map that packs assets would have carried its own copy
+        uint64 maps = 0;
+        for (const BSPFileInfo& info : bsplist)
+            if (!info.ignore_assets)
+                ++maps;
+
+        uint64 saved = maps ? total_bytes * (maps - 1) : 0;
+        ConsolePrintf(AQUA, "%s_dir.vpk : %llu assets, %.2f MB in %u chunks\n", shared_vpk_settings.name.c_str(), (uint64)vpk_assets.size() / 2, total_bytes / 1048576.0, writer.ChunkCount());
+        ConsolePrintf(AQUA, "Saved ~%.2f MB by writing the shared assets once instead of into %llu maps\n", saved / 1048576.0, maps);
+        return true;
+    }
+
+    // Splits the maps between the shards by their estimated cost, largest first onto whichever shard has the least so far,
+    // then keeps this shard's. Only sizes and names decide the split, so every machine given the same config agrees on it
+    void SelectShard(BSPInfoList& bsplist)
+    {
+        std::vector<size_t> order(bsplist.size());
+        std::vector<uint64> costs(bsplist.size());
+        for (size_t i = 0; i < bsplist.size(); i++)
+        {
+            order[i] = i;
+            costs[i] = InputBytes(bsplist[i]);
+        }
+
+        std::sort(order.begin(), order.end(), [&](size_t a, size_t b)
+        {
+            return costs[a] != costs[b] ? costs[a] > costs[b] : bsplist[a].name < bsplist[b].name;
+        });
+
+        std::vector<uint64> loads(shard_count, 0);
+        std::vector<bool> selected(bsplist.size(), false);
+        for (size_t i : order)
+        {
+            uint32 shard = (uint32)(std::min_element(loads.begin(), loads.end()) - loads.begin());
+            loads[shard] += costs[i];
+            selected[i] = shard + 1 == shard_index;
+        }
+
+        size_t kept = 0;
+        for (size_t i = 0; i < bsplist.size(); i++)
+        {
+            if (!selected[i])
+                continue;
+
+            if (kept != i)
+                bsplist[kept] = std::move(bsplist[i]);
+
+            kept++;
+        }
+
+        bsplist.resize(kept);
+
+        uint64 total_bytes = 0;
+        for (uint64 load : loads)
+            total_bytes += load;
+
+        ConsolePrintf(AQUA, "Shard %u of %u: %llu maps, %.2f MB of %.2f MB\n\n", shard_index, shard_count, (uint64)kept, loads[shard_index - 1] / 1048576.0, total_bytes / 1048576.0);
+        if (!kept)
+            ConsolePrintf(YELLOW, "There are fewer maps than shards, so this shard has nothing to pack\n\n");
+    }
+
+    // Records what this shard packed for the merge to check and upload from. It's written last, so a shard that stops
+    // early leaves no manifest behind
+    bool WriteShardManifest(const std::string& manifest_path, const BSPInfoList& bsplist)
+    {
+        json maps = json::array();
+        for (const BSPFileInfo& info : bsplist)
+        {
+            json entry;
+            entry["name"] = info.name;
+            entry["inputs"] = info.input_hash;
+            entry["output"] = OutputFingerprint(info.output_path);
+            entry["verified"] = info.verified;
+            maps.push_back(entry);
+        }
+
+        json manifest;
+        manifest["shard"] = shard_index;
+        manifest["shard_count"] = shard_count;
+        manifest["settings"] = settings_hash;
+        manifest["maps"] = maps;
+
+        std::string dump = manifest.dump(4);
+        if (!WriteFileContents(manifest_path, (const uint8*)dump.data(), dump.size()))
+        {
+            ConsolePrintf(RED, "Failed to write the shard manifest %s\n", manifest_path.c_str());
+            return false;
+        }
+
+        ConsolePrintf(AQUA, "Wrote the manifest for shard %u of %u to %s. Run \"merge\" once every shard has finished\n\n", shard_index, shard_count, manifest_path.c_str());
+        return true;
+    }
+
+    struct ShardOutput
+    {
+        uint32 shard = 0;
+        std::string inputs;
+        std::string output;
+        bool verified = false;
+    };
+
+    // Reads back every shard's manifest, checking that they were packed with the same settings and together cover every
+    // map in the config exactly once
+    bool LoadShardManifests(const BSPInfoList& bsplist)
+    {
+        std::string shards_path(base_output_path + "shards/");
+        std::vector<std::string> manifest_paths;
+        std::error_code ec;
+        for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(shards_path, ec))
+            if (entry.is_regular_file() && entry.path().extension() == ".json")
+                manifest_paths.push_back(entry.path().string());
+
+        if (manifest_paths.empty())
+        {
+            ConsolePrintf(RED, "No shard manifests were found in %s. Run every shard with --shard i/N first\n", shards_path.c_str());
+            return false;
+        }
+
+        std::sort(manifest_paths.begin(), manifest_paths.end());
+        uint32 count = 0;
+        std::vector<bool> found;
+        for (const std::string& path : manifest_paths)
+        {
+            std::ifstream stream(path);
+            json manifest = json::parse(stream, nullptr, false);
+            if (manifest.is_discarded() || !manifest.contains("shard") || !manifest["shard"].is_number_unsigned() || !manifest.contains("shard_count")
+                || !manifest["shard_count"].is_number_unsigned() || !manifest.contains("settings") || !manifest["settings"].is_string()
+                || !manifest.contains("maps") || !manifest["maps"].is_array())
+            {
+                ConsolePrintf(RED, "The shard manifest %s is malformed\n", path.c_str());
+                return false;
+            }
+
+            uint32 shard = manifest["shard"].get<uint32>();
+            if (!count)
+            {
+                count = manifest["shard_count"].get<uint32>();
+                found.assign(count, false);
+            }
+
+            if (manifest["shard_count"].get<uint32>() != count)
+            {
+                ConsolePrintf(RED, "The shard manifests in %s were written for different shard counts. Remove the ones left by older runs\n", shards_path.c_str());
+                return false;
+            }
+
+            if (!shard || shard > count || found[shard - 1])
+            {
+                ConsolePrintf(RED, "The shard manifest %s is malformed\n", path.c_str());
+                return false;
+            }
+
+            if (manifest["settings"].get<std::string>() != settings_hash)
+            {
+                ConsolePrintf(RED, "Shard %u of %u was packed with different settings than config.json has now. Run it again\n", shard, count);
+                return false;
+            }
+
+            found[shard - 1] = true;
+            for (const json& entry : manifest["maps"])
+            {
+                if (!entry.contains("name") || !entry["name"].is_string() || !entry.contains("inputs") || !entry["inputs"].is_string()
+                    || !entry.contains("output") || !entry["output"].is_string() || !entry.contains("verified") || !entry["verified"].is_boolean())
+                {
+                    ConsolePrintf(RED, "The shard manifest %s is malformed\n", path.c_str());
+                    return false;
+                }
+
+                ShardOutput output{ shard, entry["inputs"].get<std::string>(), entry["output"].get<std::string>(), entry["verified"].get<bool>() };
+                if (!shard_outputs.emplace(entry["name"].get<std::string>(), output).second)
+                {
+                    ConsolePrintf(RED, "%s was packed by more than one shard. Were the shards given the same config?\n", entry["name"].get<std::string>().c_str());
+                    return false;
+                }
+            }
+        }
+
+        for (uint32 i = 0; i < count; i++)
+        {
+            if (!found[i])
+            {
+                ConsolePrintf(RED, "Shard %u of %u hasn't written its manifest. Wait for it to finish, or run it again\n", i + 1, count);
+                return false;
+            }
+        }
+
+        for (const BSPFileInfo& info : bsplist)
+        {
+            if (!shard_outputs.contains(info.name))
+            {
+                ConsolePrintf(RED, "%s isn't in any shard's manifest. Were the shards given the same config?\n", info.name.c_str());
+                return false;
+            }
+        }
+
+        if (shard_outputs.size() != bsplist.size())
+        {
+            ConsolePrintf(RED, "The shards packed maps that aren't enabled in config.json. Were the shards given the same config?\n");
+            return false;
+        }
+
+        ConsolePrintf(AQUA, "Merging %u shards: %llu maps\n\n", count, (uint64)bsplist.size());
+        return true;
+    }
+
+    // Points the asset lists at re-encoded textures, the same way for packing and merging so input hashes agree
+    bool OptimizeTextures(BSPInfoList& bsplist)
+    {
+        if (!vtf_settings.enabled)
+            return true;
+
+        ConsolePrintf(YELLOW, "\n - - - - - - - - - - Optimizing Textures - - - - - - - - - - \n\n");
+        std::vector<std::vector<std::string>*> asset_lists;
+        for (BSPFileInfo& info : bsplist)
+            if (!info.ignore_assets)
+                asset_lists.push_back(&info.assets);
+
+        asset_lists.push_back(&shared_assets);
+        asset_lists.push_back(&vpk_assets);
+
+        VTFOptimizer optimizer(vtf_settings);
+        optimizer.verbose_logging = verbose_logging;
+        return optimizer.Run(asset_lists);
+    }
+
+    // Stands in for packing when merging. Each map a shard verified is queued for upload, as long as its inputs and its
+    // output are still the ones the shard had
+    bool QueueShardOutputs(BSPInfoList& bsplist, UploadQueue* upload_queue)
+    {
+        if (!OptimizeTextures(bsplist))
+            return false;
+
+        ConsolePrintf(YELLOW, "\n - - - - - - - - - - Merging Shards - - - - - - - - - - \n\n");
+        bool complete = true;
+        for (BSPFileInfo& info : bsplist)
+        {
+            const ShardOutput& output = shard_outputs[info.name];
+            std::string output_hash = OutputFingerprint(info.output_path);
+            info.input_hash = InputHash(info);
+            bool current = info.input_hash == output.inputs;
+            info.verified = output.verified && current && !output_hash.empty() && output_hash == output.output;
+            if (!output.verified)
+                ConsolePrintf(RED, "%s failed verification on shard %u and won't be uploaded\n", info.name.c_str(), output.shard);
+            else if (!current)
+                ConsolePrintf(RED, "%s's source, assets or settings have changed since shard %u packed it and it won't be uploaded. Run that shard again\n", info.name.c_str(), output.shard);
+            else if (!info.verified)
+                ConsolePrintf(RED, "%s has changed since shard %u packed it and won't be uploaded. Run that shard again\n", info.name.c_str(), output.shard);
+
+            if (!info.verified)
+            {
+                g_Metrics.SetStage(info.name, "failed", false);
+                complete = false;
+                continue;
+            }
+
+            ConsolePrintf(AQUA, "%s (Packed by shard %u)\n", info.name.c_str(), output.shard);
+            g_Metrics.SetStage(info.name, "packed", false);
+            if (!upload_queue || !info.upload)
+                continue;
+
+            if (resume && g_Journal.IsDone(info.name, "uploaded", info.input_hash, output_hash))
+                ConsolePrintf(AQUA, "%s was already uploaded by a previous run\n", info.name.c_str());
+            else
+            {
+                g_Metrics.SetStage(info.name, "upload_queued");
+                upload_queue->Push(&info);
+            }
+        }
+
+        printf("\n");
+        return complete;
+    }
+
+    // Packs every map, pushing each one marked for upload to the queue once its output is verified
+    bool PackMaps(BSPInfoList& bsplist, UploadQueue* upload_queue)
+    {
+        // Re-encode qualifying textures before anything is packed
+        if (!OptimizeTextures(bsplist))
+            return false;
+
+        // Shards running side by side each clear their own temp directory when they finish
+        std::string temp_path(std::filesystem::temp_directory_path().string() + "multi_map_packer_and_uploader/");
+        if (shard_count)
+            temp_path.insert(temp_path.size() - 1, "_shard_" + std::to_string(shard_index));
+
+        FixSlashes(temp_path);
+        if (!std::filesystem::is_directory(temp_path) && !std::filesystem::create_directory(temp_path))
+        {
+            ConsolePrintf(RED, "Failed to create a temp directory at %s\n", temp_path.c_str());
+            return false;
+        }
+
+        std::string reports_path(base_output_path + "reports/");
+        if (report_settings.enabled && !std::filesystem::create_directory(reports_path) && !std::filesystem::is_directory(reports_path))
+        {
+            ConsolePrintf(RED, "Failed to create a reports directory at %s\n", reports_path.c_str());
+            return false;
+        }
+
+        std::string state_path(base_output_path + "state/");
+        if (packing_settings.incremental && !std::filesystem::create_directory(state_path) && !std::filesystem::is_directory(state_path))
+        {
+            ConsolePrintf(RED, "Failed to create a state directory at %s\n", state_path.c_str());
+            return false;
+        }
+
+        std::string shards_path(base_output_path + "shards/");
+        std::string manifest_path(shards_path + "shard_" + std::to_string(shard_index) + "_of_" + std::to_string(shard_count) + ".json");
+        if (shard_count)
+        {
+            std::error_code ec;
+            if (!std::filesystem::create_directory(shards_path, ec) && !std::filesystem::is_directory(shards_path))
+            {
+                ConsolePrintf(RED, "Failed to create a shards directory at %s\n", shards_path.c_str());
+                return false;
+            }
+
+            // A manifest left by an earlier run of this shard mustn't outlive the outputs it describes
+            std::filesystem::remove(manifest_path, ec);
+        }
+
+        // Only the first shard writes the shared VPK, since every shard would write the same one
+        if (shared_vpk_settings.enabled && shard_index <= 1 && !WriteSharedVPK(bsplist))
+            return false;
+
+        // Copy maps to output directory
+        ConsolePrintf(YELLOW, "\n - - - - - - - - - - Packing Maps - - - - - - - - - - \n\n");
+
+        // Every packer streams through two pooled buffers and writes through two output buffers. Whatever is left of the budget
+        // is split between each packer's compression threads, half for their LZMA encoders and half for the window of entries
+        // they compress ahead
+        uint32 workers = packing_settings.parallel_maps;
+        uint64 memory_limit = (uint64)packing_settings.memory_limit_mb * 1048576;
+        BufferPool pool(PACK_BUFFER_SIZE, workers * 2);
+        uint64 fixed_bytes = pool.TotalBytes() + (uint64)workers * 2 * OUTPUT_BUFFER_SIZE;
+        uint64 packer_budget = (memory_limit - std::min<uint64>(memory_limit, fixed_bytes)) / workers;
+
+        PackerLimits limits;
+        uint32 compression_threads = packing_settings.compression_threads ? packing_settings.compression_threads : std::max(1u, std::thread::hardware_concurrency());
+        limits.threads = std::max(1u, compression_threads / workers);
+        if (limits.threads > 1)
+        {
+            limits.dictionary_size = LZMADictionaryForBudget(packer_budget / 2 / limits.threads);
+            limits.entry_limit = std::max<uint64>(PACK_BUFFER_SIZE, packer_budget / 2 / (limits.threads * 2 * 2));
+        }
+        else
+            limits.dictionary_size = LZMADictionaryForBudget(packer_budget);
+
+        // The dictionary is part of the output, so deterministic packing fixes it and runs fewer threads if they don't fit
+        if (packing_settings.deterministic)
+        {
+            uint64 encoder_bytes = (uint64)DETERMINISTIC_DICTIONARY_SIZE * 2 * 12 + (4 << 20);
+            limits.deterministic = true;
+            limits.dictionary_size = DETERMINISTIC_DICTIONARY_SIZE;
+            if (limits.threads > 1)
+                limits.threads = (uint32)std::clamp<uint64>(packer_budget / 2 / encoder_bytes, 1, limits.threads);
+        }
+
+        if (entry_order_settings.enabled)
+            limits.order = &entry_order;
+
+        CompressionPolicy compression_policy(compression_settings);
+        BSPPacker packer(pool, compression_policy, limits, packing_settings.output);
+
+        // Packs every map a second time, on one thread and with its assets listed the other way around, to prove the output doesn't depend on either
+        PackerLimits check_limits = limits;
+        check_limits.threads = 1;
+        CompressionPolicy check_policy(compression_settings);
+        BSPPacker check_packer(pool, check_policy, check_limits, packing_settings.output);
+
+        std::atomic<size_t> next_map = 0;
+        std::atomic<bool> failed = false;
+        auto worker = [&]()
+        {
+            for (size_t i = next_map++; i < bsplist.size() && !failed; i = next_map++)
+            {
+                BSPFileInfo& info = bsplist[i];
+                info.input_hash = InputHash(info);
+
+                // When resuming, maps a previous run packed and verified from the same inputs are left as they are
+                bool packed_before = resume && !info.ignore_assets && g_Journal.IsDone(info.name, "verified", info.input_hash, OutputFingerprint(info.output_path));
+                if (packed_before)
+                {
+                    ConsolePrintf(AQUA, "%s (Already packed by a previous run)\n\n", info.name.c_str());
+                    g_Metrics.SetStage(info.name, "packed", false);
+                }
+                else if (!PackMap(info, temp_path, reports_path, packer, check_determinism ? &check_packer : nullptr))
+                {
+                    g_Metrics.SetStage(info.name, "failed", false);
+                    g_Metrics.CountMap(true);
+                    failed = true;
+                    break;
+                }
+
+                std::string output_hash = OutputFingerprint(info.output_path);
+                bool verified = packed_before || VerifyBSP(info.output_path);
+                info.verified = verified;
+                if (!packed_before)
+                {
+                    // A map only counts as completed once its output is verified
+                    if (!verified)
+                        g_Metrics.SetStage(info.name, "failed", false);
+
+                    g_Metrics.CountMap(!verified);
+                }
+
+                if (!packed_before && !info.ignore_assets)
+                {
+                    g_Journal.Record(info.name, "packed", info.input_hash, output_hash);
+                    if (verified)
+                        g_Journal.Record(info.name, "verified", info.input_hash, output_hash);
+                    else
+                        ConsolePrintf(RED, "%s failed verification at %s\n", info.name.c_str(), info.output_path.c_str());
+                }
+
+                if (!upload_queue || !info.upload)
+                    continue;
+
+                if (!verified)
+                    ConsolePrintf(RED, "%s failed verification at %s and won't be uploaded\n", info.name.c_str(), info.output_path.c_str());
+                else if (resume && g_Journal.IsDone(info.name, "uploaded", info.input_hash, output_hash))
+                    ConsolePrintf(AQUA, "%s was already uploaded by a previous run\n", info.name.c_str());
+                else
+                {
+                    g_Metrics.SetStage(info.name, "upload_queued");
+                    upload_queue->Push(&info);
+                }
+            }
+        };
+
+        std::vector<std::thread> threads;
+        for (uint32 i = 1; i < std::min<size_t>(workers, bsplist.size()); i++)
+            threads.emplace_back(worker);
+
+        worker();
+        for (std::thread& thread : threads)
+            thread.join();
+
+        if (failed)
+            return false;
+
+        compression_policy.PrintReport();
+        packer.PrintMergeSummary();
+        source_cache.PrintSummary();
+        ConsolePrintf(AQUA, "Peak packing memory: %.1f MB (limit %u MB, %u parallel maps)\n\n", g_PackMemory.Peak() / 1048576.0, packing_settings.memory_limit_mb, workers);
+
+        if (std::filesystem::is_directory(temp_path))
+            std::filesystem::remove_all(temp_path);
+
+        return !shard_count || WriteShardManifest(manifest_path, bsplist);
+    }
+    
+    void StartMetrics()
+    {
+        g_Metrics.Start(metrics_settings);
+    }
+
+    std::string base_output_path;
+    bool upload_maps_to_workshop = false;
+    bool resume = false;
+    bool check_determinism = false;
+    bool plan = false;
+    bool merge = false;
+    uint32 shard_index = 0;
+    uint32 shard_count = 0;
+    ThroughputHistory throughput;
+    UploadRetrySettings upload_retry_settings;
+
+private:
+
+    bool PackMap(BSPFileInfo& info, const std::string& temp_path, const std::string& reports_path, BSPPacker& packer, BSPPacker* check_packer)
+    {
+        bool compress = info.compress || force_map_compression;
+        std::string state_file(base_output_path + "state/" + info.name + ".json");
+        if (info.ignore_assets || HasNothingToPack(info, compress))
+            return PassThroughMap(info, state_file);
+
+        // Outputs are written in place, which mustn't reach the source through a link left by an earlier pass through
+        std::error_code ec;
+        if (IsLinkedToSource(info.source_path, info.output_path))
+            std::filesystem::remove(info.output_path, ec);
+
+        size_t patched_assets = 0;
+        auto pack_start = std::chrono::steady_clock::now();
+        bool patched = packing_settings.incremental && !packing_settings.deterministic && PatchMap(info, compress, state_file, packer, patched_assets);
+        if (!patched && !RebuildMap(info, temp_path, packer, check_packer, compress))
+            return false;
+
+        // Only full rebuilds say how long the next one will take
+        if (!patched && !check_packer)
+            throughput.AddPack(compress, InputBytes(info), std::chrono::duration<double>(std::chrono::steady_clock::now() - pack_start).count());
+
+        if (packing_settings.incremental)
+            SavePackState(info, compress, state_file);
+
+        // Keep a map's completion line and its report together when maps finish at the same time
+        std::lock_guard<std::recursive_mutex> lock(g_ConsoleMutex);
+        if (patched)
+            ConsolePrintf(AQUA, "%s (Completed, patched %llu changed assets)     \n", info.name.c_str(), (uint64)patched_assets);
+        else
+            ConsolePrintf(AQUA, "%s (Completed)                      \n", info.name.c_str());
+
+        if (!patched && info.strip.Enabled())
+            PrintStripSavings(info);
+
+        if (report_settings.enabled)
+        {
+            g_Metrics.SetStage(info.name, "reporting");
+            BSPReport report(report_settings);
+            if (report.Generate(info.name, info.output_path) && report.Write(reports_path + info.name + ".json"))
+                report.PrintSummary();
+        }
+
+        ConsolePrintf(DEFAULT, "\n");
+
+        g_Metrics.AddBytesPacked(std::filesystem::file_size(info.output_path, ec));
+        g_Metrics.SetStage(info.name, "packed", false);
+        return true;
+    }
+
+    void PrintStripSavings(const BSPFileInfo& info)
+    {
+        uint64 total = 0;
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+        {
+            if (!((info.strip.lumps >> i) & 1) && (i != BSP_LUMP_GAME_LUMP || info.strip.game_lumps.empty()))
+                continue;
+
+            ConsolePrintf(WHITE, "  Stripped LUMP_%-32s %10.1f KB\n", g_LumpNames[i], info.strip.saved[i] / 1024.0);
+            total += info.strip.saved[i];
+        }
+
+        ConsolePrintf(AQUA, "  Stripping saved %.2f MB\n", total / 1048576.0);
+    }
+
+    // Maps without assets whose source is already uncompressed would come out of packing as they went in
+    bool HasNothingToPack(const BSPFileInfo& info, bool compress)
+    {
+        bool source_compressed = true;
+        return !compress && info.assets.empty() && shared_assets.empty() && !info.strip.Enabled() && ReadBSPCompression(info.source_path, source_compressed) && !source_compressed;
+    }
+
+    // Puts the source where its output goes without copying it if possible, so it can still be uploaded
+    bool PassThroughMap(const BSPFileInfo& info, const std::string& state_file)
+    {
+        ConsolePrintf(YELLOW, "%s (Passing Through)...            \r", info.name.c_str());
+        g_Metrics.SetStage(info.name, "passing_through");
+        PassthroughMethod method = PassThroughFile(info.source_path, info.output_path);
+        if (method == PASSTHROUGH_FAILED)
+        {
+            ConsolePrintf(RED, "Failed to put %s at %s\n", info.source_path.c_str(), info.output_path.c_str());
+            return false;
+        }
+
+        // The state of an earlier packed output doesn't describe this one
+        std::error_code ec;
+        std::filesystem::remove(state_file, ec);
+
+        ConsolePrintf(AQUA, "%s (%s, %s)                    \n\n", info.name.c_str(), info.ignore_assets ? "Ignored Assets" : "Nothing to Pack", g_PassthroughNames[method]);
+        g_Metrics.SetStage(info.name, info.ignore_assets ? "ignored" : "passed_through", false);
+        return true;
+    }
+
+    bool RebuildMap(BSPFileInfo& info, const std::string& temp_path, BSPPacker& packer, BSPPacker* check_packer, bool compress)
+    {
+        bool source_compressed = false;
+        if (!ReadBSPCompression(info.source_path, source_compressed))
+        {
+            ConsolePrintf(RED, "Failed to read a valid bsp from %s\n", info.source_path.c_str());
+            return false;
+        }
+
+        // Compressed outputs keep what the source already compressed, so only uncompressed outputs need the source decompressed
+        if (compress || !source_compressed)
+        {
+            ConsolePrintf(YELLOW, "%s (Packing)...                    \r", info.name.c_str());
+            g_Metrics.SetStage(info.name, "packing");
+            return packer.Pack(info.source_path, { &info.assets, &shared_assets }, info.output_path, compress, &info.strip) && CheckDeterminism(info, info.source_path, check_packer, compress);
+        }
+
+        // Sources that were decompressed before go straight to packing
+        uint64 source_hash = 0;
+        std::string cached_bsp;
+        if (source_cache.Enabled())
+        {
+            ConsolePrintf(YELLOW, "%s (Hashing)...                    \r", info.name.c_str());
+            g_Metrics.SetStage(info.name, "hashing");
+            if (!HashFile(info.source_path, source_hash))
+            {
+                ConsolePrintf(RED, "Failed to read %s\n", info.source_path.c_str());
+                return false;
+            }
+
+            if (source_cache.Find(source_hash, cached_bsp))
+            {
+                ConsolePrintf(YELLOW, "%s (Packing)...                    \r", info.name.c_str());
+                g_Metrics.SetStage(info.name, "packing");
+                bool packed = packer.Pack(cached_bsp, { &info.assets, &shared_assets }, info.output_path, compress, &info.strip) && CheckDeterminism(info, cached_bsp, check_packer, compress);
+                source_cache.Release(source_hash);
+                return packed;
+            }
+        }
+
+        std::string temp_bsp(temp_path + info.name + ".bsp");
+        ConsolePrintf(YELLOW, "%s (Decompressing)...            \r", info.name.c_str());
+        g_Metrics.SetStage(info.name, "decompressing");
+        if (!packer.Decompress(info.source_path, temp_bsp))
+            return false;
+
+        if (source_cache.Enabled())
+            source_cache.Store(source_hash, temp_bsp, info.name);
+
+        ConsolePrintf(YELLOW, "%s (Packing)...                    \r", info.name.c_str());
+        g_Metrics.SetStage(info.name, "packing");
+        if (!packer.Pack(temp_bsp, { &info.assets, &shared_assets }, info.output_path, compress, &info.strip) || !CheckDeterminism(info, temp_bsp, check_packer, compress))
+            return false;
+
+        std::error_code ec;
+        std::filesystem::remove(temp_bsp, ec);
+        return true;
+    }
+
+    bool CheckDeterminism(const BSPFileInfo& info, const std::string& source_bsp, BSPPacker* check_packer, bool compress)
+    {
+        if (!check_packer)
+            return true;
+
+        ConsolePrintf(YELLOW, "%s (Checking Determinism)...        \r", info.name.c_str());
+        g_Metrics.SetStage(info.name, "checking_determinism");
+
+        // Reverse the order of the assets, keeping repeated paths in order so the same one still wins
+        std::vector<std::string> lists[2] = { info.assets, shared_assets };
+        for (std::vector<std::string>& list : lists)
+        {
+            std::vector<size_t> pairs;
+            for (size_t i = 0; i + 1 < list.size(); i += 2)
+                pairs.push_back(i);
+
+            std::stable_sort(pairs.begin(), pairs.end(), [&](size_t a, size_t b) { return ToLower(list[a]) > ToLower(list[b]); });
+            std::vector<std::string> reversed;
+            for (size_t i : pairs)
+            {
+                reversed.push_back(list[i]);
+                reversed.push_back(list[i + 1]);
+            }
+
+            list = std::move(reversed);
+        }
+
+        std::string check_path(info.output_path + ".check");
+        uint64 output_hash = 0, check_hash = 0;
+        LumpStrip strip = info.strip;
+        bool packed = check_packer->Pack(source_bsp, { &lists[0], &lists[1] }, check_path, compress, &strip);
+        bool identical = packed && HashFile(info.output_path, output_hash) && HashFile(check_path, check_hash) && output_hash == check_hash;
+
+        std::error_code ec;
+        std::filesystem::remove(check_path, ec);
+        if (!identical)
+        {
+            ConsolePrintf(RED, "%s : Packing the same inputs again gave a different output (%s, %s)\n", info.name.c_str(), HashToString(output_hash).c_str(), HashToString(check_hash).c_str());
+            return false;
+        }
+
+        return true;
+    }
+
+    // The bytes a map is packed from, which pack speeds are measured against
+    uint64 InputBytes(const BSPFileInfo& info)
+    {
+        std::error_code ec;
+        uint64 bytes = std::filesystem::file_size(info.source_path, ec);
+        if (info.ignore_assets)
+            return bytes;
+
+        std::vector<const std::vector<std::string>*> asset_lists = { &info.assets, &shared_assets };
+        for (const std::vector<std::string>* list : asset_lists)
+            for (size_t i = 0; i + 1 < list->size(); i += 2)
+                bytes += std::filesystem::file_size((*list)[i + 1], ec);
+
+        return bytes;
+    }
+
+    struct MapEstimate
+    {
+        uint64 input_bytes = 0;
+        uint64 raw_bytes = 0;
+        uint64 output_bytes = 0;
+    };
+
+    // Estimates how large each map's output will be and how long packing and uploading it will take, from speeds
+    // measured by previous runs, and warns about maps over the size budget. Plan mode prints every estimate
+    void PlanMaps(const BSPInfoList& bsplist)
+    {
+        CompressionPolicy policy(compression_settings);
+        if (plan)
+        {
+            ConsolePrintf(YELLOW, "- - - - - - - - - - < Plan > - - - - - - - - - -\n\n");
+            ConsolePrintf(AQUA, "%-32s %12s %12s %10s %10s\n", "Map", "Raw MB", "Output MB", "Pack", "Upload");
+        }
+
+        MapEstimate total;
+        double total_pack = 0.0, total_upload = 0.0;
+        bool times_known = true;
+        uint32 over_budget = 0;
+        for (const BSPFileInfo& info : bsplist)
+        {
+            bool compress = info.compress || force_map_compression;
+            MapEstimate estimate;
+            if (!EstimateMap(info, compress, policy, estimate))
+            {
+                ConsolePrintf(YELLOW, "%s : Failed to read %s to estimate its output\n", info.name.c_str(), info.source_path.c_str());
+                continue;
+            }
+
+            // Unknown until a run has measured it
+            double pack_seconds = info.ignore_assets ? 0.0 : -1.0;
+            double upload_seconds = info.upload && upload_maps_to_workshop ? -1.0 : 0.0;
+            if (pack_seconds < 0.0 && throughput.PackSpeed(compress) > 0.0)
+                pack_seconds = estimate.input_bytes / throughput.PackSpeed(compress);
+
+            if (upload_seconds < 0.0 && throughput.UploadSpeed() > 0.0)
+                upload_seconds = estimate.output_bytes / throughput.UploadSpeed();
+
+            times_known = times_known && pack_seconds >= 0.0 && upload_seconds >= 0.0;
+            total.raw_bytes += estimate.raw_bytes;
+            total.output_bytes += estimate.output_bytes;
+            total_pack += std::max(pack_seconds, 0.0);
+            total_upload += std::max(upload_seconds, 0.0);
+
+            bool over = size_budget_mb && estimate.output_bytes > ((uint64)size_budget_mb << 20);
+            over_budget += over;
+            if (plan)
+            {
+                ConsolePrintf(over ? RED : WHITE, "%-32s %12.1f %12.1f %10s %10s%s\n", info.name.c_str(), estimate.raw_bytes / 1048576.0, estimate.output_bytes / 1048576.0,
+                    pack_seconds < 0.0 ? "?" : FormatDuration(pack_seconds).c_str(), upload_seconds < 0.0 ? "?" : FormatDuration(upload_seconds).c_str(), over ? "  (over budget)" : "");
+            }
+            else if (over)
+                ConsolePrintf(RED, "%s : WARNING: The output is estimated at %.1f MB, over the size budget of %u MB\n", info.name.c_str(), estimate.output_bytes / 1048576.0, size_budget_mb);
+        }
+
+        if (plan)
+        {
+            ConsolePrintf(AQUA, "%-32s %12.1f %12.1f %10s %10s\n\n", "Total", total.raw_bytes / 1048576.0, total.output_bytes / 1048576.0, FormatDuration(total_pack).c_str(), FormatDuration(total_upload).c_str());
+            if (!times_known)
+                ConsolePrintf(YELLOW, "Times marked ? haven't been measured yet. A full run measures them for the next plan\n");
+        }
+
+        if (over_budget)
+            ConsolePrintf(RED, "%u map(s) are estimated to be over the size budget of %u MB\n\n", over_budget, size_budget_mb);
+    }
+
+    // Lumps are judged by a sample from their middle, and assets by a few samples of each extension put through the
+    // compression policy, which is enough to tell the size without compressing everything
+    bool EstimateMap(const BSPFileInfo& info, bool compress, CompressionPolicy& policy, MapEstimate& estimate)
+    {
+        const size_t lump_sample_size = 64 << 10;
+        const size_t samples_per_extension = 16;
+
+        std::ifstream input(info.source_path, std::ios::binary);
+        BSPHeader header;
+        if (input.fail() || input.read((char*)&header, sizeof(header)).fail() || header.ident != BSP_IDENT)
+            return false;
+
+        // Passed through as it is
+        estimate.input_bytes = InputBytes(info);
+        if (info.ignore_assets)
+        {
+            estimate.raw_bytes = estimate.output_bytes = estimate.input_bytes;
+            return true;
+        }
+
+        estimate.raw_bytes = estimate.output_bytes = sizeof(header);
+
+        std::vector<uint8> sample;
+        std::vector<uint8> compressed;
+        uint8 props[LZMA_PROPS_SIZE];
+        for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+        {
+            const BSPLump& lump = header.lumps[i];
+            if (i == BSP_LUMP_PAKFILE || lump.filelen <= 0 || (info.strip.lumps >> i) & 1)
+                continue;
+
+            uint64 raw = lump.uncompressed_size ? lump.uncompressed_size : (uint64)lump.filelen;
+            estimate.raw_bytes += raw;
+            if (!compress || i == BSP_LUMP_GAME_LUMP)
+                estimate.output_bytes += raw;
+            else if (lump.uncompressed_size)
+                estimate.output_bytes += lump.filelen;
+            else
+            {
+                sample.resize((size_t)std::min<uint64>(lump.filelen, lump_sample_size));
+                input.clear();
+                if (input.seekg(lump.fileofs + (lump.filelen - sample.size()) / 2).read((char*)sample.data(), sample.size()).fail())
+                    return false;
+
+                double ratio = LZMACompress(sample.data(), sample.size(), compressed, props) ? compressed.size() / (double)sample.size() : 1.0;
+                estimate.output_bytes += (uint64)(raw * ratio) + sizeof(LZMALumpHeader);
+            }
+        }
+
+        std::unordered_map<std::string, const std::string*> sources;
+        if (!info.ignore_assets)
+        {
+            std::vector<const std::vector<std::string>*> asset_lists = { &info.assets, &shared_assets };
+            for (const std::vector<std::string>* list : asset_lists)
+                for (size_t i = 0; i + 1 < list->size(); i += 2)
+                    sources[ToLower((*list)[i])] = &(*list)[i + 1];
+        }
+
+        // Entries of the source's pakfile that no asset replaces are copied as they are
+        const BSPLump& pakfile = header.lumps[BSP_LUMP_PAKFILE];
+        std::vector<ZipEntry> entries;
+        if (pakfile.filelen > 0 && pakfile.uncompressed_size)
+        {
+            estimate.raw_bytes += pakfile.uncompressed_size;
+            estimate.output_bytes += pakfile.filelen;
+        }
+        else if (pakfile.filelen > 0 && ReadZipDirectory(input, (uint64)pakfile.fileofs, (uint64)pakfile.filelen, entries))
+        {
+            for (const ZipEntry& entry : entries)
+            {
+                std::string key = ToLower(entry.name);
+                FixSlashes(key);
+                if (sources.contains(key))
+                    continue;
+
+                uint64 overhead = sizeof(ZipLocalFileHeader) + sizeof(ZipCentralFileHeader) + entry.name.length() * 2;
+                estimate.raw_bytes += entry.uncompressed_size + overhead;
+                estimate.output_bytes += (compress ? entry.compressed_size : entry.uncompressed_size) + overhead;
+            }
+        }
+
+        std::map<std::string, std::vector<std::pair<const std::string*, uint64>>> extensions;
+        for (auto& [key, source] : sources)
+        {
+            std::error_code ec;
+            uint64 size = std::filesystem::file_size(*source, ec);
+            uint64 overhead = sizeof(ZipLocalFileHeader) + sizeof(ZipCentralFileHeader) + key.length() * 2;
+            estimate.raw_bytes += size + overhead;
+            estimate.output_bytes += overhead;
+            if (compress)
+                extensions[GetExtension(key)].emplace_back(source, size);
+            else
+                estimate.output_bytes += size;
+        }
+
+        for (auto& [extension, assets] : extensions)
+        {
+            uint64 total_size = 0;
+            for (auto& [source, size] : assets)
+                total_size += size;
+
+            // Spread the samples over the extension's assets, and scale what they compressed to by all of its bytes
+            uint64 sampled_size = 0;
+            double sampled_output = 0.0;
+            size_t step = std::max<size_t>(1, assets.size() / samples_per_extension);
+            for (size_t i = 0; i < assets.size(); i += step)
+            {
+                auto& [source, size] = assets[i];
+                sample.resize((size_t)std::min<uint64>(size, policy.SampleSize()));
+                std::ifstream stream(*source, std::ios::binary);
+                if (sample.empty() || stream.read((char*)sample.data(), sample.size()).fail())
+                    continue;
+
+                CompressionDecision decision = policy.Decide(extension, sample.data(), sample.size(), size);
+                sampled_size += size;
+                sampled_output += decision.compress ? size * decision.estimated_ratio + 4 + LZMA_PROPS_SIZE : size;
+            }
+
+            estimate.output_bytes += sampled_size ? (uint64)(total_size * (sampled_output / sampled_size)) : total_size;
+        }
+
+        return true;
+    }
+
+    // Hashes what a map's output is built from: the settings that shape it, and the path, size and write time of the source and every asset
+    std::string InputHash(const BSPFileInfo& info)
+    {
+        XXHash64 hasher;
+        auto add_string = [&](const std::string& value)
+        {
+            hasher.Update(value.c_str(), value.size() + 1);
+        };
+
+        auto add_file = [&](const std::string& file)
+        {
+            std::error_code ec;
+            int64 values[2] = { (int64)std::filesystem::file_size(file, ec), 0 };
+            values[1] = (int64)std::filesystem::last_write_time(file, ec).time_since_epoch().count();
+            add_string(file);
+            hasher.Update(values, sizeof(values));
+        };
+
+        add_string(settings_hash);
+        add_string(info.name);
+        add_file(info.source_path);
+
+        uint8 flags = (info.compress ? 1 : 0) | (info.ignore_assets ? 2 : 0);
+        hasher.Update(&flags, sizeof(flags));
+        hasher.Update(&info.strip.lumps, sizeof(info.strip.lumps));
+        hasher.Update(info.strip.game_lumps.data(), info.strip.game_lumps.size() * sizeof(uint32));
+
+        // What's uploaded with the map, so a changed changelog or visibility isn't taken as already uploaded
+        uint64 workshop[2] = { info.workshop_id, (uint64)info.visibility };
+        hasher.Update(workshop, sizeof(workshop));
+        add_string(info.changelog);
+        if (!info.ignore_assets)
+        {
+            std::vector<const std::vector<std::string>*> asset_lists = { &info.assets, &shared_assets };
+            for (const std::vector<std::string>* list : asset_lists)
+            {
+                for (size_t i = 0; i + 1 < list->size(); i += 2)
+                {
+                    add_string((*list)[i]);
+                    add_file((*list)[i + 1]);
+                }
+            }
+        }
+
+        return HashToString(hasher.Digest());
+    }
+
+    // What a map's output was last packed from, so the next incremental run can tell whether patching it is enough
+    json MakePackState(const BSPFileInfo& info, bool compress)
+    {
+        std::error_code ec;
+        json state;
+        state["source_size"] = std::filesystem::file_size(info.source_path, ec);
+        state["source_time"] = (int64)std::filesystem::last_write_time(info.source_path, ec).time_since_epoch().count();
+        state["output_size"] = std::filesystem::file_size(info.output_path, ec);
+        state["output_time"] = (int64)std::filesystem::last_write_time(info.output_path, ec).time_since_epoch().count();
+        state["compress"] = compress;
+        state["strip_lumps"] = info.strip.lumps;
+        state["strip_game_lumps"] = info.strip.game_lumps;
+        return state;
+    }
+
+    void SavePackState(const BSPFileInfo& info, bool compress, const std::string& state_file)
+    {
+        json state = MakePackState(info, compress);
+        json assets = json::array();
+        std::vector<const std::vector<std::string>*> asset_lists = { &info.assets, &shared_assets };
+        for (const std::vector<std::string>* list : asset_lists)
+            for (size_t i = 0; i + 1 < list->size(); i += 2)
+                assets.push_back(ToLower((*list)[i]));
+
+        state["assets"] = assets;
+        std::string text = state.dump();
+        if (!WriteFileContents(state_file, (const uint8*)text.data(), text.size()))
+            ConsolePrintf(RED, "Failed to write the pack state %s\n", state_file.c_str());
+    }
+
+    // Patches the output in place if neither the source nor the output changed since the last run
+    bool PatchMap(BSPFileInfo& info, bool compress, const std::string& state_file, BSPPacker& packer, size_t& changed)
+    {
+        std::vector<uint8> contents;
+        if (!std::filesystem::is_regular_file(info.output_path) || !ReadFileContents(state_file, contents))
+            return false;
+
+        json previous = json::parse(contents.begin(), contents.end(), nullptr, false);
+        if (previous.is_discarded() || !previous.contains("assets") || !previous["assets"].is_array())
+            return false;
+
+        json current = MakePackState(info, compress);
+        for (auto& [key, value] : current.items())
+            if (!previous.contains(key) || previous[key] != value)
+                return false;
+
+        std::vector<std::string> previous_assets;
+        for (const json& name : previous["assets"])
+            if (name.is_string())
+                previous_assets.push_back(name.get<std::string>());
+
+        ConsolePrintf(YELLOW, "%s (Patching)...                    \r", info.name.c_str());
+        g_Metrics.SetStage(info.name, "patching");
+        return packer.Patch(info.output_path, { &info.assets, &shared_assets }, compress, previous_assets, changed);
+    }
+
+    bool ParseSettings(const json& data)
+    {
+        if (!data.contains("settings"))
+        {
+            ConsolePrintf(RED, "Failed to find the \"settings\" key\n");
+            return false;
+        }
+
+        // bspzip.exe used to decompress sources, which is now done in-process
+        const json settings = data["settings"];
+        if (settings.contains("bspzip_path"))
+            ConsolePrintf(YELLOW, "The \"bspzip_path\" key is no longer needed and is ignored\n");
+
+        // Output path
+        if (!settings.contains("bsp_output_path"))
+        {
+            ConsolePrintf(RED, "Failed to find settings key \"bsp_output_path\"\n");
+            return false;
+        }
+
+        if (!settings["bsp_output_path"].is_string())
+        {
+            ConsolePrintf(RED, "The the value of \"bsp_output_path\" must be a string\n");
+            return false;
+        }
+
+        base_output_path = settings["bsp_output_path"].get<std::string>();
+        FixSlashes(base_output_path);
+        if (!std::filesystem::is_directory(base_output_path))
+        {
+            ConsolePrintf(RED, "The value of \"base_output_path\" is not a valid directory\n");
+            return false;
+        }
+
+        if (base_output_path.rfind('/') != base_output_path.size() - 1)
+        {
+            base_output_path += '/';
+        }
+
+        // Force map compression
+        if (!settings.contains("force_map_compression"))
+        {
+            ConsolePrintf(RED, "Failed to find settings key \"force_map_compression\"\n");
+            return false;
+        }
+
+        if (!settings["force_map_compression"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"force_map_compression\" must be a boolean\n");
+            return false;
+        }
+
+        force_map_compression = settings["force_map_compression"].get<bool>();
+
+        // Upload maps to workshop
+        if (!settings.contains("upload_maps_to_workshop"))
+        {
+            ConsolePrintf(RED, "Failed to find settings key \"upload_maps_to_workshop\"\n");
+            return false;
+        }
+
+        if (!settings["upload_maps_to_workshop"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"upload_maps_to_workshop\" must have a boolean value\n");
+            return false;
+        }
+
+        upload_maps_to_workshop = settings["upload_maps_to_workshop"].get<bool>();
+
+        // Verbose logging
+        if (!settings.contains("verbose_logging"))
+        {
+            ConsolePrintf(RED, "Failed to find settings key \"verbose_logging\"\n");
+            return false;
+        }
+
+        if (!settings["verbose_logging"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"verbose_logging\" must be a boolean\n");
+            return false;
+        }
+
+        verbose_logging = settings["verbose_logging"].get<bool>();
+
+        // Extension Whitelist
+        if (!settings.contains("extension_whitelist"))
+        {
+            ConsolePrintf(RED, "Failed to find settings key \"extension_whitelist\"");
+            return false;
+        }
+
+        if (!settings["extension_whitelist"].is_array())
+        {
+            ConsolePrintf(RED, "The key \"extension_whitelist\" must be an array of strings\n");
+            return false;
+        }
+
+        for (auto& [key, value] : settings["extension_whitelist"].items())
+        {
+            if (!value.is_string())
+            {
+                ConsolePrintf(RED, "The array values of \"extension_whitelist\" must only be strings\n");
+                return false;
+            }
+
+            std::string ext = value.get<std::string>();
+            if (ext.empty())
+            {
+                ConsolePrintf(RED, "Found an empty string while searching for whitelisted extensions\n");
+                return false;
+            }
+
+            if (ext[0] != '.')
+                ext = "." + ext;
+            
+            asset_filter.AddRule("*" + ext, AssetRule::Extension);
+        }
+
+        // Asset rules (optional)
+        if (settings.contains("asset_rules") && !ParseAssetRules(settings["asset_rules"], asset_filter, "settings"))
+            return false;
+
+        // Size budget (optional)
+        if (settings.contains("size_budget_mb"))
+        {
+            if (!settings["size_budget_mb"].is_number_unsigned())
+            {
+                ConsolePrintf(RED, "The value of \"size_budget_mb\" must be an unsigned integer\n");
+                return false;
+            }
+
+            size_budget_mb = settings["size_budget_mb"].get<uint32>();
+        }
+
+        // VTF optimization (optional)
+        if (settings.contains("vtf_optimization") && !ParseVTFOptimization(settings["vtf_optimization"]))
+            return false;
+
+        // Compression policy (optional)
+        if (settings.contains("compression_policy") && !ParseCompressionPolicy(settings["compression_policy"]))
+            return false;
+
+        // Packing limits (optional)
+        if (settings.contains("packing") && !ParsePacking(settings["packing"]))
+            return false;
+
+        // Decompressed source cache (optional)
+        if (settings.contains("source_cache") && !ParseSourceCache(settings["source_cache"]))
+            return false;
+
+        // Shared asset VPK (optional)
+        if (settings.contains("shared_vpk") && !ParseSharedVPK(settings["shared_vpk"]))
+            return false;
+
+        // Uploaded maps would be missing the shared assets, and the VPK has nowhere to go on the workshop
+        if (shared_vpk_settings.enabled && upload_maps_to_workshop)
+        {
+            ConsolePrintf(RED, "\"shared_vpk\" can't be enabled while \"upload_maps_to_workshop\" is, as the uploaded maps wouldn't have their shared assets\n");
+            return false;
+        }
+
+        // Stock content index (optional)
+        if (settings.contains("stock_content") && !ParseStockContent(settings["stock_content"]))
+            return false;
+
+        // Pakfile entry order (optional)
+        if (settings.contains("entry_order") && !ParseEntryOrder(settings["entry_order"]))
+            return false;
+
+        // Metrics file (optional)
+        if (settings.contains("metrics") && !ParseMetrics(settings["metrics"]))
+            return false;
+
+        // Upload retries (optional)
+        if (settings.contains("upload_retry") && !ParseUploadRetry(settings["upload_retry"]))
+            return false;
+
+        // Size report (optional)
+        if (settings.contains("report"))
+        {
+            const json& report = settings["report"];
+            if (!report.is_object() || !report.contains("enabled") || !report["enabled"].is_boolean())
+            {
+                ConsolePrintf(RED, "The value of \"report\" must be an object with a boolean \"enabled\" key\n");
+                return false;
+            }
+
+            report_settings.enabled = report["enabled"].get<bool>();
+            if (report.contains("top_entries"))
+            {
+                if (!report["top_entries"].is_number_unsigned())
+                {
+                    ConsolePrintf(RED, "The \"top_entries\" key within \"report\" must have an unsigned integer value\n");
+                    return false;
+                }
+
+                report_settings.top_entries = report["top_entries"].get<uint32>();
+            }
+        }
+
+        // Hash the settings that shape the outputs, so finished work is redone when they change
+        json output_settings = settings;
+        for (const char* key : { "bspzip_path", "upload_maps_to_workshop", "upload_retry", "size_budget_mb", "verbose_logging", "metrics", "source_cache", "report" })
+            output_settings.erase(key);
+
+        // Of "packing", only how the output is written never changes it. Without deterministic packing, the memory and
+        // thread settings size the LZMA dictionary and incremental packing patches instead of rebuilding, so they do
+        if (output_settings.contains("packing") && output_settings["packing"].is_object())
+        {
+            json& packing = output_settings["packing"];
+            for (const char* key : { "preallocate", "flush" })
+                packing.erase(key);
+
+            if (packing_settings.deterministic)
+                for (const char* key : { "memory_limit_mb", "parallel_maps", "compression_threads", "incremental" })
+                    packing.erase(key);
+        }
+
+        // The profile changes the output as well, and its path alone says nothing of its contents
+        uint64 profile_hash = 0;
+        if (entry_order_settings.enabled && !entry_order_settings.profile_path.empty() && HashFile(entry_order_settings.profile_path, profile_hash))
+            output_settings["entry_order_profile"] = HashToString(profile_hash);
+
+        std::string dump = output_settings.dump();
+        settings_hash = HashToString(HashData(dump.data(), dump.size()));
+        return true;
+    }
+
+    bool ParseMetrics(const json& metrics)
+    {
+        if (!metrics.is_object())
+        {
+            ConsolePrintf(RED, "The value of \"metrics\" must be an object\n");
+            return false;
+        }
+
+        if (!metrics.contains("path") || !metrics["path"].is_string() || metrics["path"].get<std::string>().empty())
+        {
+            ConsolePrintf(RED, "The \"path\" key within \"metrics\" must have a non-empty string value\n");
+            return false;
+        }
+
+        metrics_settings.path = metrics["path"].get<std::string>();
+        FixSlashes(metrics_settings.path);
+
+        if (metrics.contains("interval_seconds"))
+        {
+            if (!metrics["interval_seconds"].is_number_unsigned() || metrics["interval_seconds"].get<uint32>() == 0)
+            {
+                ConsolePrintf(RED, "The \"interval_seconds\" key within \"metrics\" must have an unsigned integer value above 0\n");
+                return false;
+            }
+
+            metrics_settings.interval_seconds = metrics["interval_seconds"].get<uint32>();
+        }
+
+        metrics_settings.enabled = true;
+        return true;
+    }
+
+    bool ParseUploadRetry(const json& retry)
+    {
+        if (!retry.is_object())
+        {
+            ConsolePrintf(RED, "The value of \"upload_retry\" must be an object\n");
+            return false;
+        }
+
+        if (retry.contains("max_attempts"))
+        {
+            if (!retry["max_attempts"].is_number_unsigned() || retry["max_attempts"].get<uint32>() == 0)
+            {
+                ConsolePrintf(RED, "The \"max_attempts\" key within \"upload_retry\" must have an unsigned integer value above 0\n");
+                return false;
+            }
+
+            upload_retry_settings.max_attempts = retry["max_attempts"].get<uint32>();
+        }
+
+        for (auto [key, value] : { std::make_pair("base_delay_seconds", &upload_retry_settings.base_delay_seconds), std::make_pair("max_delay_seconds", &upload_retry_settings.max_delay_seconds) })
+        {
+            if (!retry.contains(key))
+                continue;
+
+            if (!retry[key].is_number() || retry[key].get<double>() < 0.0)
+            {
+                ConsolePrintf(RED, "The \"%s\" key within \"upload_retry\" must have a non-negative number value\n", key);
+                return false;
+            }
+
+            *value = retry[key].get<double>();
+        }
+
+        if (upload_retry_settings.max_delay_seconds < upload_retry_settings.base_delay_seconds)
+        {
+            ConsolePrintf(RED, "The \"max_delay_seconds\" key within \"upload_retry\" must not be below \"base_delay_seconds\"\n");
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ParseSourceCache(const json& cache)
+    {
+        if (!cache.is_object() || !cache.contains("enabled") || !cache["enabled"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"source_cache\" must be an object with a boolean \"enabled\" key\n");
+            return false;
+        }
+
+        if (!cache["enabled"].get<bool>())
+            return true;
+
+        if (!cache.contains("path") || !cache["path"].is_string() || cache["path"].get<std::string>().empty())
+        {
+            ConsolePrintf(RED, "The \"path\" key within \"source_cache\" must have a non-empty string value\n");
+            return false;
+        }
+
+        source_cache_settings.path = cache["path"].get<std::string>();
+        FixSlashes(source_cache_settings.path);
+        if (source_cache_settings.path.back() != '/')
+            source_cache_settings.path += '/';
+
+        if (cache.contains("max_size_mb"))
+        {
+            if (!cache["max_size_mb"].is_number_unsigned())
+            {
+                ConsolePrintf(RED, "The \"max_size_mb\" key within \"source_cache\" must have an unsigned integer value\n");
+                return false;
+            }
+
+            source_cache_settings.max_size_mb = cache["max_size_mb"].get<uint64>();
+        }
+
+        source_cache_settings.enabled = true;
+        return true;
+    }
+
+    bool ParseSharedVPK(const json& vpk)
+    {
+        if (!vpk.is_object() || !vpk.contains("enabled") || !vpk["enabled"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"shared_vpk\" must be an object with a boolean \"enabled\" key\n");
+            return false;
+        }
+
+        shared_vpk_settings.enabled = vpk["enabled"].get<bool>();
+        if (vpk.contains("name"))
+        {
+            std::string name = vpk["name"].is_string() ? vpk["name"].get<std::string>() : "";
+            if (name.empty() || name.find_first_of("/\\:") != std::string::npos)
+            {
+                ConsolePrintf(RED, "The \"name\" key within \"shared_vpk\" must have a non-empty file name as its value\n");
+                return false;
+            }
+
+            shared_vpk_settings.name = name;
+        }
+
+        if (vpk.contains("chunk_size_mb"))
+        {
+            if (!vpk["chunk_size_mb"].is_number_unsigned() || vpk["chunk_size_mb"].get<uint32>() == 0 || vpk["chunk_size_mb"].get<uint32>() > 4095)
+            {
+                ConsolePrintf(RED, "The \"chunk_size_mb\" key within \"shared_vpk\" must have an unsigned integer value from 1 to 4095\n");
+                return false;
+            }
+
+            shared_vpk_settings.chunk_size_mb = vpk["chunk_size_mb"].get<uint32>();
+        }
+
+        return true;
+    }
+
+    bool ParseEntryOrder(const json& order)
+    {
+        if (!order.is_object() || !order.contains("enabled") || !order["enabled"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"entry_order\" must be an object with a boolean \"enabled\" key\n");
+            return false;
+        }
+
+        entry_order_settings.enabled = order["enabled"].get<bool>();
+        if (order.contains("profile"))
+        {
+            if (!order["profile"].is_string() || !std::filesystem::is_regular_file(order["profile"].get<std::string>()))
+            {
+                ConsolePrintf(RED, "The \"profile\" key within \"entry_order\" must have the path of a load order profile as its value\n");
+                return false;
+            }
+
+            entry_order_settings.profile_path = order["profile"].get<std::string>();
+            FixSlashes(entry_order_settings.profile_path);
+        }
+
+        return !entry_order_settings.enabled || entry_order.LoadProfile();
+    }
+
+    bool ParseStockContent(const json& stock)
+    {
+        if (!stock.is_object() || !stock.contains("enabled") || !stock["enabled"].is_boolean())
+        {
+            ConsolePrintf(RED, "The value of \"stock_content\" must be an object with a boolean \"enabled\" key\n");
+            return false;
+        }
+
+        if (!stock["enabled"].get<bool>())
+            return true;
+
+        if (!stock.contains("game_path") || !stock["game_path"].is_string() || !std::filesystem::is_directory(stock["game_path"].get<std::string>()))
+        {
+            ConsolePrintf(RED, "The \"game_path\" key within \"stock_content\" must have the path of the game's folder as its value\n");
+            return false;
+        }
+
+        stock_content_settings.game_path = stock["game_path"].get<std::string>();
+        FixSlashes(stock_content_settings.game_path);
+        stock_content_settings.cache_path = base_output_path + "stock_index.bin";
+        if (stock.contains("cache_path"))
+        {
+            if (!stock["cache_path"].is_string() || stock["cache_path"].get<std::string>().empty())
+            {
+                ConsolePrintf(RED, "The \"cache_path\" key within \"stock_content\" must have a non-empty string value\n");
+                return false;
+            }
+
+            stock_content_settings.cache_path = stock["cache_path"].get<std::string>();
+            FixSlashes(stock_content_settings.cache_path);
+        }
+
+        stock_content_settings.enabled = true;
+        return true;
+    }
+
+    // Drops every asset that's the same file the game already ships at the same internal path
+    bool FilterStockAssets(BSPInfoList& bsplist)
+    {
+        if (!stock_index.Load())
+            return false;
+
+        std::vector<char> buffer(PACK_BUFFER_SIZE);
+        uint64 total_count = 0, total_bytes = 0;
+        auto filter = [&](std::vector<std::string>& assets, const std::string& name)
+        {
+            uint64 count = 0, bytes = 0;
+            size_t kept = 0;
+            for (size_t i = 0; i + 1 < assets.size(); i += 2)
+            {
+                if (stock_index.Contains(assets[i], assets[i + 1], buffer))
+                {
+                    std::error_code ec;
+                    bytes += std::filesystem::file_size(assets[i + 1], ec);
+                    ++count;
+                    if (verbose_logging)
+                        ConsolePrintf(WHITE, "%s : Skipping stock asset %s\n", name.c_str(), assets[i].c_str());
+
+                    continue;
+                }
+
+                if (kept != i)
+                {
+                    assets[kept] = std::move(assets[i]);
+                    assets[kept + 1] = std::move(assets[i + 1]);
+                }
+
+                kept += 2;
+            }
+
+            assets.resize(kept);
+            if (count)
+                ConsolePrintf(AQUA, "%s : Skipped %llu stock assets (%.2f MB)\n", name.c_str(), count, bytes / 1048576.0);
+
+            total_count += count;
+            total_bytes += bytes;
+        };
+
+        for (BSPFileInfo& info : bsplist)
+            if (!info.ignore_assets)
+                filter(info.assets, info.name);
+
+        filter(shared_assets, "Shared Assets");
+        ConsolePrintf(AQUA, "Stock Content: %llu files indexed, %llu assets matched, %.2f MB avoided\n\n", stock_index.Count(), total_count, total_bytes / 1048576.0);
+        return true;
+    }
+
+    bool ParsePacking(const json& packing)
+    {
+        if (!packing.is_object())
+        {
+            ConsolePrintf(RED, "The value of \"packing\" must be an object\n");
+            return false;
+        }
+
+        if (packing.contains("parallel_maps"))
+        {
+            if (!packing["parallel_maps"].is_number_unsigned() || packing["parallel_maps"].get<uint32>() == 0)
+            {
+                ConsolePrintf(RED, "The \"parallel_maps\" key within \"packing\" must have an unsigned integer value above 0\n");
+                return false;
+            }
+
+            packing_settings.parallel_maps = packing["parallel_maps"].get<uint32>();
+        }
+
+        if (packing.contains("memory_limit_mb"))
+        {
+            if (!packing["memory_limit_mb"].is_number_unsigned())
+            {
+                ConsolePrintf(RED, "The \"memory_limit_mb\" key within \"packing\" must have an unsigned integer value\n");
+                return false;
+            }
+
+            packing_settings.memory_limit_mb = packing["memory_limit_mb"].get<uint32>();
+        }
+
+        if (packing.contains("compression_threads"))
+        {
+            if (!packing["compression_threads"].is_number_unsigned())
+            {
+                ConsolePrintf(RED, "The \"compression_threads\" key within \"packing\" must have an unsigned integer value\n");
+                return false;
+            }
+
+            packing_settings.compression_threads = packing["compression_threads"].get<uint32>();
         }
 
-        bspzip_path = settings["bspzip_path"].get<std::string>();
-        if (bspzip_path.empty())
+        if (packing.contains("incremental"))
         {
-            ConsolePrintf(RED, "The value of \"bspzip_path\" must not be an empty string\n");
-            return false;
+            if (!packing["incremental"].is_boolean())
+            {
+                ConsolePrintf(RED, "The \"incremental\" key within \"packing\" must have a boolean value\n");
+                return false;
+            }
+
+            packing_settings.incremental = packing["incremental"].get<bool>();
         }
 
-        FixSlashes(bspzip_path);
-        if (!bspzip_path.ends_with("bspzip.exe"))
+        if (packing.contains("deterministic"))
         {
-            ConsolePrintf(RED, "The value of \"bspzip_path\" must contain the absolute path ending in /bspzip.exe\n", bspzip_path.c_str());
-            return false;
+            if (!packing["deterministic"].is_boolean())
+            {
+                ConsolePrintf(RED, "The \"deterministic\" key within \"packing\" must have a boolean value\n");
+                return false;
+            }
+
+            packing_settings.deterministic = packing["deterministic"].get<bool>();
         }
 
-        if (!std::filesystem::is_regular_file(bspzip_path))
+        if (packing.contains("preallocate"))
         {
-            ConsolePrintf(RED, "The value of \"bspzip_path\" doesn't have a valid path to bspzip.exe\n", bspzip_path.c_str());
-            return false;
+            if (!packing["preallocate"].is_boolean())
+            {
+                ConsolePrintf(RED, "The \"preallocate\" key within \"packing\" must have a boolean value\n");
+                return false;
+            }
+
+            packing_settings.output.preallocate = packing["preallocate"].get<bool>();
         }
 
-        // Output path
-        if (!settings.contains("bsp_output_path"))
+        if (packing.contains("flush"))
         {
-            ConsolePrintf(RED, "Failed to find settings key \"bsp_output_path\"\n");
-            return false;
+            std::string flush = packing["flush"].is_string() ? packing["flush"].get<std::string>() : "";
+            if (flush != "none" && flush != "output")
+            {
+                ConsolePrintf(RED, "The \"flush\" key within \"packing\" must be \"none\" or \"output\"\n");
+                return false;
+            }
+
+            packing_settings.output.flush = flush == "output" ? OUTPUT_FLUSH_FILE : OUTPUT_FLUSH_NONE;
         }
 
-        if (!settings["bsp_output_path"].is_string())
+        // Each map needs its pooled buffers and a minimal encoder, plus its output buffers
+        uint32 map_minimum_mb = 8 + (uint32)(2 * OUTPUT_BUFFER_SIZE / 1048576);
+        if (packing_settings.memory_limit_mb < packing_settings.parallel_maps * map_minimum_mb)
         {
-            ConsolePrintf(RED, "The the value of \"bsp_output_path\" must be a string\n");
+            ConsolePrintf(RED, "The \"memory_limit_mb\" key within \"packing\" must allow at least %u MB per parallel map\n", map_minimum_mb);
             return false;
         }
 
-        base_output_path = settings["bsp_output_path"].get<std::string>();
-        FixSlashes(base_output_path);
-        if (!std::filesystem::is_directory(base_output_path))
+        return true;
+    }
+
+    bool ParseCompressionPolicy(const json& policy)
+    {
+        if (!policy.is_object())
         {
-            ConsolePrintf(RED, "The value of \"base_output_path\" is not a valid directory\n", bspzip_path.c_str());
+            ConsolePrintf(RED, "The value of \"compression_policy\" must be an object\n");
             return false;
         }
 
-        if (base_output_path.rfind('/') != base_output_path.size() - 1)
+        if (policy.contains("min_ratio"))
         {
-            base_output_path += '/';
+            if (!policy["min_ratio"].is_number() || policy["min_ratio"].get<double>() <= 0.0 || policy["min_ratio"].get<double>() > 1.0)
+            {
+                ConsolePrintf(RED, "The \"min_ratio\" key within \"compression_policy\" must be a number in the range (0, 1]\n");
+                return false;
+            }
+
+            compression_settings.min_ratio = policy["min_ratio"].get<double>();
         }
 
-        // Force map compression
-        if (!settings.contains("force_map_compression"))
+        if (policy.contains("sample_size"))
         {
-            ConsolePrintf(RED, "Failed to find settings key \"force_map_compression\"\n");
-            return false;
+            if (!policy["sample_size"].is_number_unsigned() || !policy["sample_size"].get<uint32>())
+            {
+                ConsolePrintf(RED, "The \"sample_size\" key within \"compression_policy\" must be a positive integer\n");
+                return false;
+            }
+
+            compression_settings.sample_size = policy["sample_size"].get<uint32>();
         }
 
-        if (!settings["force_map_compression"].is_boolean())
+        if (policy.contains("entropy_threshold"))
         {
-            ConsolePrintf(RED, "The value of \"force_map_compression\" must be a boolean\n");
-            return false;
-        }
+            if (!policy["entropy_threshold"].is_number())
+            {
+                ConsolePrintf(RED, "The \"entropy_threshold\" key within \"compression_policy\" must be a number of bits per byte\n");
+                return false;
+            }
 
-        force_map_compression = settings["force_map_compression"].get<bool>();
+            compression_settings.entropy_threshold = policy["entropy_threshold"].get<double>();
+        }
 
-        // Upload maps to workshop
-        if (!settings.contains("upload_maps_to_workshop"))
+        if (policy.contains("rules"))
         {
-            ConsolePrintf(RED, "Failed to find settings key \"upload_maps_to_workshop\"\n");
-            return false;
+            if (!policy["rules"].is_object())
+            {
+                ConsolePrintf(RED, "The \"rules\" key within \"compression_policy\" must be an object of extensions\n");
+                return false;
+            }
+
+            for (auto& [key, value] : policy["rules"].items())
+            {
+                std::string ext = ToLower(key);
+                if (ext.empty() || !value.is_string())
+                {
+                    ConsolePrintf(RED, "Each compression policy rule must map an extension to a string\n");
+                    return false;
+                }
+
+                if (ext[0] != '.')
+                    ext = "." + ext;
+
+                std::string action = ToLower(value.get<std::string>());
+                if (action == "store")
+                    compression_settings.rules[ext] = COMPRESSION_STORE;
+                else if (action == "compress")
+                    compression_settings.rules[ext] = COMPRESSION_COMPRESS;
+                else if (action == "sample")
+                    compression_settings.rules[ext] = COMPRESSION_SAMPLE;
+                else
+                {
+                    ConsolePrintf(RED, "The compression policy rule for \"%s\" must be \"store\", \"compress\" or \"sample\"\n", ext.c_str());
+                    return false;
+                }
+            }
         }
 
-        if (!settings["upload_maps_to_workshop"].is_boolean())
+        return true;
+    }
+
+    bool ParseVTFOptimization(const json& vtf)
+    {
+        if (!vtf.is_object())
         {
-            ConsolePrintf(RED, "The value of \"upload_maps_to_workshop\" must have a boolean value\n");
+            ConsolePrintf(RED, "The value of \"vtf_optimization\" must be an object\n");
             return false;
         }
 
-        upload_maps_to_workshop = settings["upload_maps_to_workshop"].get<bool>();
-
-        // Verbose logging
-        if (!settings.contains("verbose_logging"))
+        if (!vtf.contains("enabled") || !vtf["enabled"].is_boolean())
         {
-            ConsolePrintf(RED, "Failed to find settings key \"verbose_logging\"\n");
+            ConsolePrintf(RED, "The \"enabled\" key within \"vtf_optimization\" must have a boolean value\n");
             return false;
         }
 
-        if (!settings["verbose_logging"].is_boolean())
+        vtf_settings.enabled = vtf["enabled"].get<bool>();
+        if (!vtf_settings.enabled)
+            return true;
+
+        if (!vtf.contains("cache_path") || !vtf["cache_path"].is_string() || vtf["cache_path"].get<std::string>().empty())
         {
-            ConsolePrintf(RED, "The value of \"verbose_logging\" must be a boolean\n");
+            ConsolePrintf(RED, "The \"cache_path\" key within \"vtf_optimization\" must have a non-empty string value\n");
             return false;
         }
 
-        verbose_logging = settings["verbose_logging"].get<bool>();
+        vtf_settings.cache_path = vtf["cache_path"].get<std::string>();
+        FixSlashes(vtf_settings.cache_path);
+        if (vtf_settings.cache_path.back() != '/')
+            vtf_settings.cache_path += '/';
 
-        // Extension Whitelist
-        if (!settings.contains("extension_whitelist"))
+        if (vtf.contains("threads"))
         {
-            ConsolePrintf(RED, "Failed to find settings key \"extension_whitelist\"");
-            return false;
+            if (!vtf["threads"].is_number_unsigned())
+            {
+                ConsolePrintf(RED, "The \"threads\" key within \"vtf_optimization\" must have an unsigned integer value\n");
+                return false;
+            }
+
+            vtf_settings.threads = vtf["threads"].get<uint32>();
         }
 
-        if (!settings["extension_whitelist"].is_array())
+        if (!vtf.contains("rules") || !vtf["rules"].is_array())
         {
-            ConsolePrintf(RED, "The key \"extension_whitelist\" must be an array of strings\n");
+            ConsolePrintf(RED, "The \"rules\" key within \"vtf_optimization\" must be an array of objects\n");
             return false;
         }
 
-        for (auto& [key, value] : settings["extension_whitelist"].items())
+        for (const json& rule_obj : vtf["rules"])
         {
-            if (!value.is_string())
+            if (!rule_obj.is_object() || !rule_obj.contains("folder") || !rule_obj["folder"].is_string())
             {
-                ConsolePrintf(RED, "The array values of \"extension_whitelist\" must only be strings\n");
+                ConsolePrintf(RED, "Each vtf optimization rule must be an object with a string \"folder\" key\n");
                 return false;
             }
 
-            std::string ext = value.get<std::string>();
-            if (ext.empty())
+            VTFRule rule;
+            rule.folder = ToLower(rule_obj["folder"].get<std::string>());
+            FixSlashes(rule.folder);
+            if (!rule.folder.empty() && rule.folder.back() != '/')
+                rule.folder += '/';
+
+            if (rule_obj.contains("format"))
             {
-                ConsolePrintf(RED, "Found an empty string while searching for whitelisted extensions\n");
-                return false;
+                std::string format = rule_obj["format"].is_string() ? ToLower(rule_obj["format"].get<std::string>()) : "";
+                if (format == "auto")
+                    rule.format = VTF_TARGET_AUTO;
+                else if (format == "dxt1")
+                    rule.format = VTF_TARGET_DXT1;
+                else if (format == "dxt5")
+                    rule.format = VTF_TARGET_DXT5;
+                else if (format == "keep")
+                    rule.format = VTF_TARGET_KEEP;
+                else
+                {
+                    ConsolePrintf(RED, "The vtf optimization rule for \"%s\" has an invalid \"format\". Valid values are \"auto\", \"dxt1\", \"dxt5\" and \"keep\"\n", rule.folder.c_str());
+                    return false;
+                }
             }
 
-            if (ext[0] != '.')
-                ext = "." + ext;
-            
-            valid_exts[ext] = nullptr;
+            if (rule_obj.contains("max_resolution"))
+            {
+                if (!rule_obj["max_resolution"].is_number_unsigned())
+                {
+                    ConsolePrintf(RED, "The vtf optimization rule for \"%s\" must have an unsigned integer \"max_resolution\"\n", rule.folder.c_str());
+                    return false;
+                }
+
+                rule.max_resolution = rule_obj["max_resolution"].get<uint32>();
+            }
+
+            if (rule_obj.contains("skip_normal_maps"))
+            {
+                if (!rule_obj["skip_normal_maps"].is_boolean())
+                {
+                    ConsolePrintf(RED, "The vtf optimization rule for \"%s\" must have a boolean \"skip_normal_maps\"\n", rule.folder.c_str());
+                    return false;
+                }
+
+                rule.skip_normal_maps = rule_obj["skip_normal_maps"].get<bool>();
+            }
+
+            vtf_settings.rules.push_back(rule);
         }
 
         return true;
@@ -583,6 +8021,39 @@ private:
                 info.ignore_assets = map_entry["ignore_assets"].get<bool>();
             }
 
+            // Lump stripping
+            if (map_entry.contains("strip_lumps") && !ParseStripLumps(map_entry["strip_lumps"], map_name, info.strip))
+                return false;
+
+            if (map_entry.contains("strip_game_lumps"))
+            {
+                if (!map_entry["strip_game_lumps"].is_array())
+                {
+                    ConsolePrintf(RED, "%s : The \"strip_game_lumps\" key must have an array value\n", map_name.c_str());
+                    return false;
+                }
+
+                for (const json& id : map_entry["strip_game_lumps"])
+                {
+                    // Ids are named as in the game's code ("sprp", "dplh"), which is the reverse of their bytes in the file
+                    std::string name = id.is_string() ? id.get<std::string>() : "";
+                    if (name.length() != 4)
+                    {
+                        ConsolePrintf(RED, "%s : The \"strip_game_lumps\" array must only contain ids of four characters\n", map_name.c_str());
+                        return false;
+                    }
+
+                    info.strip.game_lumps.push_back((uint32)(uint8)name[3] | ((uint32)(uint8)name[2] << 8) | ((uint32)(uint8)name[1] << 16) | ((uint32)(uint8)name[0] << 24));
+                }
+            }
+
+            // Ignored maps are passed through as they are, so nothing would be stripped
+            if (info.ignore_assets && info.strip.Enabled())
+            {
+                ConsolePrintf(RED, "%s : The \"strip_lumps\" and \"strip_game_lumps\" keys can't be used with \"ignore_assets\"\n", map_name.c_str());
+                return false;
+            }
+
             // Workshop
             bool contains_workshop = false;
             bool changelog_set = false;
@@ -701,6 +8172,11 @@ private:
 
             if (!info.ignore_assets)
             {
+                // The map's own rules are added to the ones in settings
+                AssetFilter filter = asset_filter;
+                if (map_entry.contains("asset_rules") && !ParseAssetRules(map_entry["asset_rules"], filter, map_name))
+                    return false;
+
                 std::vector<std::string> asset_list;
                 if (map_entry.contains("assets"))
                 {
@@ -748,7 +8224,7 @@ private:
                             asset_list.push_back(asset);
                         }
                         else if (valid_folder)
-                            ParseDirectory(asset, first_slash + 1, asset_list);
+                            ParseDirectory(asset, first_slash + 1, filter, asset_list);
                         else
                         {
                             ConsolePrintf(RED, "%s : Invalid asset %s\n", map_name.c_str(), asset.c_str());
@@ -844,7 +8320,7 @@ private:
                 shared_assets.push_back(asset);
             }
             else if (valid_folder)
-                ParseDirectory(asset, first_slash + 1, shared_assets);
+                ParseDirectory(asset, first_slash + 1, asset_filter, shared_assets);
             else
             {
                 ConsolePrintf(RED, "Invalid shared asset %s\n", asset.c_str());
@@ -875,43 +8351,191 @@ private:
         return true;
     }
 
-    void ParseDirectory(const std::string& dir, const size_t double_slash_pos, std::vector<std::string>& asset_list)
+    bool ParseAssetRules(const json& asset_rules, AssetFilter& filter, const std::string& owner)
+    {
+        if (!asset_rules.is_object())
+        {
+            ConsolePrintf(RED, "%s : The value of \"asset_rules\" must be an object\n", owner.c_str());
+            return false;
+        }
+
+        for (auto [key, kind] : { std::make_pair("include", AssetRule::Include), std::make_pair("exclude", AssetRule::Exclude) })
+        {
+            if (!asset_rules.contains(key))
+                continue;
+
+            if (!asset_rules[key].is_array())
+            {
+                ConsolePrintf(RED, "%s : The \"%s\" key within \"asset_rules\" must be an array of strings\n", owner.c_str(), key);
+                return false;
+            }
+
+            for (const json& value : asset_rules[key])
+            {
+                if (!value.is_string())
+                {
+                    ConsolePrintf(RED, "%s : The array values of \"%s\" within \"asset_rules\" must only be strings\n", owner.c_str(), key);
+                    return false;
+                }
+
+                std::string pattern = value.get<std::string>();
+                FixSlashes(pattern);
+                if (!filter.AddRule(pattern, kind))
+                {
+                    ConsolePrintf(RED, "%s : Found an empty rule within the \"%s\" key of \"asset_rules\"\n", owner.c_str(), key);
+                    return false;
+                }
+            }
+        }
+
+        return true;
+    }
+
+    // Lumps are given by index or by name, with or without the LUMP_ prefix. The game lump and the pakfile can't be stripped whole
+    bool ParseStripLumps(const json& lumps, const std::string& map_name, LumpStrip& strip)
+    {
+        if (!lumps.is_array())
+        {
+            ConsolePrintf(RED, "%s : The \"strip_lumps\" key must have an array value\n", map_name.c_str());
+            return false;
+        }
+
+        for (const json& lump : lumps)
+        {
+            int index = -1;
+            if (lump.is_number_unsigned() && lump.get<uint64>() < BSP_HEADER_LUMPS)
+                index = lump.get<int>();
+            else if (lump.is_string())
+            {
+                std::string name = lump.get<std::string>();
+                std::transform(name.begin(), name.end(), name.begin(), [](unsigned char c) { return (char)std::toupper(c); });
+                if (name.starts_with("LUMP_"))
+                    name.erase(0, 5);
+
+                for (int i = 0; i < BSP_HEADER_LUMPS; i++)
+                    if (name == g_LumpNames[i])
+                        index = i;
+            }
+
+            if (index < 0)
+            {
+                ConsolePrintf(RED, "%s : Unknown lump %s in \"strip_lumps\"\n", map_name.c_str(), lump.dump().c_str());
+                return false;
+            }
+
+            if (index == BSP_LUMP_GAME_LUMP || index == BSP_LUMP_PAKFILE)
+            {
+                ConsolePrintf(RED, "%s : LUMP_%s can't be stripped. Use \"strip_game_lumps\" to remove game lumps\n", map_name.c_str(), g_LumpNames[index]);
+                return false;
+            }
+
+            strip.lumps |= 1ull << index;
+        }
+
+        return true;
+    }
+
+    void ParseDirectory(const std::string& dir, const size_t double_slash_pos, const AssetFilter& filter, std::vector<std::string>& asset_list)
+    {
+        // The folder's own internal path is matched once, then only the names of what's below it
+        AssetFilter::State state;
+        filter.Start(state);
+
+        size_t length = dir.length();
+        while (length > double_slash_pos && dir[length - 1] == '/')
+            length--;
+
+        bool included = false;
+        if (length > double_slash_pos)
+        {
+            filter.Feed(state, dir.data() + double_slash_pos, length - double_slash_pos);
+            if (filter.ExcludesFolder(state))
+                return;
+
+            included = filter.IncludesFolder(state);
+            filter.Feed(state, '/');
+        }
+
+        ParseDirectory(dir, double_slash_pos, filter, state, included, asset_list);
+    }
+
+    void ParseDirectory(const std::string& dir, const size_t double_slash_pos, const AssetFilter& filter, const AssetFilter::State& state, bool included, std::vector<std::string>& asset_list)
     {
+        AssetFilter::State entry_state;
         for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(dir))
         {
+            std::string name = entry.path().filename().string();
+            entry_state = state;
+            filter.Feed(entry_state, name.data(), name.length());
             if (entry.is_regular_file())
             {
-                std::string file = entry.path().string();
-                FixSlashes(file);
-                if (ContainsValidExtension(file))
+                if (filter.IncludesFile(entry_state, included))
                 {
+                    std::string file = entry.path().string();
+                    FixSlashes(file);
                     std::string internal_path = file.substr(double_slash_pos, file.length() - 1);
                     asset_list.push_back(internal_path);
                     asset_list.push_back(file);
                 }
             }
             else if (entry.is_directory())
-                ParseDirectory(entry.path().string(), double_slash_pos, asset_list);
-        }
-    }
-
-    bool ContainsValidExtension(const std::string& source)
-    {
-        size_t element = source.find_last_of('.');
-        if (element == -1)
-            return false;
+            {
+                // Excluded folders are never opened
+                if (filter.ExcludesFolder(entry_state))
+                    continue;
 
-        std::string ext = source.substr(element);
-        return valid_exts.contains(ext);
+                bool folder_included = included || filter.IncludesFolder(entry_state);
+                filter.Feed(entry_state, '/');
+                ParseDirectory(entry.path().string(), double_slash_pos, filter, entry_state, folder_included, asset_list);
+            }
+        }
     }
 
     bool force_map_compression = false;
     bool verbose_logging = false;
-    std::unordered_map<std::string, void*> valid_exts;
+    uint32 size_budget_mb = 0;
+    VTFSettings vtf_settings;
+    CompressionPolicySettings compression_settings;
+    ReportSettings report_settings;
+    PackingSettings packing_settings;
+    SourceCacheSettings source_cache_settings;
+    SharedVPKSettings shared_vpk_settings;
+    StockContentSettings stock_content_settings;
+    EntryOrderSettings entry_order_settings;
+    MetricsSettings metrics_settings;
+    std::string settings_hash;
+    SourceCache source_cache{ source_cache_settings };
+    StockIndex stock_index{ stock_content_settings };
+    EntryOrder entry_order{ entry_order_settings };
+    AssetFilter asset_filter;
+    std::unordered_map<std::string, ShardOutput> shard_outputs;
     std::vector<std::string> shared_assets;
+    std::vector<std::string> vpk_assets;
+};
+
+struct UploadStatus
+{
+    bool finished = false;
+    EResult result = k_EResultOK;
+    bool needs_legal_agreement = false;
+    uint64 bytes_uploaded = 0;
+    uint64 bytes_total = 0;
+};
+
+// Where maps are uploaded to. Steam in normal runs, or a local fake that replays scripted results
+class WorkshopBackend
+{
+
+public:
+
+    virtual ~WorkshopBackend() = default;
+
+    // Returns k_EResultOK once the upload is underway
+    virtual EResult StartUpload(const BSPFileInfo& info) = 0;
+    virtual void PollUpload(UploadStatus& status) = 0;
 };
 
-class Steam
+class Steam : public WorkshopBackend
 {
 
 public:
@@ -943,7 +8567,7 @@ public:
         return true;
     }
 
-    bool FindUGCMaps(BSPInfoList& workshop_list)
+    bool FindUGCMaps(std::vector<BSPFileInfo*>& workshop_list)
     {
         ConsolePrintf(WHITE, "\n> Finding owned workshop maps...\n\n");
         EnumerateAll();
@@ -959,24 +8583,26 @@ public:
 
         ConsolePrintf(YELLOW, "Verifying that maps marked to be uploaded exist on the workshop...\n\n");
 
-        // Store all UGC ids in a map for fast checking between config and ugc ids
-        std::unordered_map<PublishedFileId_t, SteamUGCDetails_t> UGCFileIds;
-        for (SteamUGCDetails_t& details : UGCFiles)
-            if (details.m_eFileType == k_EWorkshopFileTypeCommunity)
-                UGCFileIds[details.m_nPublishedFileId] = details;
+        // Keep only community items, sorted by id so config ids can be looked up without a copy of the results
+        std::erase_if(UGCFiles, [](const WorkshopItem& item) { return item.file_type != k_EWorkshopFileTypeCommunity; });
+        std::sort(UGCFiles.begin(), UGCFiles.end(), [](const WorkshopItem& a, const WorkshopItem& b) { return a.id < b.id; });
 
-        // Make sure that all workshop ids match a ugc id
-        BSPInfoList confirmed_list;
-        for (BSPFileInfo& info : workshop_list)
+        // Make sure that all workshop ids match a ugc id. Maps that don't are left out of the upload
+        std::vector<BSPFileInfo*> confirmed_list;
+        for (BSPFileInfo* info : workshop_list)
         {
-            if (UGCFileIds.contains(info.workshop_id))
+            auto found = std::lower_bound(UGCFiles.begin(), UGCFiles.end(), info->workshop_id, [](const WorkshopItem& item, PublishedFileId_t id) { return item.id < id; });
+            if (found != UGCFiles.end() && found->id == info->workshop_id)
             {
-                info.details = UGCFileIds[info.workshop_id];
-                ConsolePrintf(AQUA, "Found %s (%llu)\n", info.name.c_str(), info.workshop_id);
+                info->workshop = *found;
+                ConsolePrintf(AQUA, "Found %s (%llu)\n", info->name.c_str(), info->workshop_id);
                 confirmed_list.push_back(info);
             }
             else
-                ConsolePrintf(RED, "Failed to find %s (%llu)\n", info.name.c_str(), info.workshop_id);
+            {
+                ConsolePrintf(RED, "Failed to find %s (%llu)\n", info->name.c_str(), info->workshop_id);
+                info->upload = false;
+            }
         }
 
         if (confirmed_list.size() != workshop_list.size())
@@ -1005,29 +8631,78 @@ public:
         return true;
     }
 
-    bool UploadUGCMaps(const BSPInfoList& workshop_list)
+    // Asked before packing starts, since maps are uploaded as soon as they're packed
+    bool ConfirmUpload()
     {
-        ConsolePrintf(WHITE, "> The next step will upload all maps found from the previous step to the workshop.\n");
-        ConsolePrintf(WHITE, "Before proceeding, ensure you have reviewed the packed bsps in the output path using GCFScape or VPKEdit.\n");
-        ConsolePrintf(WHITE, "Copy-paste any bsps from the output path to your TF2 maps folder and check in-game to ensure they work as expected.\n\n");
+        ConsolePrintf(WHITE, "> Maps found from the previous step will be uploaded to the workshop as soon as each one is packed.\n");
+        ConsolePrintf(WHITE, "There won't be a chance to review the packed bsps before they're uploaded, so only mark maps for upload\n");
+        ConsolePrintf(WHITE, "once a previous build of them has been checked in-game using GCFScape or VPKEdit and your TF2 maps folder.\n\n");
 
         ConsolePrintf(YELLOW, "NOTE:\n");
         ConsolePrintf(YELLOW, "TF2 won't launch if it's not currently open because Steam believes it's already running.\n");
         ConsolePrintf(YELLOW, "As a workaround, you can launch tf_win64.exe manually via adding it as a non-steam game,\n");
         ConsolePrintf(YELLOW, "or by creating a .bat file with the parameters tf_win64.exe -game tf -steam -insecure\n\n");
 
-        ConsolePrintf(WHITE, "Enter \"y\" to start the upload process, enter anything else to abort.\n");
-        std::string input;
-        std::cin >> input;
-        if (!(!input.compare("y")))
-            return false;
+        ConsolePrintf(WHITE, "Enter \"y\" to start packing and uploading, enter anything else to abort.\n");
+        std::string input;
+        std::cin >> input;
+        return !input.compare("y");
+    }
+
+    EResult StartUpload(const BSPFileInfo& info) override
+    {
+        CallbackFinished = false;
+        UploadHandle = k_UGCUpdateHandleInvalid;
+
+        PublishedFileId_t id = info.workshop.id;
+        if (!std::filesystem::is_regular_file(info.output_path))
+        {
+            ConsolePrintf(RED, "The file path %s is no longer valid. Was the output path deleted?\n", info.output_path.c_str());
+            return k_EResultFileNotFound;
+        }
+
+        UploadHandle = SteamUGCHandle->StartItemUpdate(AppID, id);
+        if (UploadHandle == k_UGCUpdateHandleInvalid)
+        {
+            ConsolePrintf(RED, "Failed to begin update for %llu\n", id);
+            return k_EResultFail;
+        }
+
+        if (!SteamUGCHandle->SetItemContent(UploadHandle, info.output_path.c_str()))
+        {
+            ConsolePrintf(RED, "Failed to set map data for %llu (%s)\n", id, info.output_path.c_str());
+            return k_EResultFail;
+        }
+
+        if (!SteamUGCHandle->SetItemVisibility(UploadHandle, k_ERemoteStoragePublishedFileVisibilityUnlisted))
+        {
+            ConsolePrintf(RED, "Failed to set map visibility for %llu (%s)\n", id, info.source_path.c_str());
+            return k_EResultFail;
+        }
+        
+        SteamAPICall = SteamUGCHandle->SubmitItemUpdate(UploadHandle, info.changelog.c_str());
+        if (SteamAPICall == k_uAPICallInvalid)
+        {
+            ConsolePrintf(RED, "Failed to send Steam Upload message\n");
+            return k_EResultFail;
+        }
+
+        UploadCallback.Set(SteamAPICall, this, &Steam::CallbackUpload);
+        return k_EResultOK;
+    }
 
-        ConsolePrintf(WHITE, "\n> Uploading modified maps to the workshop...\n");
-        UploadList = workshop_list;
-        UploadAll();
-        SleepUntilCondition(this, &Steam::IsUGCUploadFinished, 100);
-        
-        return !Error;
+    void PollUpload(UploadStatus& status) override
+    {
+        SteamAPI_RunCallbacks();
+        if (CallbackFinished)
+        {
+            status.finished = true;
+            status.result = UploadResult;
+            status.needs_legal_agreement = NeedsLegalAgreement;
+            return;
+        }
+
+        SteamUGCHandle->GetItemUpdateProgress(UploadHandle, &status.bytes_uploaded, &status.bytes_total);
     }
 
 private:
@@ -1080,12 +8755,17 @@ private:
             return;
         }
 
+        // One details struct is reused for the whole page, and only what's needed of it is kept
         uint32 item_count = result->m_unNumResultsReturned;
+        std::unique_ptr<SteamUGCDetails_t> details = std::make_unique<SteamUGCDetails_t>();
+        UGCFiles.reserve(result->m_unTotalMatchingResults);
         for (uint32_t i = 0; i < item_count; i++)
         {
-            SteamUGCDetails_t details = {};
-            SteamUGCHandle->GetQueryUGCResult(result->m_handle, i, &details);
-            UGCFiles.push_back(details);
+            *details = {};
+            if (!SteamUGCHandle->GetQueryUGCResult(result->m_handle, i, details.get()))
+                continue;
+
+            UGCFiles.push_back({ details->m_nPublishedFileId, details->m_eFileType, details->m_ulSteamIDOwner, details->m_rtimeUpdated, details->m_nFileSize });
         }
 
         uint32 matching_results = result->m_unTotalMatchingResults;
@@ -1097,129 +8777,349 @@ private:
             Enumerate(++UGCItemsPage);
     }
 
-    bool IsUGCUploadFinished()
+    void CallbackUpload(SubmitItemUpdateResult_t* result, bool error)
     {
-        if (CallbackFinished)
-            return true;
+        // A failed call never reached Steam, which is worth retrying like any other I/O failure
+        UploadResult = error ? k_EResultIOFailure : result->m_eResult;
+        NeedsLegalAgreement = !error && result->m_bUserNeedsToAcceptWorkshopLegalAgreement;
+        CallbackFinished = true;
+    }
 
-        uint64 bytes_uploaded = 0;
-        uint64 bytes_total = 0;
-        if (SteamUGCHandle->GetItemUpdateProgress(UploadHandle, &bytes_uploaded, &bytes_total))
-            ConsolePrintProgress(AQUA, bytes_uploaded, bytes_total);
+    const AppId_t AppID = 440;
+    CSteamID UserSteamID;
+    AccountID_t UserAccountID = 0;
+    ISteamUser* SteamUserHandle = nullptr;
+    ISteamFriends* SteamFriendsHandle = nullptr;
+    ISteamUGC* SteamUGCHandle = nullptr;
 
-        return false;
-    }
+    SteamAPICall_t SteamAPICall = 0;
+    CCallResult<Steam, SteamUGCQueryCompleted_t> QueryCallback;
+    CCallResult<Steam, SubmitItemUpdateResult_t> UploadCallback;
+    std::vector<WorkshopItem> UGCFiles;
+    
+    UGCQueryHandle_t QueryHandle = 0;
+    uint32_t UGCItemsPage = 0;
 
-    void UploadAll()
-    {
-        CallbackFinished = false;
-        UploadHandle = k_UGCUpdateHandleInvalid;
-        Uploaded = 0;
-        Upload(UploadList[0].details.m_nPublishedFileId);
-    }
+    UGCUpdateHandle_t UploadHandle = 0;
+    EResult UploadResult = k_EResultOK;
+    bool NeedsLegalAgreement = false;
 
-    void Upload(const PublishedFileId_t& id)
-    {
-        ConsolePrintf(YELLOW, "Uploading %s (%llu)...\n", UploadList[Uploaded].name.c_str(), id);
+    bool CallbackFinished = false;
+    bool Error = false;
+};
 
-        if (!std::filesystem::is_regular_file(UploadList[Uploaded].output_path))
-        {
-            ConsolePrintf(RED, "The file path %s is no longer valid. Was the output path deleted?\n", UploadList[Uploaded].output_path.c_str());
-            CallbackFinished = Error = true;
-            return;
-        }
+// Stands in for the workshop so retries can be exercised without Steam. The script maps workshop ids to the results
+// their attempts return in turn, e.g. { "123": [16, 16, 1] } times out twice before succeeding. Ids without a script,
+// or that ran out of results, succeed. Results that were never returned are reported once uploading is done, so a run
+// against a script checks that the uploader made exactly the attempts it scripted
+class FakeWorkshop : public WorkshopBackend
+{
 
-        UploadHandle = SteamUGCHandle->StartItemUpdate(AppID, id);
-        if (UploadHandle == k_UGCUpdateHandleInvalid)
+public:
+
+    bool Load(const std::string& path)
+    {
+        std::ifstream stream(path);
+        json data = json::parse(stream, nullptr, false);
+        if (stream.fail() || data.is_discarded() || !data.is_object())
         {
-            ConsolePrintf(RED, "Failed to begin update for %llu\n", id);
-            CallbackFinished = Error = true;
-            return;
+            ConsolePrintf(RED, "Failed to read the fake workshop script %s\n", path.c_str());
+            return false;
         }
 
-        if (!SteamUGCHandle->SetItemContent(UploadHandle, UploadList[Uploaded].output_path.c_str()))
+        for (auto& [key, value] : data.items())
         {
-            ConsolePrintf(RED, "Failed to set map data for %llu (%s)\n", id, UploadList[Uploaded].output_path.c_str());
-            CallbackFinished = Error = true;
-            return;
+            if (key == "upload_seconds")
+            {
+                if (!value.is_number() || value.get<double>() < 0.0)
+                {
+                    ConsolePrintf(RED, "The \"upload_seconds\" key within the fake workshop script must have a non-negative number value\n");
+                    return false;
+                }
+
+                upload_seconds = value.get<double>();
+                continue;
+            }
+
+            char* end = nullptr;
+            uint64 id = std::strtoull(key.c_str(), &end, 10);
+            if (key.empty() || *end || !id)
+            {
+                ConsolePrintf(RED, "The fake workshop script key \"%s\" must be a workshop id\n", key.c_str());
+                return false;
+            }
+
+            if (!value.is_array())
+            {
+                ConsolePrintf(RED, "The fake workshop results for \"%s\" must be an array of result codes\n", key.c_str());
+                return false;
+            }
+
+            std::vector<EResult>& script = results[id];
+            for (const json& result : value)
+            {
+                if (!result.is_number_integer())
+                {
+                    ConsolePrintf(RED, "The fake workshop results for \"%s\" must only contain integer result codes\n", key.c_str());
+                    return false;
+                }
+
+                script.push_back((EResult)result.get<int>());
+            }
         }
 
-        if (!SteamUGCHandle->SetItemVisibility(UploadHandle, k_ERemoteStoragePublishedFileVisibilityUnlisted))
+        return true;
+    }
+
+    // Whether every scripted result was returned by an attempt
+    bool CheckFinished()
+    {
+        bool finished = true;
+        for (const auto& [id, script] : results)
         {
-            ConsolePrintf(RED, "Failed to set map visibility for %llu (%s)\n", id, UploadList[Uploaded].source_path.c_str());
-            CallbackFinished = Error = true;
-            return;
+            if (script.empty())
+                continue;
+
+            ConsolePrintf(RED, "The fake workshop expected %zu more attempt(s) for %llu\n", script.size(), id);
+            finished = false;
         }
-        
-        SteamAPICall = SteamUGCHandle->SubmitItemUpdate(UploadHandle, UploadList[Uploaded].changelog.c_str());
-        if (SteamAPICall == k_uAPICallInvalid)
+
+        return finished;
+    }
+
+    EResult StartUpload(const BSPFileInfo& info) override
+    {
+        std::error_code ec;
+        size = std::filesystem::file_size(info.output_path, ec);
+        if (ec)
+            return k_EResultFileNotFound;
+
+        std::vector<EResult>& script = results[info.workshop.id];
+        result = k_EResultOK;
+        if (!script.empty())
         {
-            ConsolePrintf(RED, "Failed to send Steam Upload message\n");
-            CallbackFinished = Error = true;
-            return;
+            result = script.front();
+            script.erase(script.begin());
         }
 
-        UploadCallback.Set(SteamAPICall, this, &Steam::CallbackUpload);
+        start = std::chrono::steady_clock::now();
+        return k_EResultOK;
     }
 
-    void CallbackUpload(SubmitItemUpdateResult_t* result, bool error)
+    void PollUpload(UploadStatus& status) override
+    {
+        double progress = std::min(1.0, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() / std::max(upload_seconds, 0.001));
+        status.bytes_total = size;
+        status.bytes_uploaded = (uint64)(size * progress);
+        status.finished = progress >= 1.0;
+        status.result = result;
+    }
+
+private:
+
+    std::unordered_map<uint64, std::vector<EResult>> results;
+    double upload_seconds = 1.0;
+    std::chrono::steady_clock::time_point start;
+    EResult result = k_EResultOK;
+    uint64 size = 0;
+};
+
+// Uploads maps as the packing threads push them. Transient failures are retried with exponential backoff and jitter
+// while other maps carry on, and maps that still fail are collected for the summary instead of stopping the batch
+class WorkshopUploader
+{
+
+public:
+
+    // Upload speeds are added to the history if one is given
+    WorkshopUploader(WorkshopBackend& backend, const UploadRetrySettings& settings, ThroughputHistory* history) : backend(backend), settings(settings), history(history), random(std::random_device()()) {}
+
+    bool Run(UploadQueue& queue)
     {
-        if (result->m_bUserNeedsToAcceptWorkshopLegalAgreement)
+        bool first_upload = true;
+        bool aborted = false;
+        while (!aborted)
         {
-            ConsolePrintf(RED, "Failed to upload map. User needs to agree to the workshop legal agreement\n");
-            CallbackFinished = Error = true;
-            return;
+            // Retries whose backoff has passed go before new maps. Until the next one is due, only a new map wakes this up
+            PendingUpload upload;
+            auto now = std::chrono::steady_clock::now();
+            auto retry = std::min_element(retries.begin(), retries.end(), [](const PendingUpload& a, const PendingUpload& b) { return a.retry_at < b.retry_at; });
+            std::chrono::milliseconds wait = std::chrono::hours(1);
+            if (retry != retries.end())
+                wait = std::chrono::ceil<std::chrono::milliseconds>(retry->retry_at - now);
+
+            if (retry != retries.end() && retry->retry_at <= now)
+            {
+                upload = *retry;
+                retries.erase(retry);
+            }
+            else if (const BSPFileInfo* info = queue.Pop(wait))
+                upload.info = info;
+            else if (queue.Drained() && retries.empty())
+                break;
+            else
+            {
+                if (queue.Drained())
+                    Sleep((DWORD)wait.count());
+
+                continue;
+            }
+
+            if (!first_upload)
+            {
+                for (int i = 5; i; i--)
+                {
+                    ConsolePrintf(WHITE, "Waiting a moment to avoid tripping spam filters (%d)...\r", i);
+                    Sleep(1000);
+                }
+
+                ConsolePrintf(WHITE, "                                                                                                  \r");
+            }
+
+            first_upload = false;
+            aborted = !Attempt(upload);
         }
 
-        if (error || result->m_eResult != k_EResultOK)
+        PrintSummary(aborted);
+        return !aborted && failures.empty();
+    }
+
+private:
+
+    struct PendingUpload
+    {
+        const BSPFileInfo* info = nullptr;
+        uint32 attempts = 0;
+        EResult result = k_EResultOK;
+        std::chrono::steady_clock::time_point retry_at;
+    };
+
+    static bool IsTransient(EResult result)
+    {
+        switch (result)
         {
-            ConsolePrintf(RED, "Failed to upload map. Result: %d\n", result->m_eResult);
-            CallbackFinished = Error = true;
-            return;
+            case k_EResultNoConnection:
+            case k_EResultBusy:
+            case k_EResultIOFailure:
+            case k_EResultTimeout:
+            case k_EResultServiceUnavailable:
+            case k_EResultLimitExceeded:
+            case k_EResultRemoteDisconnect:
+            case k_EResultTryAnotherCM:
+            case k_EResultRemoteCallFailed:
+            case k_EResultRateLimitExceeded:
+                return true;
+            default:
+                return false;
         }
+    }
+
+    // Returns false if nothing else can be uploaded either
+    bool Attempt(PendingUpload& upload)
+    {
+        const BSPFileInfo& info = *upload.info;
+        upload.attempts++;
+        ConsolePrintf(YELLOW, "Uploading %s (%llu)%s...\n", info.name.c_str(), info.workshop_id, upload.attempts > 1 ? " again" : "");
 
-        ConsolePrintf(AQUA, "Successfully uploaded %s (%llu)!                                                   \n", 
-            UploadList[Uploaded].name.c_str(), UploadList[Uploaded].workshop_id);
+        auto upload_start = std::chrono::steady_clock::now();
+        g_Metrics.SetStage(info.name, "uploading");
 
-        if (++Uploaded >= UploadList.size())
-            CallbackFinished = true;
-        else
+        UploadStatus status;
+        status.result = backend.StartUpload(info);
+        status.finished = status.result != k_EResultOK;
+        while (!status.finished)
         {
-            for (int i = 5; i; i--)
+            Sleep(100);
+            backend.PollUpload(status);
+            if (!status.finished && status.bytes_total)
             {
-                ConsolePrintf(WHITE, "Waiting a moment to avoid tripping spam filters (%d)...\r", i);
-                Sleep(1000);
+                ConsolePrintProgress(AQUA, status.bytes_uploaded, status.bytes_total);
+                g_Metrics.SetUploadProgress(status.bytes_uploaded);
             }
+        }
+
+        upload.result = status.result;
+        std::error_code ec;
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - upload_start).count();
+        if (status.result == k_EResultOK && !status.needs_legal_agreement)
+        {
+            ConsolePrintf(AQUA, "Successfully uploaded %s (%llu)!                                                   \n", info.name.c_str(), info.workshop_id);
+            uint64 bytes = std::filesystem::file_size(info.output_path, ec);
+            g_Metrics.AddUpload(bytes, seconds, false);
+            g_Metrics.SetStage(info.name, "uploaded", false);
+            if (history)
+                history->AddUpload(bytes, seconds);
+
+            g_Journal.Record(info.name, "uploaded", info.input_hash, OutputFingerprint(info.output_path));
+            uploaded.push_back(upload);
+            return true;
+        }
 
-            ConsolePrintf(WHITE, "                                                                                                  \r");
-            Upload(UploadList[Uploaded].details.m_nPublishedFileId);
+        // Every other upload would fail the same way
+        if (status.needs_legal_agreement)
+        {
+            ConsolePrintf(RED, "Failed to upload map. User needs to agree to the workshop legal agreement\n");
+            g_Metrics.AddUpload(0, seconds, true);
+            g_Metrics.SetStage(info.name, "upload_failed", false);
+            failures.push_back(upload);
+            return false;
+        }
+
+        if (IsTransient(status.result) && upload.attempts < settings.max_attempts)
+        {
+            // Exponential backoff with equal jitter, so retries of several maps don't line up
+            double delay = std::min(settings.max_delay_seconds, settings.base_delay_seconds * std::pow(2.0, upload.attempts - 1));
+            delay = delay / 2 + std::uniform_real_distribution<double>(0.0, delay / 2)(random);
+            upload.retry_at = std::chrono::steady_clock::now() + std::chrono::milliseconds((int64)(delay * 1000));
+
+            ConsolePrintf(YELLOW, "Failed to upload %s. Result: %d. Retrying in %.1f seconds (attempt %u of %u)          \n", info.name.c_str(), status.result, delay, upload.attempts, settings.max_attempts);
+            g_Metrics.SetUploadProgress(0);
+            g_Metrics.CountUploadRetry();
+            g_Metrics.SetStage(info.name, "upload_retry_wait");
+            retries.push_back(upload);
+            return true;
         }
+
+        ConsolePrintf(RED, "Failed to upload %s. Result: %d                                        \n", info.name.c_str(), status.result);
+        g_Metrics.AddUpload(0, seconds, true);
+        g_Metrics.SetStage(info.name, "upload_failed", false);
+        failures.push_back(upload);
+        return true;
     }
 
-    const AppId_t AppID = 440;
-    CSteamID UserSteamID;
-    AccountID_t UserAccountID = 0;
-    ISteamUser* SteamUserHandle = nullptr;
-    ISteamFriends* SteamFriendsHandle = nullptr;
-    ISteamUGC* SteamUGCHandle = nullptr;
+    void PrintSummary(bool aborted)
+    {
+        ConsolePrintf(WHITE, "\nUploaded %zu map(s), %zu failed\n", uploaded.size(), failures.size());
+        for (const PendingUpload& upload : uploaded)
+        {
+            if (upload.attempts > 1)
+                ConsolePrintf(AQUA, "    %s (%llu) after %u attempts\n", upload.info->name.c_str(), upload.info->workshop_id, upload.attempts);
+            else
+                ConsolePrintf(AQUA, "    %s (%llu)\n", upload.info->name.c_str(), upload.info->workshop_id);
+        }
 
-    SteamAPICall_t SteamAPICall = 0;
-    CCallResult<Steam, SteamUGCQueryCompleted_t> QueryCallback;
-    CCallResult<Steam, SubmitItemUpdateResult_t> UploadCallback;
-    std::vector<SteamUGCDetails_t> UGCFiles;
-    
-    UGCQueryHandle_t QueryHandle = 0;
-    uint32_t UGCItemsPage = 0;
+        for (const PendingUpload& upload : failures)
+            ConsolePrintf(RED, "    %s (%llu) failed after %u attempt(s). Result: %d\n", upload.info->name.c_str(), upload.info->workshop_id, upload.attempts, upload.result);
 
-    UGCUpdateHandle_t UploadHandle = 0;
-    size_t Uploaded = 0;
+        if (aborted)
+        {
+            for (const PendingUpload& upload : retries)
+                ConsolePrintf(RED, "    %s (%llu) was waiting to retry. Result: %d\n", upload.info->name.c_str(), upload.info->workshop_id, upload.result);
 
-    BSPInfoList UploadList;
-    bool CallbackFinished = false;
-    bool Error = false;
+            ConsolePrintf(RED, "Stopped uploading. The remaining maps were not uploaded\n");
+        }
+    }
+
+    WorkshopBackend& backend;
+    const UploadRetrySettings& settings;
+    ThroughputHistory* history;
+    std::mt19937 random;
+    std::vector<PendingUpload> retries;
+    std::vector<PendingUpload> uploaded;
+    std::vector<PendingUpload> failures;
 };
 
-int main()
+int main(int argc, char* argv[])
 {
     g_Console = GetStdHandle(STD_OUTPUT_HANDLE);
     if (!g_Console)
@@ -1228,9 +9128,72 @@ int main()
         return 0;
     }
 
+    // Get settings and maps from the config
+    Config config;
+    std::string fake_workshop_path;
+    std::string memory_profile_path;
+    for (int i = 1; i < argc; i++)
+    {
+        // Measures the disk instead of packing anything
+        if (!strcmp(argv[i], "--benchmark-io") && i + 1 < argc)
+        {
+            uint64 size_mb = i + 2 < argc ? std::strtoull(argv[i + 2], nullptr, 10) : 1024;
+            bool benchmarked = BenchmarkOutput(argv[i + 1], size_mb ? size_mb : 1024);
+            ConsoleWaitForKey();
+            return benchmarked ? 0 : 1;
+        }
+
+        // Checks the asset rule matcher instead of packing anything
+        if (!strcmp(argv[i], "--check-asset-rules"))
+        {
+            bool passed = CheckAssetFilter();
+            ConsoleWaitForKey();
+            return passed ? 0 : 1;
+        }
+
+        if (!strcmp(argv[i], "--resume"))
+            config.resume = true;
+        else if (!strcmp(argv[i], "--check-determinism"))
+            config.check_determinism = true;
+        else if (!strcmp(argv[i], "--plan"))
+            config.plan = true;
+        else if (!strcmp(argv[i], "--fake-workshop") && i + 1 < argc)
+            fake_workshop_path = argv[++i];
+        else if (!strcmp(argv[i], "--shard") && i + 1 < argc)
+        {
+            // Written as i/N, counting shards from 1
+            char trailing = 0;
+            if (sscanf(argv[++i], "%u/%u%c", &config.shard_index, &config.shard_count, &trailing) != 2 || !config.shard_index || config.shard_index > config.shard_count)
+            {
+                ConsolePrintf(RED, "--shard takes a shard and a shard count such as 2/4, not \"%s\"\n", argv[i]);
+                ConsoleWaitForKey();
+                return 1;
+            }
+        }
+        else if (!strcmp(argv[i], "merge"))
+            config.merge = true;
+        else if (!strcmp(argv[i], "--profile-memory"))
+        {
+            // Started right away so the config's allocations are counted too
+            if (i + 1 < argc && strncmp(argv[i + 1], "--", 2))
+                memory_profile_path = argv[++i];
+
+            g_AllocProfiler.Enable();
+        }
+        else
+            ConsolePrintf(YELLOW, "Ignoring unknown argument \"%s\"\n", argv[i]);
+    }
+
+    if (config.merge && config.shard_count)
+    {
+        ConsolePrintf(RED, "merge combines what every shard packed, so it can't be run as a shard itself\n");
+        ConsoleWaitForKey();
+        return 1;
+    }
+
     // Set up logging
     std::string logs_path = std::filesystem::current_path().string() + "\\logs\\";
-    if (!std::filesystem::is_directory(logs_path) && !std::filesystem::create_directory(logs_path))
+    if (!std::filesystem::create_directory(logs_path) && !std::filesystem::is_directory(logs_path))
     {
         ConsolePrintf(RED, "Failed to create a the directory %s\n", logs_path);
         return 0;
@@ -1239,16 +9202,17 @@ int main()
     time_t now = time(0);
     tm* localTime = localtime(&now);
     char timeString[80];
-    std::strftime(timeString, sizeof(timeString), "%Y%m%d_%H%M%S.txt", localTime);
-    log_stream.open(logs_path + timeString);
+    std::strftime(timeString, sizeof(timeString), "%Y%m%d_%H%M%S", localTime);
+
+    // Shards started side by side each keep a log and a journal of their own
+    std::string shard_suffix = config.shard_count ? "_shard_" + std::to_string(config.shard_index) : std::string();
+    log_stream.open(logs_path + timeString + shard_suffix + ".txt");
     if (log_stream.fail())
     {
         ConsolePrintf(RED, "Failed to create a log file %s\n", logs_path.c_str());
         return 0;
     }
 
-    // Get settings and maps from the config
-    Config config;
     BSPInfoList bsplist;
     if (!config.ParseConfig("config.json", bsplist))
     {
@@ -1257,26 +9221,32 @@ int main()
         return 1;
     }
 
-    ShellExecuteA(NULL, "open", config.base_output_path.c_str(), NULL, NULL, SW_SHOWDEFAULT);
-    
-    if (!config.upload_maps_to_workshop)
+    if (config.plan)
     {
+        g_AllocProfiler.Report(memory_profile_path);
+        ConsolePrintf(WHITE, "Nothing was packed or uploaded. Run without --plan to do so\n");
         ConsoleWaitForKey();
         return 0;
     }
-    
-    // Start the upload process
-    Steam* steam = new Steam();
-    while (true)
+
+    // Record finished stages, and pick up the ones a previous run finished when resuming
+    if (!g_Journal.Open(std::filesystem::current_path().string() + "\\journal" + shard_suffix + ".jsonl", config.resume))
     {
-        if (!steam->SteamInit())
-        {
-            ConsolePrintf(RED, "Failed to initialize a connection to Steam\n");
-            ConsolePrintf(WHITE, "Exiting.\n");
-            return 0;
-        }
+        ConsolePrintf(WHITE, "Exiting.\n");
+        ConsoleWaitForKey();
+        return 1;
+    }
+
+    config.StartMetrics();
 
-        BSPInfoList workshop_list;
+    // Connect to Steam and get every confirmation out of the way before packing starts
+    g_AllocProfiler.SetStage(PROFILE_STAGE_WORKSHOP_QUERY);
+    Steam* steam = nullptr;
+    FakeWorkshop fake_workshop;
+    WorkshopBackend* backend = nullptr;
+    if (config.upload_maps_to_workshop)
+    {
+        std::vector<BSPFileInfo*> workshop_list;
         for (BSPFileInfo& info : bsplist)
         {
             if (info.upload)
@@ -1288,28 +9258,90 @@ int main()
                     continue;
                 }
                 
-                workshop_list.push_back(info);
+                workshop_list.push_back(&info);
             }
         }
 
-        if (workshop_list.empty())
+        if (!fake_workshop_path.empty())
         {
-            ConsolePrintf(WHITE, "No maps were found to be uploaded to the workshop\n");
-            ConsolePrintf(WHITE, "Exiting.\n");
-            break;
-        }
+            // Nothing leaves the machine, so the maps are taken as they are
+            if (!fake_workshop.Load(fake_workshop_path))
+            {
+                ConsolePrintf(WHITE, "Exiting.\n");
+                return 0;
+            }
+
+            for (BSPFileInfo* info : workshop_list)
+                info->workshop.id = info->workshop_id;
 
-        if (!steam->FindUGCMaps(workshop_list) || !steam->UploadUGCMaps(workshop_list))
+            ConsolePrintf(YELLOW, "Uploading to a fake workshop from \"%s\"\n", fake_workshop_path.c_str());
+            backend = &fake_workshop;
+        }
+        else
         {
-            ConsolePrintf(WHITE, "Exiting.\n");
-            break;
+            steam = new Steam();
+            if (!steam->SteamInit())
+            {
+                ConsolePrintf(RED, "Failed to initialize a connection to Steam\n");
+                ConsolePrintf(WHITE, "Exiting.\n");
+                return 0;
+            }
+
+            if (workshop_list.empty())
+                ConsolePrintf(WHITE, "No maps were found to be uploaded to the workshop\n");
+            else if (!steam->FindUGCMaps(workshop_list) || !steam->ConfirmUpload())
+            {
+                ConsolePrintf(WHITE, "Exiting.\n");
+                SteamAPI_Shutdown();
+                delete steam;
+                return 0;
+            }
+            else
+                backend = steam;
         }
+    }
 
-        break;
+    // Pack on a separate thread, so each map can be uploaded while the ones after it are still packing
+    UploadQueue upload_queue;
+    bool packed = false;
+    g_AllocProfiler.SetStage(PROFILE_STAGE_PACKING);
+    std::thread packing_thread([&]()
+    {
+        packed = config.merge ? config.QueueShardOutputs(bsplist, backend ? &upload_queue : nullptr) : config.PackMaps(bsplist, backend ? &upload_queue : nullptr);
+        upload_queue.Close();
+    });
+
+    if (backend)
+    {
+        ConsolePrintf(WHITE, config.merge ? "\n> Uploading the shards' maps to the workshop...\n" : "\n> Uploading maps to the workshop as they finish packing...\n");
+        AllocationProfiler::Scope profile_scope(g_AllocProfiler, PROFILE_STAGE_UPLOADING);
+        WorkshopUploader uploader(*backend, config.upload_retry_settings, backend == steam ? &config.throughput : nullptr);
+        if (!uploader.Run(upload_queue))
+            ConsolePrintf(RED, "Not every map was uploaded. The remaining maps will still be packed\n");
     }
-    
-    SteamAPI_Shutdown();
-    delete steam;
+
+    packing_thread.join();
+    bool script_finished = backend != &fake_workshop || fake_workshop.CheckFinished();
+    g_AllocProfiler.SetStage(PROFILE_STAGE_FINISHING);
+    g_Metrics.Stop();
+    config.throughput.Save();
+    g_AllocProfiler.Report(memory_profile_path);
+
+    if (steam)
+    {
+        SteamAPI_Shutdown();
+        delete steam;
+    }
+
+    if (!packed || !script_finished)
+    {
+        ConsolePrintf(WHITE, "Exiting.\n");
+        ConsoleWaitForKey();
+        return 1;
+    }
+
+    ShellExecuteA(NULL, "open", config.base_output_path.c_str(), NULL, NULL, SW_SHOWDEFAULT);
+    ConsoleWaitForKey();
 
 	return 0;
 }